@@ -5,23 +5,8 @@ in vec3 worldNormal;
 in vec2 uv;
 
 
-uniform vec3 lightPosition;
-uniform vec3 lightIntensity;
-
-
-// Fog 
-const uniform vec3 fogColor = vec3(0.3, 0.3, 0.3);        
-uniform float fogStart = 200.0;       // Start distance for fog
-uniform float fogEnd = 300.0;         // End distance for fog
-uniform float fogDensity = 0.004f;
-uniform vec3 cameraPosition;  // Camera position
-
-// Sphere light uniforms
-uniform vec3 sphereLightPos;      
-uniform vec3 sphereLightColor;    
-uniform float sphereLightIntensity;
-
-uniform vec3 viewPos;
+// Lights, fog and camera position
+#include "frame_data.glsl"
 
 out vec3 finalColor;
 
@@ -51,7 +36,7 @@ void main()
     float diff = max(dot(norm, lightDir), 0.0);
     vec3 diffuse = sphereLightColor * diff * sphereLightIntensity;
 
-    vec3 viewDir = normalize(viewPos - worldPosition);
+    vec3 viewDir = normalize(cameraPosition - worldPosition);
     vec3 reflectDir = reflect(-lightDir, norm);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32.0); // Shininess factor is 32.0
     vec3 specular = vec3(1.0) * spec * sphereLightColor * sphereLightIntensity;
@@ -5,8 +5,10 @@
 layout(location = 0) in vec3 vertexPosition;
 layout(location = 1) in vec3 vertexNormal;
 layout(location = 2) in vec2 vertexUV;
-layout(location = 3) in vec4 vertexJointIndices;
-layout(location = 4) in vec4 vertexJointWeights;
+
+// Per instance, see MyModel::drawInstances
+layout(location = 5) in mat4 instanceModelMatrix;
+layout(location = 9) in mat3 instanceNormalMatrix;
 
 // Output data, to be interpolated for each fragment
 out vec3 worldNormal;
@@ -14,50 +16,26 @@ out vec3 worldPosition;
 out vec2 uv;
 
 
-uniform mat4 MVP;
+uniform mat4 viewProjection;
 uniform mat4 lightSpaceMatrix; // Light-space transformation matrix
 uniform mat4 model;       
-uniform mat4 modelMatrix;
-uniform mat3 normalMatrix;
-
 
-uniform mat4 jointMatrices[70];
-uniform bool useSkinning;  
 
 void main() {
-    vec3 transformNormal;
-    vec4 transformPosition;
-
-    if (useSkinning) {
-        // Skinning logic
-        transformNormal = vec3(0.0);
-        transformPosition = vec4(0.0);
-        
-        for (int j = 0; j < 6; j++) { // GLTF typically supports up to 4 weights per vertex
-            int jointIndex = int(vertexJointIndices[j]);
-            float weight = vertexJointWeights[j];
-
-            transformPosition += weight * (jointMatrices[jointIndex] * vec4(vertexPosition, 1.0));
-            transformNormal += weight * mat3(jointMatrices[jointIndex]) * vertexNormal;
-        }
-
-        // Normalize the normal vector
-        transformNormal = normalize(transformNormal);
-
-    } else {
-        // No skinning: Direct transformation
-        transformPosition = vec4(vertexPosition, 1.0);
-        transformNormal = vertexNormal;
-    }
+    // Skinned models are posed by the skinning pre-pass (skin.vert),
+    // so the vertices arriving here are final
+    vec4 transformPosition = vec4(vertexPosition, 1.0);
+    vec3 transformNormal = vertexNormal;
 
     // Transform vertex
-    gl_Position =  MVP * transformPosition;
+    vec4 world = instanceModelMatrix * transformPosition;
+    gl_Position =  viewProjection * world;
 
     // World-space geometry 
     //worldPosition = (model * vec4(vertexPosition, 1.0)).xyz; // OLD AND WORKING
     //worldNormal = vertexNormal;   // OLD AND WORKING
-    worldPosition = vec3(modelMatrix * vec4(vertexPosition, 1.0));
-    worldNormal = normalMatrix * vertexNormal; // ADDED NEW FOR BUILDING GLOW 
+    worldPosition = world.xyz;
+    worldNormal = instanceNormalMatrix * transformNormal; // ADDED NEW FOR BUILDING GLOW 
 
     uv = vertexUV;
 
@@ -0,0 +1,18 @@
+#version 330 core
+// Reduces the full resolution scene depth to the low resolution rain target.
+// Keeps the farthest depth of each block so rain is not lost along silhouettes;
+// the composite pass rejects samples that do not belong to the full-res pixel.
+uniform sampler2D sceneDepth;
+uniform int factor;
+
+void main() {
+    ivec2 base = ivec2(gl_FragCoord.xy) * factor;
+    ivec2 size = textureSize(sceneDepth, 0) - 1;
+    float depth = 0.0;
+    for (int y = 0; y < factor; y++) {
+        for (int x = 0; x < factor; x++) {
+            depth = max(depth, texelFetch(sceneDepth, min(base + ivec2(x, y), size), 0).r);
+        }
+    }
+    gl_FragDepth = depth;
+}
@@ -0,0 +1,17 @@
+// frame_data.glsl
+// Per-frame inputs shared by every lit pass, see FrameData in lab2_skybox.cpp.
+// Filled once per frame with a single glBufferSubData and bound at uniform
+// buffer binding 0. std140: each vec3 shares its 16 bytes with the float after it.
+layout(std140) uniform FrameData {
+	vec3 cameraPosition;
+	float sphereLightIntensity;
+	vec3 sphereLightPos;
+	float fogDensity;
+	vec3 sphereLightColor;
+	float fogStart;
+	vec3 lightPosition;
+	float fogEnd;
+	vec3 lightIntensity;
+	float time;
+	vec3 fogColor;
+};
@@ -11,20 +11,8 @@ in vec2 uv;
 uniform sampler2D textureSampler;
 
 
-// FOG
-const uniform vec3 fogColor = vec3(0.3, 0.3, 0.3);        
-uniform float fogStart = 200.0;       // Start distance for fog
-uniform float fogEnd = 300.0;         // End distance for fog
-uniform float fogDensity = 0.004f;
-uniform vec3 cameraPosition;  // Camera position
-
-
-// Sphere light uniforms
-uniform vec3 sphereLightPos;      
-uniform vec3 sphereLightColor;    
-uniform float sphereLightIntensity;
-
-uniform vec3 viewPos;
+// Lights, fog and camera position
+#include "frame_data.glsl"
 
 out vec3 finalColor;
 
@@ -44,7 +32,7 @@ void main()
     vec3 diffuse = textureColor * sphereLightColor * diff * sphereLightIntensity;
 
     // Specular lighting
-    vec3 viewDir = normalize(viewPos - worldPosition);
+    vec3 viewDir = normalize(cameraPosition - worldPosition);
     vec3 reflectDir = reflect(-lightDir, norm);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32.0); // Shininess factor is 32.0
     vec3 specular = vec3(1.0) * spec * sphereLightColor * sphereLightIntensity;
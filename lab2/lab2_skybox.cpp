@@ -11,17 +11,30 @@
 #include <tiny_gltf.h>
 
 #include <render/shader.h>
+#include <render/simd.h>
+#include <render/worker_pool.h>
+#include <render/particles.h>
+#include <render/animation.h>
+#include <render/animation_batch.h>
+#include <render/texture_loader.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb/stb_image.h>
 
 #include <vector>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
 #include <iostream>
+#include <iomanip>
 #define _USE_MATH_DEFINES
 #include <math.h>
 
 #include <cstdlib> // for rand() and seeding random numbers for building sizes
 #include <ctime>
+#include <cstdint>
+#include <cstddef>
+#include <cfloat>
 
 #define BUFFER_OFFSET(i) ((char *)NULL + (i))
 
@@ -73,38 +86,118 @@ static float depthFar = 1500.0f;
 
 // SPHERE
 GLuint sphereVAO, sphereVBO, sphereEBO;
-GLuint sphereProgramID; // Shader program for the sphere
+ShaderProgram sphereProgram; // Shader program for the sphere
+Uniform<glm::mat4> sphereMVPUniform;
+Uniform<glm::vec3> sphereColorUniform;
+Uniform<float> sphereIntensityUniform;
 glm::vec3 sphereLightPos(0.0f, 15.0f, 60.0f);  // Initial position
 glm::vec3 sphereLightColor(0.7f, 0.0f, 0.0f);  // Purple light color
 float sphereLightIntensity = 2.0f;             // Light intensity
 
+// FRAME DATA
+// Mirror of the std140 FrameData block in frame_data.glsl: a vec3 and the
+// float after it fill one 16 byte slot
+struct FrameData {
+	glm::vec3 cameraPosition;
+	float sphereLightIntensity;
+	glm::vec3 sphereLightPos;
+	float fogDensity;
+	glm::vec3 sphereLightColor;
+	float fogStart;
+	glm::vec3 lightPosition;
+	float fogEnd;
+	glm::vec3 lightIntensity;
+	float time;
+	glm::vec3 fogColor;
+	float padding;
+};
+static_assert(sizeof(FrameData) == 96, "FrameData must match the std140 layout of frame_data.glsl");
+
+// Uniform buffer behind FrameData, shared by every program that declares the block
+struct FrameUniformBuffer {
+	GLuint bufferID = 0;
+
+	void initialize() {
+		glGenBuffers(1, &bufferID);
+		glBindBuffer(GL_UNIFORM_BUFFER, bufferID);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), nullptr, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, kFrameDataBinding, bufferID);
+	}
+
+	void update(const FrameData &data) {
+		glBindBuffer(GL_UNIFORM_BUFFER, bufferID);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &data);
+	}
+
+	void cleanup() {
+		glDeleteBuffers(1, &bufferID);
+	}
+};
+
+// RAIN
+enum RainMode {
+	RAIN_CPU,			// Drops simulated on the CPU, endpoints streamed into the VBO every frame
+	RAIN_STATELESS,		// Drops derived in rain.vert from gl_VertexID and time, no per-frame CPU work
+	RAIN_SIMD,			// SoA drops updated by an SSE kernel across the worker pool, written into the mapped VBO
+	RAIN_TRANSFORM_FEEDBACK,	// Drops simulated by the particle engine on the GPU, with ground splashes
+	RAIN_MODE_COUNT
+};
+static RainMode rainMode = RAIN_STATELESS;	// G cycles through the rain modes
+
+// The rain volume follows the camera, so quality trades volume size for drop count
+// while the density around the viewer stays fixed
+static const float rainDensity = 0.03f;	// Drops per cubic unit, the volume is 100 units tall
+enum RainQuality {
+	RAIN_QUALITY_LOW,
+	RAIN_QUALITY_MEDIUM,
+	RAIN_QUALITY_HIGH,
+	RAIN_QUALITY_ULTRA
+};
+struct RainQualityLevel {
+	const char *name;
+	float extent;		// Half size of the volume in x and z
+};
+static const RainQualityLevel rainQualityLevels[] = {
+	{ "low", 25.0f },		// 7.5k drops
+	{ "medium", 45.0f },	// 24k drops
+	{ "high", 80.0f },		// 77k drops
+	{ "ultra", 160.0f },	// 307k drops
+};
+static RainQuality rainQuality = RAIN_QUALITY_HIGH;
+static int rainResolutionDivisor = 1;		// H cycles full, half and quarter resolution rain
+
+// Skinned instances read pre-baked clips instead of per-frame palettes, toggled with B
+static bool bakedAnimation = false;
+
+// Set by N, runs the animation batch benchmark once from the main loop
+static bool animationBenchmarkRequested = false;
+
+// Set by M, times the SoA rain path on a million drops once from the main loop
+static bool rainBenchmarkRequested = false;
+
+// Reuse linked shader programs from earlier runs; off compiles every program from source
+static bool programBinaryCache = true;
+
+// Signs on the ring around the scene, besides the one by the start; all of them take one draw call
+static int signRingCount = 36;
+
+// GPU memory for texture levels (the 128 texel ones load regardless), T cycles it down to 1 MB and back
+static int textureBudgetMegabytes = 64;
 
 
+// Decodes on the worker pool and streams the pixels in over the next frames,
+// started by main before anything loads a texture
+static TextureLoader textureLoader;
+
+// The texture is usable right away, it samples as a grey placeholder until the image is in
 static GLuint LoadTextureTileBox(const char *texture_file_path, GLenum wrapS, GLenum wrapT) {
-    int w, h, channels;
-    uint8_t* img = stbi_load(texture_file_path, &w, &h, &channels, 3);
-    GLuint texture;
-    glGenTextures(1, &texture);  
-    glBindTexture(GL_TEXTURE_2D, texture);  
-
-    // Set the wrapping mode
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS);	
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT);
-
-    // Set filtering modes
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    if (img) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, img);
-        glGenerateMipmap(GL_TEXTURE_2D);
-		std::cout << "Texture loaded successfully: " << texture_file_path << std::endl;
-    } else {
-        std::cout << "Failed to load texture " << texture_file_path << std::endl;
-    }
-    stbi_image_free(img);
+	return textureLoader.load(texture_file_path, wrapS, wrapT);
+}
 
-    return texture;
+// Pixels an object 'worldSize' across covers on screen at 'distance' from the camera, for texture detail requests
+static float ScreenSize(float worldSize, float distance) {
+	float focalPixels = windowHeight * 0.5f / tan(glm::radians(FoV) * 0.5f);
+	return worldSize * focalPixels / std::max(distance, zNear);
 }
 
 // Generating my sphere
@@ -182,11 +275,14 @@ void setupSphere(float radius) {
     glBindVertexArray(0);
 
     // Load shaders for the sphere
-    sphereProgramID = LoadShadersFromFile("../lab2/sphere.vert", "../lab2/sphere.frag");
+    sphereProgram = LoadShadersFromFile("../lab2/sphere.vert", "../lab2/sphere.frag");
+    sphereMVPUniform = sphereProgram.uniform<glm::mat4>("MVP");
+    sphereColorUniform = sphereProgram.uniform<glm::vec3>("lightColor");
+    sphereIntensityUniform = sphereProgram.uniform<float>("intensity");
 }
 
 void renderSphere(glm::mat4 vp, glm::vec3 position, glm::vec3 color, float intensity) {
-    glUseProgram(sphereProgramID);
+    glUseProgram(sphereProgram);
 
     glm::mat4 model = glm::mat4(1.0f);
     model = glm::translate(model, position);
@@ -194,9 +290,9 @@ void renderSphere(glm::mat4 vp, glm::vec3 position, glm::vec3 color, float inten
 
     glm::mat4 mvp = vp * model;
 
-    glUniformMatrix4fv(glGetUniformLocation(sphereProgramID, "MVP"), 1, GL_FALSE, &mvp[0][0]);
-    glUniform3fv(glGetUniformLocation(sphereProgramID, "lightColor"), 1, glm::value_ptr(color));
-    glUniform1f(glGetUniformLocation(sphereProgramID, "intensity"), intensity);
+    sphereProgram.setUniform(sphereMVPUniform, mvp);
+    sphereProgram.setUniform(sphereColorUniform, color);
+    sphereProgram.setUniform(sphereIntensityUniform, intensity);
 
     glBindVertexArray(sphereVAO);
     glDrawElements(GL_TRIANGLES, 50 * 50 * 6, GL_UNSIGNED_INT, 0); // Adjust based on segments
@@ -211,20 +307,326 @@ struct RainParticle {
 	float length;
 };
 
+#ifdef RENDER_SSE
+// SSE2 has no floor instruction: truncate, then step down where truncation rounded up
+static inline __m128 floorSSE(__m128 x) {
+	__m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+	return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, x), _mm_set1_ps(1.0f)));
+}
+#endif
+
+// Small per-chunk generator so respawns never contend on libc rand() state
+struct XorShiftRandom {
+	uint32_t state;
+
+	explicit XorShiftRandom(uint32_t seed = 2463534242u) : state(seed ? seed : 2463534242u) {}
+
+	uint32_t next() {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	// Uniform in [0, 1)
+	float next01() {
+		return (next() >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+// Structure-of-arrays drop storage for the SIMD path. All arrays share one
+// allocation and each starts on a 16-byte boundary; count is padded to 4.
+struct RainParticlesSoA {
+	std::vector<float> storage;
+	float *posX, *posY, *posZ;
+	float *velX, *velY, *velZ;
+	float *tailX, *tailY, *tailZ;	// Normalized velocity * length, fixed until respawn
+	size_t count = 0;
+
+	void allocate(size_t particleCount) {
+		count = (particleCount + 3) & ~size_t(3);
+		storage.assign(count * 9 + 4, 0.0f);
+
+		float *base = storage.data();
+		while (reinterpret_cast<uintptr_t>(base) & 15) base++;
+
+		float **arrays[9] = { &posX, &posY, &posZ, &velX, &velY, &velZ, &tailX, &tailY, &tailZ };
+		for (int i = 0; i < 9; i++) {
+			*arrays[i] = base + i * count;
+		}
+	}
+};
+
+// Top-down height field of the static scene, rasterized once at load. Rain and
+// particles use it to find the roof under any (x, z) with a single lookup.
+struct HeightField {
+	int resolution = 256;
+	glm::vec2 minXZ = glm::vec2(-300.0f);	// Covers the ground quad
+	glm::vec2 maxXZ = glm::vec2(300.0f);
+	float bottom = 0.0f;					// Ground level, also the value where nothing was drawn
+	float top = 400.0f;
+
+	std::vector<float> heights;				// CPU copy, row-major in z then x
+	GLuint textureID = 0;					// Same heights as GL_R32F for the GPU paths
+
+	// Render the occluders with an orthographic camera looking straight down and
+	// turn the depth buffer into heights
+	void build(const std::function<void(const glm::mat4 &)> &drawOccluders) {
+		glm::vec2 size = maxXZ - minXZ;
+
+		// x -> clip x, z -> clip y, higher y -> smaller depth
+		glm::mat4 topDown(0.0f);
+		topDown[0][0] = 2.0f / size.x;
+		topDown[2][1] = 2.0f / size.y;
+		topDown[1][2] = -2.0f / (top - bottom);
+		topDown[3][0] = -1.0f - 2.0f * minXZ.x / size.x;
+		topDown[3][1] = -1.0f - 2.0f * minXZ.y / size.y;
+		topDown[3][2] = 2.0f * top / (top - bottom) - 1.0f;
+		topDown[3][3] = 1.0f;
+
+		GLint previousFramebuffer;
+		glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+
+		GLuint fbo, depthTexture;
+		glGenTextures(1, &depthTexture);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, resolution, resolution, 0,
+			GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			std::cerr << "Height field framebuffer incomplete." << std::endl;
+		}
+
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		glViewport(0, 0, resolution, resolution);
+		glClearDepth(1.0);
+		glClear(GL_DEPTH_BUFFER_BIT);
+
+		// The top-down projection flips handedness, so draw both faces
+		GLboolean cullFace = glIsEnabled(GL_CULL_FACE);
+		glDisable(GL_CULL_FACE);
+		drawOccluders(topDown);
+		if (cullFace) glEnable(GL_CULL_FACE);
+
+		std::vector<float> depths(resolution * resolution);
+		glReadPixels(0, 0, resolution, resolution, GL_DEPTH_COMPONENT, GL_FLOAT, depths.data());
+
+		heights.resize(depths.size());
+		float highest = bottom;
+		for (size_t i = 0; i < depths.size(); i++) {
+			heights[i] = top - depths[i] * (top - bottom);
+			highest = std::max(highest, heights[i]);
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &depthTexture);
+
+		glGenTextures(1, &textureID);
+		glBindTexture(GL_TEXTURE_2D, textureID);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, resolution, resolution, 0, GL_RED, GL_FLOAT, heights.data());
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		std::cout << "Height field built: " << resolution << "x" << resolution
+			<< ", highest roof " << highest << std::endl;
+	}
+
+	// Roof height under (x, z); ground level outside the covered area
+	float heightAt(float x, float z) const {
+		if (heights.empty()) return bottom;
+		int i = int((x - minXZ.x) / (maxXZ.x - minXZ.x) * resolution);
+		int j = int((z - minXZ.y) / (maxXZ.y - minXZ.y) * resolution);
+		if (i < 0 || j < 0 || i >= resolution || j >= resolution) return bottom;
+		return heights[j * resolution + i];
+	}
+
+	// uv = xz * transform.xy + transform.zw, for texture lookups in shaders
+	glm::vec4 uvTransform() const {
+		glm::vec2 scale = 1.0f / (maxXZ - minXZ);
+		return glm::vec4(scale, -minXZ * scale);
+	}
+
+	void cleanup() {
+		glDeleteTextures(1, &textureID);
+	}
+};
+
 class RainSystem {
 private:
     std::vector<RainParticle> particles;
     GLuint VAO, VBO;
+	GLuint statelessVAO;		// Empty VAO, stateless drops have no vertex attributes
 	GLuint programID;
     GLuint vpMatrixID;
-    const int MAX_PARTICLES = 10000;
+	GLuint statelessID, timeID, seedID, spawnHeightID, anchorID, extentID, speedRangeID;
+	GLuint heightFieldID, heightFieldTransformID;
+	int particleCount = 0;		// Set from the quality level, shared by every mode
     float spawnHeight = 100.0f;
-    float spawnArea = 200.0f;  
+	float extent = 80.0f;		// Half size of the rain volume around the anchor, in x and z
+	float frustumBias = 0.6f;	// How far ahead of the eye the volume is centred, as a fraction of extent
+	float eyeClearance = 20.0f;	// How far the top of the volume stays above the eye
+	glm::vec3 anchor = glm::vec3(0.0f);	// Centre of the volume in x and z, its bottom in y
+	const HeightField *heightField = nullptr;	// Roofs that stop drops
 	float minSpeed = 20.0f;          
     float maxSpeed = 30.0f;       
+	unsigned int seed = 1337u;
+	float elapsed = 0.0f;
+	RainMode mode = RAIN_CPU;
+
+	// SIMD path
+	GLuint simdVAO, simdVBO;
+	RainParticlesSoA soa;
+	std::vector<XorShiftRandom> chunkRandoms;
+	WorkerPool *workerPool = nullptr;
+
+	// Transform feedback path, owned by the particle engine
+	ParticleSystem *gpuRain = nullptr;
+
+	// Toroidal wrap of an offset from the anchor into [-extent, extent)
+	float wrapOffset(float offset) const {
+		return offset - 2.0f * extent * std::floor((offset + extent) / (2.0f * extent));
+	}
+
+	void resetParticleSoA(size_t i, float startHeight, XorShiftRandom &random) {
+		soa.posX[i] = anchor.x + (random.next01() * 2.0f - 1.0f) * extent;
+		soa.posY[i] = startHeight;
+		soa.posZ[i] = anchor.z + (random.next01() * 2.0f - 1.0f) * extent;
+
+		float speed = minSpeed + random.next01() * (maxSpeed - minSpeed);
+		float vx = random.next01() - 0.5f;
+		float vz = random.next01() - 0.5f;
+		soa.velX[i] = vx;
+		soa.velY[i] = -speed;
+		soa.velZ[i] = vz;
+
+		// Direction only changes on respawn, so the normalize happens here instead of per frame
+		float length = 0.5f + random.next01();
+		float scale = length / std::sqrt(vx * vx + speed * speed + vz * vz);
+		soa.tailX[i] = vx * scale;
+		soa.tailY[i] = -speed * scale;
+		soa.tailZ[i] = vz * scale;
+	}
+
+	// Advance drops [begin, end) and write both line endpoints of each into out (6 floats per drop)
+	void updateRangeSoA(size_t begin, size_t end, float deltaTime, XorShiftRandom &random, float *out) {
+		size_t i = begin;
+#ifdef RENDER_SSE
+		const __m128 dt = _mm_set1_ps(deltaTime);
+		const __m128 bottom = _mm_set1_ps(anchor.y);
+		const __m128 anchorX = _mm_set1_ps(anchor.x);
+		const __m128 anchorZ = _mm_set1_ps(anchor.z);
+		const __m128 halfSize = _mm_set1_ps(extent);
+		const __m128 size = _mm_set1_ps(2.0f * extent);
+		const __m128 invSize = _mm_set1_ps(0.5f / extent);
+		for (; i + 4 <= end; i += 4) {
+			__m128 px = _mm_add_ps(_mm_load_ps(soa.posX + i), _mm_mul_ps(_mm_load_ps(soa.velX + i), dt));
+			__m128 py = _mm_add_ps(_mm_load_ps(soa.posY + i), _mm_mul_ps(_mm_load_ps(soa.velY + i), dt));
+			__m128 pz = _mm_add_ps(_mm_load_ps(soa.posZ + i), _mm_mul_ps(_mm_load_ps(soa.velZ + i), dt));
+
+			// Wrap x and z around the anchor so the volume follows the camera
+			__m128 dx = _mm_sub_ps(px, anchorX);
+			__m128 dz = _mm_sub_ps(pz, anchorZ);
+			px = _mm_sub_ps(px, _mm_mul_ps(size, floorSSE(_mm_mul_ps(_mm_add_ps(dx, halfSize), invSize))));
+			pz = _mm_sub_ps(pz, _mm_mul_ps(size, floorSSE(_mm_mul_ps(_mm_add_ps(dz, halfSize), invSize))));
+
+			_mm_store_ps(soa.posX + i, px);
+			_mm_store_ps(soa.posY + i, py);
+			_mm_store_ps(soa.posZ + i, pz);
+
+			// Drops die on the roof below them or at the bottom of the volume, one height field lookup each
+			__m128 roof = _mm_set_ps(
+				heightField->heightAt(soa.posX[i + 3], soa.posZ[i + 3]),
+				heightField->heightAt(soa.posX[i + 2], soa.posZ[i + 2]),
+				heightField->heightAt(soa.posX[i + 1], soa.posZ[i + 1]),
+				heightField->heightAt(soa.posX[i], soa.posZ[i]));
+			int fallen = _mm_movemask_ps(_mm_cmplt_ps(py, _mm_max_ps(roof, bottom)));
+			if (fallen) {
+				for (int lane = 0; lane < 4; lane++) {
+					if (fallen & (1 << lane)) resetParticleSoA(i + lane, anchor.y + spawnHeight, random);
+				}
+				px = _mm_load_ps(soa.posX + i);
+				py = _mm_load_ps(soa.posY + i);
+				pz = _mm_load_ps(soa.posZ + i);
+			}
+
+			__m128 ex = _mm_add_ps(px, _mm_load_ps(soa.tailX + i));
+			__m128 ey = _mm_add_ps(py, _mm_load_ps(soa.tailY + i));
+			__m128 ez = _mm_add_ps(pz, _mm_load_ps(soa.tailZ + i));
+
+			// Transpose to per-drop rows: {px py pz ex} and {ey ez - -}
+			__m128 head0 = px, head1 = py, head2 = pz, head3 = ex;
+			_MM_TRANSPOSE4_PS(head0, head1, head2, head3);
+			__m128 tail0 = ey, tail1 = ez, tail2 = _mm_setzero_ps(), tail3 = _mm_setzero_ps();
+			_MM_TRANSPOSE4_PS(tail0, tail1, tail2, tail3);
+
+			float *dst = out + i * 6;
+			_mm_storeu_ps(dst + 0, head0);  _mm_storel_pi((__m64 *)(dst + 4), tail0);
+			_mm_storeu_ps(dst + 6, head1);  _mm_storel_pi((__m64 *)(dst + 10), tail1);
+			_mm_storeu_ps(dst + 12, head2); _mm_storel_pi((__m64 *)(dst + 16), tail2);
+			_mm_storeu_ps(dst + 18, head3); _mm_storel_pi((__m64 *)(dst + 22), tail3);
+		}
+#endif
+		for (; i < end; i++) {
+			soa.posX[i] += soa.velX[i] * deltaTime;
+			soa.posY[i] += soa.velY[i] * deltaTime;
+			soa.posZ[i] += soa.velZ[i] * deltaTime;
+			soa.posX[i] = anchor.x + wrapOffset(soa.posX[i] - anchor.x);
+			soa.posZ[i] = anchor.z + wrapOffset(soa.posZ[i] - anchor.z);
+			if (soa.posY[i] < std::max(anchor.y, heightField->heightAt(soa.posX[i], soa.posZ[i]))) {
+				resetParticleSoA(i, anchor.y + spawnHeight, random);
+			}
+
+			float *dst = out + i * 6;
+			dst[0] = soa.posX[i];
+			dst[1] = soa.posY[i];
+			dst[2] = soa.posZ[i];
+			dst[3] = soa.posX[i] + soa.tailX[i];
+			dst[4] = soa.posY[i] + soa.tailY[i];
+			dst[5] = soa.posZ[i] + soa.tailZ[i];
+		}
+	}
+
+	void updateSoA(float deltaTime) {
+		size_t bytes = soa.count * 6 * sizeof(float);
+		glBindBuffer(GL_ARRAY_BUFFER, simdVBO);
+		float *out = (float *)glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (!out) return;
+
+		workerPool->parallelFor(soa.count, 4, [&](size_t begin, size_t end, unsigned int chunk) {
+			updateRangeSoA(begin, end, deltaTime, chunkRandoms[chunk], out);
+		});
+
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	}
     
 public:
-	void initialize() {
+	void initialize(RainMode initialMode, RainQuality quality, WorkerPool *pool, ParticleEngine *particleEngine,
+		const HeightField *roofs) {
+		mode = initialMode;
+		workerPool = pool;
+		heightField = roofs;
+
+		// Same drops per unit volume at any quality, only the volume around the camera changes
+		const RainQualityLevel &level = rainQualityLevels[quality];
+		extent = level.extent;
+		particleCount = int(rainDensity * (2.0f * extent) * (2.0f * extent) * spawnHeight);
+		std::cout << "Rain quality " << level.name << ": " << particleCount << " drops in a "
+			<< 2.0f * extent << " x " << 2.0f * extent << " volume" << std::endl;
+
         programID = LoadShadersFromFile("../lab2/rain.vert", "../lab2/rain.frag");
         if (programID == 0) {
             std::cerr << "Failed to load rain shaders." << std::endl;
@@ -232,8 +634,17 @@ public:
         }
 
 		vpMatrixID = glGetUniformLocation(programID, "VP");
-
-		for(int i = 0; i < MAX_PARTICLES; i++) {
+		statelessID = glGetUniformLocation(programID, "statelessRain");
+		timeID = glGetUniformLocation(programID, "time");
+		seedID = glGetUniformLocation(programID, "seed");
+		spawnHeightID = glGetUniformLocation(programID, "spawnHeight");
+		anchorID = glGetUniformLocation(programID, "anchor");
+		extentID = glGetUniformLocation(programID, "extent");
+		speedRangeID = glGetUniformLocation(programID, "speedRange");
+		heightFieldID = glGetUniformLocation(programID, "heightField");
+		heightFieldTransformID = glGetUniformLocation(programID, "heightFieldTransform");
+
+		for(int i = 0; i < particleCount; i++) {
 				RainParticle particle;
 				resetParticle(particle, ((rand() % 1000) / 1000.0f) * spawnHeight);
             	particles.push_back(particle);
@@ -242,10 +653,10 @@ public:
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
 
-		std::vector<glm::vec3> vertices(MAX_PARTICLES * 2);
+		std::vector<glm::vec3> vertices(particleCount * 2);
         
         //std::vector<glm::vec3> vertices;
-        //for(int i = 0; i < MAX_PARTICLES; i++) {
+        //for(int i = 0; i < particleCount; i++) {
         //    vertices.push_back(particles[i].position);
         //}
         
@@ -255,11 +666,125 @@ public:
         
         glEnableVertexAttribArray(0);
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+
+		// Core profile still needs a VAO bound to draw, even with no attributes
+		glGenVertexArrays(1, &statelessVAO);
+
+		// SIMD path: one generator per worker chunk, drops start at random heights
+		chunkRandoms.clear();
+		for (unsigned int i = 0; i < workerPool->chunkCount(); i++) {
+			chunkRandoms.push_back(XorShiftRandom(seed * 747796405u + i * 2891336453u));
+		}
+		soa.allocate(particleCount);
+		for (size_t i = 0; i < soa.count; i++) {
+			resetParticleSoA(i, chunkRandoms[0].next01() * spawnHeight, chunkRandoms[0]);
+		}
+
+		glGenVertexArrays(1, &simdVAO);
+		glGenBuffers(1, &simdVBO);
+		glBindVertexArray(simdVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, simdVBO);
+		glBufferData(GL_ARRAY_BUFFER, soa.count * 6 * sizeof(float), nullptr, GL_STREAM_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+
+		glBindVertexArray(0);
+
+		// Transform feedback path: the same drops as an emitter, splashing on the ground
+		ParticleEmitterDesc rainDesc;
+		rainDesc.maxParticles = particleCount;
+		rainDesc.spawnMin = glm::vec3(-extent, spawnHeight, -extent);
+		rainDesc.spawnMax = glm::vec3(extent, spawnHeight, extent);
+		rainDesc.wrapExtent = glm::vec2(extent);
+		rainDesc.velocityMin = glm::vec3(-0.5f, -maxSpeed, -0.5f);
+		rainDesc.velocityMax = glm::vec3(0.5f, -minSpeed, 0.5f);
+		rainDesc.lifetime = glm::vec2(1000.0f);		// Drops only die on impact
+		rainDesc.collide = true;
+		rainDesc.collisionHeight = 0.0f;
+		rainDesc.heightFieldTexture = heightField->textureID;
+		rainDesc.heightFieldTransform = heightField->uvTransform();
+		rainDesc.shape = PARTICLE_STREAK;
+		rainDesc.streakLength = glm::vec2(0.5f, 1.5f);
+		rainDesc.color = glm::vec4(0.6f, 0.9f, 0.6f, 0.3f);
+		gpuRain = particleEngine->createSystem(rainDesc);
+
+		ParticleBurstDesc splash;
+		splash.burstCount = 3;
+		splash.lifetime = 0.25f;
+		splash.speed = 2.5f;
+		splash.pointSize = 2.0f;
+		splash.color = glm::vec4(0.7f, 0.9f, 0.8f, 0.5f);
+		gpuRain->setCollisionBurst(splash);
+		gpuRain->enabled = (mode == RAIN_TRANSFORM_FEEDBACK);
     }
+
+	// Centre the rain volume a little ahead of the eye so most drops land inside the view.
+	// It rests on the ground until the eye climbs near its top, then rises with the eye.
+	void setViewer(const glm::vec3 &eye, const glm::vec3 &forward) {
+		glm::vec3 ahead(forward.x, 0.0f, forward.z);
+		float length = glm::length(ahead);
+		if (length > 1e-4f) ahead /= length;
+
+		float bottom = std::max(0.0f, eye.y + eyeClearance - spawnHeight);
+		anchor = glm::vec3(eye.x, bottom, eye.z) + ahead * (frustumBias * extent);
+		if (gpuRain) gpuRain->origin = anchor;
+	}
+
+	// Times the SoA update on 'dropCount' drops at the usual density, on the
+	// calling thread and across the pool, and prints ms per 60 Hz frame. The
+	// endpoints go to system memory, so the VBO upload is not included.
+	// Triggered with M.
+	void benchmarkSoA(size_t dropCount, int frames) {
+		RainParticlesSoA live;
+		std::swap(live, soa);
+		float liveExtent = extent;
+		extent = 0.5f * std::sqrt(dropCount / (rainDensity * spawnHeight));
+
+		soa.allocate(dropCount);
+		for (size_t i = 0; i < soa.count; i++) {
+			resetParticleSoA(i, chunkRandoms[0].next01() * spawnHeight, chunkRandoms[0]);
+		}
+		std::vector<float> out(soa.count * 6);
+		const float deltaTime = 1.0f / 60.0f;
+
+		const char *modes[] = { "sse", "sse + pool" };
+#ifndef RENDER_SSE
+		modes[0] = "scalar";
+		modes[1] = "scalar + pool";
+#endif
+		for (int mode = 0; mode < 2; mode++) {
+			double start = glfwGetTime();
+			for (int frame = 0; frame < frames; frame++) {
+				if (mode == 0) {
+					updateRangeSoA(0, soa.count, deltaTime, chunkRandoms[0], out.data());
+				} else {
+					workerPool->parallelFor(soa.count, 4, [&](size_t begin, size_t end, unsigned int chunk) {
+						updateRangeSoA(begin, end, deltaTime, chunkRandoms[chunk], out.data());
+					});
+				}
+			}
+			double ms = (glfwGetTime() - start) * 1000.0 / frames;
+			std::cout << "Rain " << soa.count << " drops, " << std::setw(13) << modes[mode] << ": "
+				<< std::fixed << std::setprecision(2) << ms << " ms/frame over " << frames << " frames ("
+				<< workerPool->chunkCount() << " chunks)" << std::defaultfloat << std::endl;
+		}
+
+		std::swap(live, soa);
+		extent = liveExtent;
+	}
+
+	void setMode(RainMode newMode) {
+		if (newMode == mode) return;
+		mode = newMode;
+		if (gpuRain) gpuRain->enabled = (mode == RAIN_TRANSFORM_FEEDBACK);
+
+		const char *names[RAIN_MODE_COUNT] = { "CPU", "stateless GPU", "CPU SoA/SIMD", "GPU transform feedback" };
+		std::cout << "Rain mode: " << names[mode] << std::endl;
+	}
     
     void resetParticle(RainParticle& particle, float startHeight) {
-        float x = ((rand() % 1000) / 1000.0f * 2.0f - 1.0f) * spawnArea;
-        float z = ((rand() % 1000) / 1000.0f * 2.0f - 1.0f) * spawnArea;
+        float x = anchor.x + ((rand() % 1000) / 1000.0f * 2.0f - 1.0f) * extent;
+        float z = anchor.z + ((rand() % 1000) / 1000.0f * 2.0f - 1.0f) * extent;
         particle.position = glm::vec3(x, startHeight, z);
         
         // Randomize velocity
@@ -276,14 +801,27 @@ public:
     }
     
     void update(float deltaTime) {
+		elapsed += deltaTime;
+
+		// Stateless drops are a pure function of time, nothing to simulate or upload.
+		// Transform feedback drops are advanced by the particle engine.
+		if (mode == RAIN_STATELESS || mode == RAIN_TRANSFORM_FEEDBACK) return;
+
+		if (mode == RAIN_SIMD) {
+			updateSoA(deltaTime);
+			return;
+		}
+
         std::vector<glm::vec3> vertices;
-        vertices.reserve(MAX_PARTICLES * 2); // Reserve space for start and end points
+        vertices.reserve(particleCount * 2); // Reserve space for start and end points
         
         for(auto& particle : particles) {
             particle.position += particle.velocity * deltaTime;
+			particle.position.x = anchor.x + wrapOffset(particle.position.x - anchor.x);
+			particle.position.z = anchor.z + wrapOffset(particle.position.z - anchor.z);
             
-            if(particle.position.y < 0.0f) {
-                resetParticle(particle, spawnHeight);
+            if(particle.position.y < std::max(anchor.y, heightField->heightAt(particle.position.x, particle.position.z))) {
+                resetParticle(particle, anchor.y + spawnHeight);
             }
             
             // Calculate end point of raindrop using velocity direction and length
@@ -300,14 +838,38 @@ public:
     }
     
     void render(const glm::mat4& vp) {
+		if (mode == RAIN_TRANSFORM_FEEDBACK) return;	// Drawn by ParticleEngine::render
+
         glUseProgram(programID);
         glUniformMatrix4fv(vpMatrixID, 1, GL_FALSE, glm::value_ptr(vp));
+		glUniform1i(statelessID, mode == RAIN_STATELESS);
         
         glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		// Alpha accumulates coverage so the low resolution target composites as premultiplied colour
+		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
         
-        glBindVertexArray(VAO);
-        glDrawArrays(GL_LINES, 0, MAX_PARTICLES * 2);  // Draw lines instead of points
+		if (mode == RAIN_STATELESS) {
+			glUniform1f(timeID, elapsed);
+			glUniform1ui(seedID, seed);
+			glUniform1f(spawnHeightID, spawnHeight);
+			glUniform3fv(anchorID, 1, glm::value_ptr(anchor));
+			glUniform1f(extentID, extent);
+			glUniform2f(speedRangeID, minSpeed, maxSpeed);
+
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, heightField->textureID);
+			glUniform1i(heightFieldID, 0);
+			glUniform4fv(heightFieldTransformID, 1, glm::value_ptr(heightField->uvTransform()));
+
+			glBindVertexArray(statelessVAO);
+			glDrawArrays(GL_LINES, 0, particleCount * 2);
+		} else if (mode == RAIN_SIMD) {
+			glBindVertexArray(simdVAO);
+			glDrawArrays(GL_LINES, 0, (GLsizei)soa.count * 2);
+		} else {
+			glBindVertexArray(VAO);
+			glDrawArrays(GL_LINES, 0, particleCount * 2);  // Draw lines instead of points
+		}
         
         glDisable(GL_BLEND);
     }
@@ -316,9 +878,202 @@ public:
         glDeleteProgram(programID);
         glDeleteBuffers(1, &VBO);
         glDeleteVertexArrays(1, &VAO);
+		glDeleteVertexArrays(1, &statelessVAO);
+		glDeleteBuffers(1, &simdVBO);
+		glDeleteVertexArrays(1, &simdVAO);
     }
 };
 
+// Optional reduced resolution rain. The scene is rendered into an off-screen
+// target, its depth is downsampled into a half or quarter size depth buffer,
+// rain is drawn against that at the reduced size and composited back with a
+// depth-aware upsample. Cuts the fill cost of heavy, overlapping rain.
+struct LowResRainPass {
+	int divisor = 1;		// 1 draws rain straight into the scene, 2 is half res, 4 quarter res
+	int width = 0, height = 0;
+
+	GLuint sceneFBO = 0, sceneColor = 0, sceneDepth = 0;
+	GLuint rainFBO = 0, rainColor = 0, rainDepth = 0;
+	int rainWidth = 0, rainHeight = 0;
+
+	GLuint emptyVAO = 0;
+	GLuint downsampleProgramID = 0;
+	GLuint compositeProgramID = 0;
+	GLint downsampleDepthID, downsampleFactorID;
+	GLint compositeColorID, compositeRainDepthID, compositeSceneDepthID, compositeClipRangeID;
+
+	bool initialize() {
+		downsampleProgramID = LoadShadersFromFile("../lab2/fullscreen.vert", "../lab2/depth_downsample.frag");
+		compositeProgramID = LoadShadersFromFile("../lab2/fullscreen.vert", "../lab2/rain_composite.frag");
+		if (downsampleProgramID == 0 || compositeProgramID == 0) {
+			std::cerr << "Failed to load low resolution rain shaders." << std::endl;
+			return false;
+		}
+
+		downsampleDepthID = glGetUniformLocation(downsampleProgramID, "sceneDepth");
+		downsampleFactorID = glGetUniformLocation(downsampleProgramID, "factor");
+		compositeColorID = glGetUniformLocation(compositeProgramID, "rainColor");
+		compositeRainDepthID = glGetUniformLocation(compositeProgramID, "rainDepth");
+		compositeSceneDepthID = glGetUniformLocation(compositeProgramID, "sceneDepth");
+		compositeClipRangeID = glGetUniformLocation(compositeProgramID, "clipRange");
+
+		glGenVertexArrays(1, &emptyVAO);
+		return true;
+	}
+
+	void setDivisor(int newDivisor) {
+		if (newDivisor == divisor) return;
+		divisor = newDivisor;
+		std::cout << "Rain resolution: 1/" << divisor << std::endl;
+		releaseTargets();
+	}
+
+	bool active() const {
+		return divisor > 1 && compositeProgramID != 0;
+	}
+
+	// Redirect the opaque scene into the off-screen target
+	void beginScene() {
+		if (!active()) return;
+
+		int fbWidth, fbHeight;
+		glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+		if (fbWidth != width || fbHeight != height || sceneFBO == 0) {
+			releaseTargets();
+			createTargets(fbWidth, fbHeight);
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+		glViewport(0, 0, width, height);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
+
+	// Present the scene and prepare the low resolution target for the rain draws
+	void beginRain() {
+		if (!active()) return;
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, rainFBO);
+		glViewport(0, 0, rainWidth, rainHeight);
+		GLfloat clearColor[4];
+		glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+
+		// Depth only pass: every low-res texel gets the farthest depth of its block
+		glUseProgram(downsampleProgramID);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, sceneDepth);
+		glUniform1i(downsampleDepthID, 0);
+		glUniform1i(downsampleFactorID, divisor);
+		GLint depthFunc;
+		glGetIntegerv(GL_DEPTH_FUNC, &depthFunc);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glDepthFunc(GL_ALWAYS);
+		glBindVertexArray(emptyVAO);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glDepthFunc(depthFunc);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+		// Rain is tested against the downsampled depth but never writes it
+		glDepthMask(GL_FALSE);
+	}
+
+	// Upsample the rain over the presented scene
+	void endRain() {
+		if (!active()) return;
+
+		glDepthMask(GL_TRUE);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, width, height);
+
+		glUseProgram(compositeProgramID);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, rainColor);
+		glUniform1i(compositeColorID, 0);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, rainDepth);
+		glUniform1i(compositeRainDepthID, 1);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, sceneDepth);
+		glUniform1i(compositeSceneDepthID, 2);
+		glUniform2f(compositeClipRangeID, zNear, zFar);
+
+		// The rain target holds premultiplied colour, see RainSystem::render
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+		glBindVertexArray(emptyVAO);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glDisable(GL_BLEND);
+		glEnable(GL_DEPTH_TEST);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void cleanup() {
+		releaseTargets();
+		glDeleteVertexArrays(1, &emptyVAO);
+		glDeleteProgram(downsampleProgramID);
+		glDeleteProgram(compositeProgramID);
+	}
+
+private:
+	static GLuint createTexture(GLint internalFormat, GLenum format, GLenum type, int w, int h) {
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, w, h, 0, format, type, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		return texture;
+	}
+
+	static GLuint createFramebuffer(GLuint color, GLuint depth) {
+		GLuint fbo;
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			std::cerr << "Rain framebuffer incomplete." << std::endl;
+		}
+		return fbo;
+	}
+
+	void createTargets(int w, int h) {
+		width = w;
+		height = h;
+		rainWidth = std::max(1, (w + divisor - 1) / divisor);
+		rainHeight = std::max(1, (h + divisor - 1) / divisor);
+
+		sceneColor = createTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, width, height);
+		sceneDepth = createTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT, width, height);
+		sceneFBO = createFramebuffer(sceneColor, sceneDepth);
+
+		rainColor = createTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, rainWidth, rainHeight);
+		rainDepth = createTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT, rainWidth, rainHeight);
+		rainFBO = createFramebuffer(rainColor, rainDepth);
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void releaseTargets() {
+		if (sceneFBO == 0) return;
+		glDeleteFramebuffers(1, &sceneFBO);
+		glDeleteFramebuffers(1, &rainFBO);
+		GLuint textures[] = { sceneColor, sceneDepth, rainColor, rainDepth };
+		glDeleteTextures(4, textures);
+		sceneFBO = rainFBO = 0;
+	}
+};
+
 struct Skybox {
 	glm::vec3 position;		// Position of the box 
 	glm::vec3 scale;		// Size of the box in each axis
@@ -471,9 +1226,9 @@ struct Skybox {
 	GLuint textureID;
 
 	// Shader variable IDs
-	GLuint mvpMatrixID;
-	GLuint textureSamplerID;
-	GLuint programID;
+	Uniform<glm::mat4> mvpUniform;
+	Uniform<int> textureSamplerUniform;
+	ShaderProgram programID;
 
 	
 
@@ -520,18 +1275,8 @@ struct Skybox {
 			std::cerr << "Failed to load shaders." << std::endl;
 		}
 
-		// Set fog uniforms
-		glm::vec3 fogColor(0.6f, 0.7f, 1.0f); // Gray fog
-		float fogStart = 50.0f;
-		float fogEnd = 300.0f;
-
-
-		glUniform3fv(glGetUniformLocation(programID, "fogColor"), 1, glm::value_ptr(fogColor));
-		glUniform1f(glGetUniformLocation(programID, "fogStart"), fogStart);
-		glUniform1f(glGetUniformLocation(programID, "fogEnd"), fogEnd);
-
 		// Get a handle for our "MVP" uniform
-		mvpMatrixID = glGetUniformLocation(programID, "MVP");
+		mvpUniform = programID.uniform<glm::mat4>("MVP");
 
         // TODO: Load a texture 
         // --------------------
@@ -542,7 +1287,7 @@ struct Skybox {
         // TODO: Get a handle to texture sampler 
         // -------------------------------------
 		// Get a handle for our "textureSampler" uniform
-		textureSamplerID = glGetUniformLocation(programID,"textureSampler");
+		textureSamplerUniform = programID.uniform<int>("textureSampler");
 		
         // -------------------------------------
 	}
@@ -550,14 +1295,6 @@ struct Skybox {
 	void render(glm::mat4 cameraMatrix) {
 		glUseProgram(programID);
 
-		glm::vec3 cameraPos = -glm::vec3(
-        cameraMatrix[3][0] * cameraMatrix[0][0] + cameraMatrix[3][1] * cameraMatrix[0][1] + cameraMatrix[3][2] * cameraMatrix[0][2],
-        cameraMatrix[3][0] * cameraMatrix[1][0] + cameraMatrix[3][1] * cameraMatrix[1][1] + cameraMatrix[3][2] * cameraMatrix[1][2],
-        cameraMatrix[3][0] * cameraMatrix[2][0] + cameraMatrix[3][1] * cameraMatrix[2][1] + cameraMatrix[3][2] * cameraMatrix[2][2]
-    );
-
-		glUniform3fv(glGetUniformLocation(programID, "cameraPosition"), 1, glm::value_ptr(cameraPos));
-
 		glEnableVertexAttribArray(0);
 		glBindBuffer(GL_ARRAY_BUFFER, vertexBufferID);
 		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
@@ -579,7 +1316,7 @@ struct Skybox {
 
 		// Set model-view-projection matrix
 		glm::mat4 mvp = cameraMatrix * modelMatrix;
-		glUniformMatrix4fv(mvpMatrixID, 1, GL_FALSE, &mvp[0][0]);
+		programID.setUniform(mvpUniform, mvp);
 
 		// TODO: Enable UV buffer and texture sampler
 		// ------------------------------------------
@@ -589,7 +1326,7 @@ struct Skybox {
 		// Set textureSampler to use texture unit 0
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, textureID);
-		glUniform1i(textureSamplerID, 0); 
+		programID.setUniform(textureSamplerUniform, 0);
 
 
         // ------------------------------------------
@@ -624,11 +1361,8 @@ struct Skybox {
 struct MyModel {
 
 	// Shader variable IDs
-	GLuint mvpMatrixID;
-	GLuint jointMatricesID;
-	GLuint lightPositionID;
-	GLuint lightIntensityID;
-	GLuint programID;
+	Uniform<glm::mat4> viewProjectionUniform;	// Lights and camera come from FrameData
+	ShaderProgram programID;
 
 	// Shadow-related members
     GLuint shadowProgramID;  
@@ -642,199 +1376,395 @@ struct MyModel {
 	// Each VAO corresponds to each mesh primitive in the GLTF model
 	struct PrimitiveObject {
 		GLuint vao;
-		std::map<int, GLuint> vbos;
+		GLuint skinVBO = 0;		// Compact joints and weights, if any
 	};
 	std::vector<PrimitiveObject> primitiveObjects;
 
-	// Skinning 
-	struct SkinObject {
-		// Transforms the geometry into the space of the respective joint
-		std::vector<glm::mat4> inverseBindMatrices;  
-
-		// Transforms the geometry following the movement of the joints
-		std::vector<glm::mat4> globalJointTransforms;
-
-		// Combined transforms
-		std::vector<glm::mat4> jointMatrices;
+	// Everything needed to draw one primitive, recorded by bindModel so drawing
+	// never touches the tinygltf model. The index buffer is part of the VAO.
+	struct DrawCommand {
+		GLuint vao;
+		GLenum mode;
+		GLsizei count;			// Indices, or vertices when indexType is 0
+		GLenum indexType;
+		size_t byteOffset;		// Into the index buffer
+		int nodeIndex;
+		bool skinned;			// Drawn from the skinning cache when it exists
 	};
-	std::vector<SkinObject> skinObjects;
-
-	glm::mat4 getNodeTransform(const tinygltf::Node& node) {
-		glm::mat4 transform(1.0f); 
-
-		if (node.matrix.size() == 16) {
-			transform = glm::make_mat4(node.matrix.data());
-		} else {
-			if (node.translation.size() == 3) {
-				transform = glm::translate(transform, glm::vec3(node.translation[0], node.translation[1], node.translation[2]));
-			}
-			if (node.rotation.size() == 4) {
-				glm::quat q(node.rotation[3], node.rotation[0], node.rotation[1], node.rotation[2]);
-				transform *= glm::mat4_cast(q);
-			}
-			if (node.scale.size() == 3) {
-				transform = glm::scale(transform, glm::vec3(node.scale[0], node.scale[1], node.scale[2]));
-			}
+	std::vector<DrawCommand> drawCommands;
+
+	// One GL buffer per glTF buffer, uploaded once; every VAO points into them
+	std::vector<GLuint> bufferObjects;
+
+	// Per-instance poses. Every instance plays its own clip and clock; instances
+	// landing on the same frame of a clip (at bakedFrameRate) share a pose slot. The joint palettes of all
+	// slots are packed back to back into one texture buffer, uploaded once per
+	// frame and read by the skinning pre-pass.
+	struct PoseSlot {
+		int clip;
+		float clipTime;		// Seconds into the clip
+		int instance;		// First instance on this slot, owner of the channel cursors
+	};
+	int paletteStride = 0;					// Joint matrices per slot, all skins back to back
+	std::vector<int> skinPaletteOffsets;	// First matrix of each skin within a slot
+	AnimationBatch animationBatch;			// Evaluates every slot's palette, see updatePoses
+	std::vector<AnimationRequest> animationRequests;
+	WorkerPool *workerPool = nullptr;		// Splits large batches, optional
+	std::vector<int> instanceCursors;		// One cursor per channel per instance
+	std::vector<PoseSlot> poseSlots;
+	std::vector<int> instancePoseSlots;		// Slot drawn by each instance
+	std::unordered_map<uint64_t, int> poseSlotLookup;
+	GLuint paletteBufferID = 0;
+	GLuint paletteTextureID = 0;
+
+	void preparePalettes() {
+		skinPaletteOffsets.clear();
+		paletteStride = 0;
+		for (const tinygltf::Skin &skin : model.skins) {
+			skinPaletteOffsets.push_back(paletteStride);
+			paletteStride += (int)skin.joints.size();
 		}
-		return transform;
+		if (paletteStride == 0 || !animationBatch.initialize(model)) return;
+		animationBatch.removeRootMotion();
+		animationBatch.compress();
+
+		glGenBuffers(1, &paletteBufferID);
+		glBindBuffer(GL_TEXTURE_BUFFER, paletteBufferID);
+		glBufferData(GL_TEXTURE_BUFFER, paletteStride * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+
+		glGenTextures(1, &paletteTextureID);
+		glBindTexture(GL_TEXTURE_BUFFER, paletteTextureID);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, paletteBufferID);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
 	}
 
-	void computeLocalNodeTransform(const tinygltf::Model& model, 
-		int nodeIndex, 
-		std::vector<glm::mat4> &localTransforms)
-	{
-		// TODO: your code here
-		const tinygltf::Node& node = model.nodes[nodeIndex];
-    	localTransforms[nodeIndex] = getNodeTransform(node);
-
-		for (int childIndex : node.children) {
-        	computeLocalNodeTransform(model, childIndex, localTransforms);
-    	}
+	bool hasPalettes() const {
+		return paletteStride > 0;
 	}
 
-	void computeGlobalNodeTransform(const tinygltf::Model& model, 
-		const std::vector<glm::mat4> &localTransforms,
-		int nodeIndex, const glm::mat4& parentTransform, 
-		std::vector<glm::mat4> &globalTransforms)
-	{
-		// TODO 2: your code here
-		glm::mat4 globalTransform = parentTransform * localTransforms[nodeIndex];
-    	globalTransforms[nodeIndex] = globalTransform;
-
-    	const tinygltf::Node& node = model.nodes[nodeIndex];
-    	for (int childIndex : node.children) {
-        	computeGlobalNodeTransform(model, localTransforms, childIndex, globalTransform, globalTransforms);
-    	}
-	}  
-
+	// Baked animation for large crowds: every clip is sampled at a fixed rate
+	// into one RGBA32F texture, one row per frame and four texels per joint
+	// matrix. Instances then only pick a frame and skin.vert blends the two
+	// nearest rows, so animating costs no CPU time per joint.
+	struct BakedClip {
+		int firstRow;
+		int frameCount;
+	};
+	std::vector<BakedClip> bakedClips;
+	float bakedFrameRate = 30.0f;
+	GLuint bakedTextureID = 0;
+	bool useBakedAnimation = false;
+
+	void bakeAnimations() {
+		if (!hasPalettes() || animationBatch.clipCount() == 0) return;
+
+		// One request per row, evaluated from the compressed clips in one batch
+		std::vector<AnimationRequest> requests;
+		for (size_t c = 0; c < animationBatch.clipCount(); c++) {
+			BakedClip baked;
+			baked.firstRow = (int)requests.size();
+			baked.frameCount = std::max(1, (int)ceil(animationBatch.clipDuration((int)c) * bakedFrameRate));
+			for (int frame = 0; frame < baked.frameCount; frame++) {
+				AnimationRequest request = { (int)c, frame / bakedFrameRate, nullptr };
+				requests.push_back(request);
+			}
+			bakedClips.push_back(baked);
+		}
 
-		std::vector<SkinObject> prepareSkinning(const tinygltf::Model &model) {
-		std::vector<SkinObject> skinObjects;
+		std::vector<glm::mat4> rows(requests.size() * paletteStride);
+		animationBatch.evaluate(requests.data(), requests.size(), glm::value_ptr(rows[0]), workerPool);
 
-		if (model.skins.empty()) {
-    		std::cout << "Model has no skins. Skipping skinning setup." << std::endl;
-			return {};
+		int width = paletteStride * 4;
+		int height = (int)(rows.size() / paletteStride);
+		GLint maxSize;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+		if (width > maxSize || height > maxSize) {
+			std::cerr << "Baked animation of " << width << "x" << height << " exceeds the texture size limit." << std::endl;
+			bakedClips.clear();
+			return;
 		}
 
+		glGenTextures(1, &bakedTextureID);
+		glBindTexture(GL_TEXTURE_2D, bakedTextureID);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, rows.data());
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
 
-		// In our Blender exporter, the default number of joints that may influence a vertex is set to 4, just for convenient implementation in shaders.
-		for (size_t i = 0; i < model.skins.size(); i++) {
-			SkinObject skinObject;
+		std::cout << "Baked " << bakedClips.size() << " clips into " << width << "x" << height
+			<< " RGBA32F texture, " << std::fixed << std::setprecision(2)
+			<< width * height * 16 / (1024.0 * 1024.0) << " MB" << std::defaultfloat << std::endl;
+	}
 
-			const tinygltf::Skin &skin = model.skins[i];
+	bool hasBakedAnimation() const {
+		return bakedTextureID != 0;
+	}
 
-			// Read inverseBindMatrices
-			const tinygltf::Accessor &accessor = model.accessors[skin.inverseBindMatrices];
-			assert(accessor.type == TINYGLTF_TYPE_MAT4);
-			const tinygltf::BufferView &bufferView = model.bufferViews[accessor.bufferView];
-			const tinygltf::Buffer &buffer = model.buffers[bufferView.buffer];
-			const float *ptr = reinterpret_cast<const float *>(
-            	buffer.data.data() + accessor.byteOffset + bufferView.byteOffset);
-			
-			skinObject.inverseBindMatrices.resize(accessor.count);
-			for (size_t j = 0; j < accessor.count; j++) {
-				float m[16];
-				memcpy(m, ptr + j * 16, 16 * sizeof(float));
-				skinObject.inverseBindMatrices[j] = glm::make_mat4(m);
+	// Group the instances into pose slots for this frame
+	template <typename Instance>
+	void assignPoseSlots(const std::vector<Instance> &instances, float time) {
+		size_t channelCount = animationBatch.channelCount();
+		instanceCursors.resize(instances.size() * channelCount, 0);
+		instancePoseSlots.resize(instances.size());
+		poseSlots.clear();
+		poseSlotLookup.clear();
+
+		for (size_t i = 0; i < instances.size(); i++) {
+			PoseSlot slot = { 0, 0.0f, (int)i };
+			if (animationBatch.clipCount() > 0) {
+				const AnimationPlayback &playback = instances[i].animation;
+				slot.clip = std::min(std::max(playback.clip, 0), (int)animationBatch.clipCount() - 1);
+				float duration = animationBatch.clipDuration(slot.clip);
+				if (duration > 0.0f) {
+					slot.clipTime = fmod(playback.timeOffset + time * playback.speed, duration);
+					if (slot.clipTime < 0.0f) slot.clipTime += duration;
+
+					// Snap to the bake's frame grid, so instances on the same frame share a
+					// slot; the pose is then at most half a frame off
+					slot.clipTime = std::min(floor(slot.clipTime * bakedFrameRate + 0.5f) / bakedFrameRate, duration);
+				}
 			}
 
-			assert(skin.joints.size() == accessor.count);
-
-			skinObject.globalJointTransforms.resize(skin.joints.size());
-			skinObject.jointMatrices.resize(skin.joints.size());
-
-			// ----------------------------------------------
-			// TODO 3: your code here to compute joint matrices
-			// ----------------------------------------------
+			uint32_t timeBits;
+			memcpy(&timeBits, &slot.clipTime, sizeof(timeBits));
+			uint64_t key = ((uint64_t)(uint32_t)slot.clip << 32) | timeBits;
+			auto found = poseSlotLookup.find(key);
+			if (found == poseSlotLookup.end()) {
+				found = poseSlotLookup.emplace(key, (int)poseSlots.size()).first;
+				poseSlots.push_back(slot);
+			}
+			instancePoseSlots[i] = found->second;
+		}
+	}
 
-			// Compute local and global transforms for all nodes
-			// I ADDED
-			std::vector<glm::mat4> localTransforms(model.nodes.size());
-			for (size_t i = 0; i < model.nodes.size(); i++) {
-				computeLocalNodeTransform(model, i, localTransforms);
+	// Evaluate the pose of every slot straight into the mapped palette buffer and
+	// skin them. Instance is any type with an AnimationPlayback 'animation' member.
+	template <typename Instance>
+	void updatePoses(const std::vector<Instance> &instances, float time) {
+		if (!hasPalettes() || instances.empty()) return;
+
+		assignPoseSlots(instances, time);
+
+		// Baked clips are sampled on the GPU, nothing to evaluate here
+		if (!(useBakedAnimation && hasBakedAnimation())) {
+			size_t channelCount = animationBatch.channelCount();
+			animationRequests.resize(poseSlots.size());
+			for (size_t i = 0; i < poseSlots.size(); i++) {
+				const PoseSlot &slot = poseSlots[i];
+				AnimationRequest &request = animationRequests[i];
+				request.clip = animationBatch.clipCount() == 0 ? -1 : slot.clip;
+				request.time = slot.clipTime;
+				request.cursors = channelCount > 0 ? &instanceCursors[slot.instance * channelCount] : nullptr;
 			}
 
-			std::vector<glm::mat4> globalTransforms(model.nodes.size(), glm::mat4(1.0f));
-			for (size_t i = 0; i < model.nodes.size(); i++) {
-				computeGlobalNodeTransform(model, localTransforms, i, glm::mat4(1.0f), globalTransforms);
+			// Orphan last frame's storage so mapping never waits on the pre-pass reading it
+			GLsizeiptr size = poseSlots.size() * paletteStride * sizeof(glm::mat4);
+			glBindBuffer(GL_TEXTURE_BUFFER, paletteBufferID);
+			glBufferData(GL_TEXTURE_BUFFER, size, nullptr, GL_STREAM_DRAW);
+			float *mapped = (float *)glMapBufferRange(GL_TEXTURE_BUFFER, 0, size,
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			if (mapped) {
+				animationBatch.evaluate(animationRequests.data(), animationRequests.size(), mapped, workerPool);
+				glUnmapBuffer(GL_TEXTURE_BUFFER);
 			}
-		// ------------------------------- I ADDED
-        	// Compute joint matrices
-        for (size_t j = 0; j < skin.joints.size(); j++) {
-            int jointIndex = skin.joints[j];
-            skinObject.globalJointTransforms[j] = globalTransforms[jointIndex];
-            skinObject.jointMatrices[j] = skinObject.globalJointTransforms[j] * skinObject.inverseBindMatrices[j];
-        }
+			glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		}
 
+		skinPoses();
+	}
 
-			// ----------------------------------------------
+	// Transform feedback skinning cache: skin.vert poses every skinned primitive
+	// once per pose slot into skinnedBufferID, and every pass of the frame draws
+	// those vertices with the original indices
+	struct SkinnedVertex {
+		glm::vec3 position;
+		glm::vec3 normal;
+		glm::vec2 uv;
+	};
+	struct SkinnedPrimitive {
+		GLuint sourceVAO;		// Original attributes, input of the pre-pass
+		GLuint skinnedVAO;		// Captured vertices and the original index buffer
+		int skin;
+		int firstVertex;		// Within one pose slot
+		int vertexCount;
+		GLenum mode;
+		GLsizei indexCount;
+		GLenum indexType;
+		size_t indexOffset;
+	};
+	std::vector<SkinnedPrimitive> skinnedPrimitives;
+	int skinnedVerticesPerPose = 0;
+	size_t skinnedBufferSize = 0;
+	GLuint skinnedBufferID = 0;
+	GLuint skinProgramID = 0;
+	GLint skinPaletteID, skinPaletteOffsetID, skinUseBakedID, skinBakedAnimationID, skinBakedClipID, skinBakedFrameID;
+
+	// Walks the nodes in the same order as bindModelNodes so primitive indices line up
+	void collectSkinnedPrimitives(int nodeIndex, size_t &primitiveIndex) {
+		const tinygltf::Node &node = model.nodes[nodeIndex];
+		if (node.mesh >= 0 && node.mesh < (int)model.meshes.size()) {
+			for (const tinygltf::Primitive &primitive : model.meshes[node.mesh].primitives) {
+				const PrimitiveObject &object = primitiveObjects[primitiveIndex++];
+				if (node.skin < 0 || primitive.indices < 0 ||
+					!primitive.attributes.count("POSITION") || !primitive.attributes.count("JOINTS_0") ||
+					!primitive.attributes.count("WEIGHTS_0")) {
+					continue;
+				}
 
-			skinObjects.push_back(skinObject);
+				const tinygltf::Accessor &positions = model.accessors[primitive.attributes.at("POSITION")];
+				const tinygltf::Accessor &indices = model.accessors[primitive.indices];
+
+				SkinnedPrimitive skinned;
+				skinned.sourceVAO = object.vao;
+				skinned.skin = node.skin;
+				skinned.firstVertex = skinnedVerticesPerPose;
+				skinned.vertexCount = (int)positions.count;
+				skinned.mode = primitive.mode;
+				skinned.indexCount = (GLsizei)indices.count;
+				skinned.indexType = indices.componentType;
+				skinned.indexOffset = model.bufferViews[indices.bufferView].byteOffset + indices.byteOffset;
+				skinnedVerticesPerPose += skinned.vertexCount;
+
+				glGenVertexArrays(1, &skinned.skinnedVAO);
+				glBindVertexArray(skinned.skinnedVAO);
+				glBindBuffer(GL_ARRAY_BUFFER, skinnedBufferID);
+				glEnableVertexAttribArray(0);
+				glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SkinnedVertex), (void*)offsetof(SkinnedVertex, position));
+				glEnableVertexAttribArray(1);
+				glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(SkinnedVertex), (void*)offsetof(SkinnedVertex, normal));
+				glEnableVertexAttribArray(2);
+				glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(SkinnedVertex), (void*)offsetof(SkinnedVertex, uv));
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bufferObjects[model.bufferViews[indices.bufferView].buffer]);
+				glBindVertexArray(0);
+
+				skinnedPrimitives.push_back(skinned);
+			}
+		}
+		for (int child : node.children) {
+			collectSkinnedPrimitives(child, primitiveIndex);
 		}
-		return skinObjects;
 	}
 
-	int findKeyframeIndex(const std::vector<float>& times, float animationTime) 
-	{
-		int left = 0;
-		int right = times.size() - 1;
-
-		while (left <= right) {
-			int mid = (left + right) / 2;
+	void prepareSkinCache() {
+		if (!hasPalettes()) return;
 
-			if (mid + 1 < times.size() && times[mid] <= animationTime && animationTime < times[mid + 1]) {
-				return mid;
-			}
-			else if (times[mid] > animationTime) {
-				right = mid - 1;
-			}
-			else { // animationTime >= times[mid + 1]
-				left = mid + 1;
-			}
+		const char *varyings[] = { "skinnedPosition", "skinnedNormal", "skinnedUV" };
+		skinProgramID = LoadTransformFeedbackShaderFromFile("../lab2/skin.vert", varyings, 3,
+			compactSkinning ? "#define COMPACT_SKINNING\n" : nullptr);
+		if (skinProgramID == 0) {
+			std::cerr << "Failed to load skinning shader, drawing the bind pose." << std::endl;
+			paletteStride = 0;
+			return;
+		}
+		skinPaletteID = glGetUniformLocation(skinProgramID, "jointPalette");
+		skinPaletteOffsetID = glGetUniformLocation(skinProgramID, "paletteOffset");
+		skinUseBakedID = glGetUniformLocation(skinProgramID, "useBakedAnimation");
+		skinBakedAnimationID = glGetUniformLocation(skinProgramID, "bakedAnimation");
+		skinBakedClipID = glGetUniformLocation(skinProgramID, "bakedClip");
+		skinBakedFrameID = glGetUniformLocation(skinProgramID, "bakedFrame");
+
+		glGenBuffers(1, &skinnedBufferID);
+		size_t primitiveIndex = 0;
+		for (int root : model.scenes[model.defaultScene].nodes) {
+			collectSkinnedPrimitives(root, primitiveIndex);
 		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
 
-		// Target not found
-		return times.size() - 2;
+	bool hasSkinCache() const {
+		return skinProgramID != 0 && !skinnedPrimitives.empty();
 	}
 
-		void updateSkinning(const std::vector<glm::mat4> &nodeTransforms) {
+	// Skin every primitive once per pose slot, with rasterization disabled
+	void skinPoses() {
+		if (!hasSkinCache() || poseSlots.empty()) return;
 
-		// -------------------------------------------------
-		// TODO: Recompute joint matrices 
-		
-		std::vector<glm::mat4> globalTransforms;
-		globalTransforms.resize(model.nodes.size(), glm::mat4(1.0f));
+		size_t required = poseSlots.size() * skinnedVerticesPerPose * sizeof(SkinnedVertex);
+		if (required > skinnedBufferSize) {
+			glBindBuffer(GL_ARRAY_BUFFER, skinnedBufferID);
+			glBufferData(GL_ARRAY_BUFFER, required, nullptr, GL_DYNAMIC_COPY);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			skinnedBufferSize = required;
+		}
 
-		// global transforms for the root nodess
-		const tinygltf::Scene &scene = model.scenes[model.defaultScene];
+		bool baked = useBakedAnimation && hasBakedAnimation();
+		glUseProgram(skinProgramID);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_BUFFER, paletteTextureID);
+		glUniform1i(skinPaletteID, 0);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, bakedTextureID);
+		glUniform1i(skinBakedAnimationID, 1);
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(skinUseBakedID, baked);
+
+		glEnable(GL_RASTERIZER_DISCARD);
+		for (size_t i = 0; i < poseSlots.size(); i++) {
+			const PoseSlot &slot = poseSlots[i];
+			int paletteBase = (int)i * paletteStride;
+			if (baked) {
+				const BakedClip &clip = bakedClips[std::min(slot.clip, (int)bakedClips.size() - 1)];
+				glUniform2i(skinBakedClipID, clip.firstRow, clip.frameCount);
+				glUniform1f(skinBakedFrameID, slot.clipTime * bakedFrameRate);
+				paletteBase = 0;
+			}
 
-		for (const int &rootNodeIndex : scene.nodes) {
-        computeGlobalNodeTransform(model, nodeTransforms, rootNodeIndex, glm::mat4(1.0f), globalTransforms);
-    }
+			for (const SkinnedPrimitive &primitive : skinnedPrimitives) {
+				glUniform1i(skinPaletteOffsetID, paletteBase + skinPaletteOffsets[primitive.skin]);
+				glBindVertexArray(primitive.sourceVAO);
+				glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, skinnedBufferID,
+					(i * skinnedVerticesPerPose + primitive.firstVertex) * sizeof(SkinnedVertex),
+					primitive.vertexCount * sizeof(SkinnedVertex));
 
-		// Iterate over each skin object
-    for (SkinObject &skinObject : skinObjects) {
-        size_t skinIndex = &skinObject - &skinObjects[0]; // Index of the current skin object
-        const tinygltf::Skin &currentSkin = model.skins[skinIndex];
+				glBeginTransformFeedback(GL_POINTS);
+				glDrawArrays(GL_POINTS, 0, primitive.vertexCount);
+				glEndTransformFeedback();
+			}
+		}
+		glDisable(GL_RASTERIZER_DISCARD);
 
-        // Update joint matrices for the skin
-        for (size_t jointIndex = 0; jointIndex < currentSkin.joints.size(); ++jointIndex) {
-            int nodeIndex = currentSkin.joints[jointIndex];
-            glm::mat4 jointTransform = globalTransforms[nodeIndex];
-            skinObject.jointMatrices[jointIndex] = jointTransform * skinObject.inverseBindMatrices[jointIndex];
-        }
-    }
-		// -------------------------------------------------
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+		glBindVertexArray(0);
 	}
 
-		void update(float time) {
-		// -------------------------------------------------
-        // Prepare transformations for all nodes
-        std::vector<glm::mat4> currentNodeTransforms;
-        currentNodeTransforms.resize(model.nodes.size(), glm::mat4(1.0f));
-        // Update the skinning data
-        updateSkinning(currentNodeTransforms);
-    }
+	// Compact skinning format, see packSkinInfluences. Either every skinned
+	// primitive converts or the model keeps its source format, since the two
+	// need different variants of skin.vert.
+	bool compactSkinning = false;
+	std::map<const tinygltf::Primitive *, std::vector<unsigned char>> packedInfluences;	// Only until bindModel
+
+	void prepareCompactSkinning() {
+		size_t sourceBytes = 0, packedBytes = 0;
+		for (const tinygltf::Mesh &mesh : model.meshes) {
+			for (const tinygltf::Primitive &primitive : mesh.primitives) {
+				auto joints = primitive.attributes.find("JOINTS_0");
+				auto weights = primitive.attributes.find("WEIGHTS_0");
+				if (joints == primitive.attributes.end() || weights == primitive.attributes.end()) continue;
+
+				std::vector<unsigned char> packed;
+				if (!packSkinInfluences(model, joints->second, weights->second, packed)) {
+					std::cout << "Skin influences do not fit 8 bits, keeping the source format." << std::endl;
+					packedInfluences.clear();
+					compactSkinning = false;
+					return;
+				}
+
+				const tinygltf::Accessor &jointAccessor = model.accessors[joints->second];
+				const tinygltf::Accessor &weightAccessor = model.accessors[weights->second];
+				sourceBytes += jointAccessor.count * 4 * tinygltf::GetComponentSizeInBytes(jointAccessor.componentType);
+				sourceBytes += weightAccessor.count * 4 * tinygltf::GetComponentSizeInBytes(weightAccessor.componentType);
+				packedBytes += packed.size();
+				packedInfluences[&primitive] = std::move(packed);
+			}
+		}
+
+		compactSkinning = !packedInfluences.empty();
+		if (compactSkinning) {
+			std::cout << "Compact skinning: " << sourceBytes / 1024 << " KB of joints and weights packed into "
+				<< packedBytes / 1024 << " KB" << std::endl;
+		}
+	}
 
 	bool loadModel(tinygltf::Model &model, const char *filename) {
 		tinygltf::TinyGLTF loader;
@@ -860,15 +1790,21 @@ struct MyModel {
 
 	void initializeModel() {
 		// Modify your path if needed
-		if (!loadModel(model, "../lab2/bot/bot.gltf")) {
+		if (!loadModel(model, "../lab2/bot/botog.gltf")) {
 			return;
 		}
+		prepareModelFit();
 
 		// Prepare buffers for rendering 
+		prepareCompactSkinning();
 		primitiveObjects = bindModel(model);
+		packedInfluences.clear();
 
-		// Prepare joint matrices
-		skinObjects = prepareSkinning(model);
+		// Joint palettes, evaluated from the compressed clips
+		preparePalettes();
+		bakeAnimations();
+		prepareSkinCache();
+		prepareInstancing();
 
 
 		programID = LoadShadersFromFile("../lab2/bot.vert", "../lab2/bot.frag");
@@ -878,10 +1814,7 @@ struct MyModel {
 		}
 
 		// Get a handle for GLSL variables
-		mvpMatrixID = glGetUniformLocation(programID, "MVP");
-		lightPositionID = glGetUniformLocation(programID, "lightPosition");
-		lightIntensityID = glGetUniformLocation(programID, "lightIntensity");
-		jointMatricesID = glGetUniformLocation(programID, "jointMatrices");
+		viewProjectionUniform = programID.uniform<glm::mat4>("viewProjection");
 
 		
 		
@@ -890,48 +1823,49 @@ struct MyModel {
 	}
 
 		void bindMesh(std::vector<PrimitiveObject> &primitiveObjects,
-				tinygltf::Model &model, tinygltf::Mesh &mesh) {
-
-		std::map<int, GLuint> vbos;
-		for (size_t i = 0; i < model.bufferViews.size(); ++i) {
-			const tinygltf::BufferView &bufferView = model.bufferViews[i];
-
-			int target = bufferView.target;
-			
-			if (bufferView.target == 0) { 
-				// The bufferView with target == 0 in our model refers to 
-				// the skinning weights, for 25 joints, each 4x4 matrix (16 floats), totaling to 400 floats or 1600 bytes. 
-				// So it is considered safe to skip the warning.
-				//std::cout << "WARN: bufferView.target is zero" << std::endl;
-				continue;
-			}
-
-			const tinygltf::Buffer &buffer = model.buffers[bufferView.buffer];
-			GLuint vbo;
-			glGenBuffers(1, &vbo);
-			glBindBuffer(target, vbo);
-			glBufferData(target, bufferView.byteLength,
-						&buffer.data.at(0) + bufferView.byteOffset, GL_STATIC_DRAW);
-			
-			vbos[i] = vbo;
-		}
+				tinygltf::Model &model, tinygltf::Mesh &mesh, int nodeIndex) {
 
 		// Each mesh can contain several primitives (or parts), each we need to 
 		// bind to an OpenGL vertex array object
 		for (size_t i = 0; i < mesh.primitives.size(); ++i) {
 
-			tinygltf::Primitive primitive = mesh.primitives[i];
-			tinygltf::Accessor indexAccessor = model.accessors[primitive.indices];
+			const tinygltf::Primitive &primitive = mesh.primitives[i];
 
 			GLuint vao;
 			glGenVertexArrays(1, &vao);
 			glBindVertexArray(vao);
 
+			DrawCommand command;
+			command.vao = vao;
+			command.mode = primitive.mode;
+			command.indexType = 0;
+			command.byteOffset = 0;
+			command.nodeIndex = nodeIndex;
+			command.skinned = model.nodes[nodeIndex].skin >= 0;
+			if (primitive.indices >= 0) {
+				const tinygltf::Accessor &indexAccessor = model.accessors[primitive.indices];
+				const tinygltf::BufferView &indexView = model.bufferViews[indexAccessor.bufferView];
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bufferObjects[indexView.buffer]);
+				command.count = (GLsizei)indexAccessor.count;
+				command.indexType = indexAccessor.componentType;
+				command.byteOffset = indexView.byteOffset + indexAccessor.byteOffset;
+			} else {
+				auto position = primitive.attributes.find("POSITION");
+				command.count = position != primitive.attributes.end() ? (GLsizei)model.accessors[position->second].count : 0;
+			}
+			drawCommands.push_back(command);
+
+			auto packed = packedInfluences.find(&mesh.primitives[i]);
+			bool packedSkin = packed != packedInfluences.end();
+
 			for (auto &attrib : primitive.attributes) {
-				tinygltf::Accessor accessor = model.accessors[attrib.second];
-				int byteStride =
-					accessor.ByteStride(model.bufferViews[accessor.bufferView]);
-				glBindBuffer(GL_ARRAY_BUFFER, vbos[accessor.bufferView]);
+				if (packedSkin && (attrib.first == "JOINTS_0" || attrib.first == "WEIGHTS_0")) {
+					continue;	// Bound from the compact buffer below
+				}
+				const tinygltf::Accessor &accessor = model.accessors[attrib.second];
+				const tinygltf::BufferView &bufferView = model.bufferViews[accessor.bufferView];
+				int byteStride = accessor.ByteStride(bufferView);
+				glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[bufferView.buffer]);
 
 				int size = 1;
 				if (accessor.type != TINYGLTF_TYPE_SCALAR) {
@@ -949,16 +1883,28 @@ struct MyModel {
 					glEnableVertexAttribArray(vaa);
 					glVertexAttribPointer(vaa, size, accessor.componentType,
 										accessor.normalized ? GL_TRUE : GL_FALSE,
-										byteStride, BUFFER_OFFSET(accessor.byteOffset));
+										byteStride, BUFFER_OFFSET(bufferView.byteOffset + accessor.byteOffset));
 				} else {
 					std::cout << "vaa missing: " << attrib.first << std::endl;
 				}
 			}
 
+			// 4 x uint8 joints then 4 x unorm8 weights, 8 bytes per vertex
+			GLuint skinVBO = 0;
+			if (packedSkin) {
+				glGenBuffers(1, &skinVBO);
+				glBindBuffer(GL_ARRAY_BUFFER, skinVBO);
+				glBufferData(GL_ARRAY_BUFFER, packed->second.size(), packed->second.data(), GL_STATIC_DRAW);
+				glEnableVertexAttribArray(3);
+				glVertexAttribIPointer(3, 4, GL_UNSIGNED_BYTE, 8, BUFFER_OFFSET(0));
+				glEnableVertexAttribArray(4);
+				glVertexAttribPointer(4, 4, GL_UNSIGNED_BYTE, GL_TRUE, 8, BUFFER_OFFSET(4));
+			}
+
 			// Record VAO for later use
 			PrimitiveObject primitiveObject;
 			primitiveObject.vao = vao;
-			primitiveObject.vbos = vbos;
+			primitiveObject.skinVBO = skinVBO;
 			primitiveObjects.push_back(primitiveObject);
 
 			glBindVertexArray(0);
@@ -967,77 +1913,221 @@ struct MyModel {
 
 	void bindModelNodes(std::vector<PrimitiveObject> &primitiveObjects, 
 						tinygltf::Model &model,
-						tinygltf::Node &node) {
+						int nodeIndex) {
+		tinygltf::Node &node = model.nodes[nodeIndex];
 
 		// Bind buffers for the current mesh at the node
 		if ((node.mesh >= 0) && (node.mesh < model.meshes.size())) {
-			bindMesh(primitiveObjects, model, model.meshes[node.mesh]);
+			bindMesh(primitiveObjects, model, model.meshes[node.mesh], nodeIndex);
 		}
 
 		// Recursive into children nodes
 		for (size_t i = 0; i < node.children.size(); i++) {
 			assert((node.children[i] >= 0) && (node.children[i] < model.nodes.size()));
-			bindModelNodes(primitiveObjects, model, model.nodes[node.children[i]]);
+			bindModelNodes(primitiveObjects, model, node.children[i]);
 		}
 	}
 
 	std::vector<PrimitiveObject> bindModel(tinygltf::Model &model) {
 		std::vector<PrimitiveObject> primitiveObjects;
+		drawCommands.clear();
+
+		// Vertex and index views share the buffers, attributes and indices are read at offsets
+		size_t uploadedBytes = 0;
+		bufferObjects.resize(model.buffers.size());
+		glGenBuffers((GLsizei)bufferObjects.size(), bufferObjects.data());
+		for (size_t i = 0; i < model.buffers.size(); ++i) {
+			const std::vector<unsigned char> &data = model.buffers[i].data;
+			glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[i]);
+			glBufferData(GL_ARRAY_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+			uploadedBytes += data.size();
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		std::cout << "Uploaded " << model.buffers.size() << " glTF buffers, " << std::fixed << std::setprecision(2)
+			<< uploadedBytes / (1024.0 * 1024.0) << " MB" << std::defaultfloat << std::endl;
 
 		const tinygltf::Scene &scene = model.scenes[model.defaultScene];
 		for (size_t i = 0; i < scene.nodes.size(); ++i) {
 			assert((scene.nodes[i] >= 0) && (scene.nodes[i] < model.nodes.size()));
-			bindModelNodes(primitiveObjects, model, model.nodes[scene.nodes[i]]);
+			bindModelNodes(primitiveObjects, model, scene.nodes[i]);
 		}
 
 		return primitiveObjects;
 	}
 
-	void drawMesh(const std::vector<PrimitiveObject> &primitiveObjects,
-				tinygltf::Model &model, tinygltf::Mesh &mesh) {
-		
-		for (size_t i = 0; i < mesh.primitives.size(); ++i) 
-		{
-			GLuint vao = primitiveObjects[i].vao;
-			std::map<int, GLuint> vbos = primitiveObjects[i].vbos;
+	// Skinned vertices ignore node transforms, so a rigged model stands wherever its
+	// bind pose was authored. The instance placements were made for bot.gltf (Z-down
+	// until renderInstances stands it up, feet at the origin, 8.7 units tall), so
+	// skinned meshes are fitted into that frame from the bounds of their bind pose.
+	glm::mat4 modelFit = glm::mat4(1.0f);
+
+	void prepareModelFit() {
+		glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+		for (const tinygltf::Node &node : model.nodes) {
+			if (node.mesh < 0 || node.skin < 0) continue;
+			for (const tinygltf::Primitive &primitive : model.meshes[node.mesh].primitives) {
+				auto position = primitive.attributes.find("POSITION");
+				if (position == primitive.attributes.end()) continue;
+				const tinygltf::Accessor &accessor = model.accessors[position->second];
+				if (accessor.minValues.size() != 3 || accessor.maxValues.size() != 3) continue;
+				low = glm::min(low, glm::vec3(accessor.minValues[0], accessor.minValues[1], accessor.minValues[2]));
+				high = glm::max(high, glm::vec3(accessor.maxValues[0], accessor.maxValues[1], accessor.maxValues[2]));
+			}
+		}
+		modelFit = glm::mat4(1.0f);
+		if (!(low.y < high.y)) return;
 
-			glBindVertexArray(vao);
+		const float fittedHeight = 8.7f;
+		modelFit = glm::scale(modelFit, glm::vec3(fittedHeight / (high.y - low.y)));
+		modelFit = glm::rotate(modelFit, glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+		modelFit = glm::translate(modelFit, -glm::vec3(0.5f * (low.x + high.x), low.y, 0.5f * (low.z + high.z)));
+	}
 
-			tinygltf::Primitive primitive = mesh.primitives[i];
-			tinygltf::Accessor indexAccessor = model.accessors[primitive.indices];
+	// Hardware instancing: the model and normal matrix of every instance live in
+	// one attribute buffer (locations 5-8 and 9-11, divisor 1), so each
+	// primitive is drawn once for all instances
+	struct InstanceData {
+		glm::mat4 modelMatrix;
+		glm::mat3 normalMatrix;
+	};
+	std::vector<InstanceData> instanceData;
+	std::vector<int> slotInstanceStart;		// First instance of each pose slot in instanceData
+	GLuint instanceBufferID = 0;
+
+	// Set with setInstanceTransforms; the records are only rebuilt and uploaded
+	// when these or the instances' pose slots change
+	std::vector<glm::mat4> instanceTransforms;
+	std::vector<int> uploadedPoseSlots;		// instancePoseSlots of the records in the buffer
+	bool instancesChanged = false;
+
+	void setInstanceTransforms(const std::vector<glm::mat4> &modelMatrices) {
+		instanceTransforms.resize(modelMatrices.size());
+		for (size_t i = 0; i < modelMatrices.size(); i++) {
+			instanceTransforms[i] = modelMatrices[i] * modelFit;
+		}
+		instancesChanged = true;
+	}
 
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbos.at(indexAccessor.bufferView));
+	// Points the instance attributes of the bound VAO at instanceData[firstInstance]
+	void bindInstanceAttributes(size_t firstInstance) {
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBufferID);
+		size_t base = firstInstance * sizeof(InstanceData);
+		for (int column = 0; column < 4; column++) {
+			glEnableVertexAttribArray(5 + column);
+			glVertexAttribPointer(5 + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				BUFFER_OFFSET(base + column * sizeof(glm::vec4)));
+			glVertexAttribDivisor(5 + column, 1);
+		}
+		for (int column = 0; column < 3; column++) {
+			glEnableVertexAttribArray(9 + column);
+			glVertexAttribPointer(9 + column, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				BUFFER_OFFSET(base + sizeof(glm::mat4) + column * sizeof(glm::vec3)));
+			glVertexAttribDivisor(9 + column, 1);
+		}
+	}
 
-			glDrawElements(primitive.mode, indexAccessor.count,
-						indexAccessor.componentType,
-						BUFFER_OFFSET(indexAccessor.byteOffset));
+	void prepareInstancing() {
+		glGenBuffers(1, &instanceBufferID);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBufferID);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceData), nullptr, GL_STREAM_DRAW);
 
-			glBindVertexArray(0);
+		for (const DrawCommand &command : drawCommands) {
+			glBindVertexArray(command.vao);
+			bindInstanceAttributes(0);
+		}
+		for (const SkinnedPrimitive &primitive : skinnedPrimitives) {
+			glBindVertexArray(primitive.skinnedVAO);
+			bindInstanceAttributes(0);
 		}
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
 
-	void drawModelNodes(const std::vector<PrimitiveObject>& primitiveObjects,
-						tinygltf::Model &model, tinygltf::Node &node) {
-		// Draw the mesh at the node, and recursively do so for children nodes
-		if ((node.mesh >= 0) && (node.mesh < model.meshes.size())) {
-			drawMesh(primitiveObjects, model, model.meshes[node.mesh]);
+	// Draw every instance with one call per primitive. Instances are grouped by
+	// pose slot (see updatePoses) so each slot's pre-skinned vertices are drawn
+	// once, for the contiguous run of instances wearing that pose.
+	void drawInstances() {
+		size_t count = instanceTransforms.size();
+		if (count == 0) return;
+
+		bool skinned = hasSkinCache() && instancePoseSlots.size() == count;
+		static const std::vector<int> unskinnedSlots;
+		const std::vector<int> &slots = skinned ? instancePoseSlots : unskinnedSlots;
+
+		// Static instances keep their pose slots from frame to frame, so usually
+		// the records in the buffer are still current
+		if (instancesChanged || slots != uploadedPoseSlots) {
+			size_t slotCount = skinned ? poseSlots.size() : 1;
+			slotInstanceStart.assign(slotCount + 1, 0);
+			for (size_t i = 0; i < count; i++) {
+				slotInstanceStart[(skinned ? slots[i] : 0) + 1]++;
+			}
+			for (size_t slot = 0; slot < slotCount; slot++) {
+				slotInstanceStart[slot + 1] += slotInstanceStart[slot];
+			}
+
+			instanceData.resize(count);
+			std::vector<int> next(slotInstanceStart.begin(), slotInstanceStart.end() - 1);
+			for (size_t i = 0; i < count; i++) {
+				InstanceData &data = instanceData[next[skinned ? slots[i] : 0]++];
+				data.modelMatrix = instanceTransforms[i];
+				data.normalMatrix = glm::transpose(glm::inverse(glm::mat3(instanceTransforms[i])));
+			}
+
+			glBindBuffer(GL_ARRAY_BUFFER, instanceBufferID);
+			glBufferData(GL_ARRAY_BUFFER, count * sizeof(InstanceData), instanceData.data(), GL_DYNAMIC_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			uploadedPoseSlots = slots;
+			instancesChanged = false;
 		}
-		for (size_t i = 0; i < node.children.size(); i++) {
-			drawModelNodes(primitiveObjects, model, model.nodes[node.children[i]]);
+		size_t slotCount = slotInstanceStart.size() - 1;
+
+		for (const DrawCommand &command : drawCommands) {
+			// Skinned meshes come from the skinning cache below
+			if (command.skinned && skinned) continue;
+
+			glBindVertexArray(command.vao);
+			if (command.indexType != 0) {
+				glDrawElementsInstanced(command.mode, command.count, command.indexType,
+					BUFFER_OFFSET(command.byteOffset), (GLsizei)count);
+			} else {
+				glDrawArraysInstanced(command.mode, 0, command.count, (GLsizei)count);
+			}
 		}
-	}
-	void drawModel(const std::vector<PrimitiveObject>& primitiveObjects,
-				tinygltf::Model &model) {
-		// Draw all nodes
-		const tinygltf::Scene &scene = model.scenes[model.defaultScene];
-		for (size_t i = 0; i < scene.nodes.size(); ++i) {
-			drawModelNodes(primitiveObjects, model, model.nodes[scene.nodes[i]]);
+
+		if (skinned) {
+			for (const SkinnedPrimitive &primitive : skinnedPrimitives) {
+				glBindVertexArray(primitive.skinnedVAO);
+				for (size_t slot = 0; slot < slotCount; slot++) {
+					GLsizei slotInstances = slotInstanceStart[slot + 1] - slotInstanceStart[slot];
+					if (slotInstances == 0) continue;
+					bindInstanceAttributes(slotInstanceStart[slot]);
+					glDrawElementsInstancedBaseVertex(primitive.mode, primitive.indexCount, primitive.indexType,
+						BUFFER_OFFSET(primitive.indexOffset), slotInstances,
+						(GLint)(slot * skinnedVerticesPerPose + primitive.firstVertex));
+				}
+			}
 		}
+		glBindVertexArray(0);
 	}
 
 	
 	void cleanup() {
 		glDeleteProgram(programID);
+		glDeleteTextures(1, &paletteTextureID);
+		glDeleteTextures(1, &bakedTextureID);
+		glDeleteProgram(skinProgramID);
+		glDeleteBuffers(1, &skinnedBufferID);
+		for (const SkinnedPrimitive &primitive : skinnedPrimitives) {
+			glDeleteVertexArrays(1, &primitive.skinnedVAO);
+		}
+		for (const PrimitiveObject &primitive : primitiveObjects) {
+			if (primitive.skinVBO != 0) glDeleteBuffers(1, &primitive.skinVBO);
+		}
+		glDeleteBuffers(1, &paletteBufferID);
+		glDeleteBuffers((GLsizei)bufferObjects.size(), bufferObjects.data());
+		glDeleteBuffers(1, &instanceBufferID);
 	}
 
 };
@@ -1132,23 +2222,37 @@ GLuint groundTextureID;
 
 
 
-	void renderGround(glm::mat4 vp, glm::mat4 modelMatrix, GLuint VAO, GLuint textureID, GLuint programID, GLuint mvpMatrixID, GLuint textureSamplerID, glm::vec3 cameraPosition) {
-    glUseProgram(programID);
+	// Uniform handles of the ground shader, resolved once after loading
+	struct GroundUniforms {
+		Uniform<glm::mat4> mvp;
+		Uniform<glm::mat4> model;
+		Uniform<glm::mat3> normalMatrix;
+		Uniform<int> textureSampler;
+
+		void initialize(const ShaderProgram &program) {
+			mvp = program.uniform<glm::mat4>("MVP");
+			model = program.uniform<glm::mat4>("model");
+			normalMatrix = program.uniform<glm::mat3>("normalMatrix");
+			textureSampler = program.uniform<int>("textureSampler");
+		}
+	};
+
+	void renderGround(glm::mat4 vp, glm::mat4 modelMatrix, GLuint VAO, GLuint textureID, ShaderProgram &program, const GroundUniforms &uniforms) {
+    glUseProgram(program);
 
-	glUniform3fv(glGetUniformLocation(programID, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
     // Model matrix for the ground
     //glm::mat4 modelMatrix = glm::mat4(1.0f);
     //modelMatrix = glm::translate(modelMatrix, glm::vec3(0.0f, 0.0f, 0.0f)); // Slightly below zero
-	glUniformMatrix4fv(glGetUniformLocation(programID, "model"), 1, GL_FALSE, glm::value_ptr(modelMatrix));
+	program.setUniform(uniforms.model, modelMatrix);
 
     // Calculate the MVP matrix
     glm::mat4 mvp = vp * modelMatrix;
-    glUniformMatrix4fv(mvpMatrixID, 1, GL_FALSE, &mvp[0][0]);
+    program.setUniform(uniforms.mvp, mvp);
 	
     // Bind the texture
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, textureID);
-    glUniform1i(textureSamplerID, 0);
+    program.setUniform(uniforms.textureSampler, 0);
 
     // Bind and draw the geometry
     glBindVertexArray(VAO);
@@ -1160,6 +2264,7 @@ GLuint groundTextureID;
 		glm::vec3 position;
 		glm::vec3 scale;
 		float rotation;
+		AnimationPlayback animation = AnimationPlayback();	// Clip and clock of this instance, used by skinned models
 	};
 
 	std::vector<ModelInstance> modelInstances = {
@@ -1187,73 +2292,100 @@ GLuint groundTextureID;
 
 	};
 
+	// Set after moving, adding or removing modelInstances; renderInstances then
+	// rebuilds their transforms
+	bool modelInstancesChanged = true;
+
 
 	void renderInstances(glm::mat4 cameraMatrix, const std::vector<ModelInstance>& instances, MyModel& model) {
 			glUseProgram(model.programID);
 
-			//glm::vec3 cameraPos = -glm::vec3(
-			//cameraMatrix[3][0] * cameraMatrix[0][0] + cameraMatrix[3][1] * cameraMatrix[0][1] + cameraMatrix[3][2] * cameraMatrix[0][2],
-			//cameraMatrix[3][0] * cameraMatrix[1][0] + cameraMatrix[3][1] * cameraMatrix[1][1] + cameraMatrix[3][2] * cameraMatrix[1][2],
-			//cameraMatrix[3][0] * cameraMatrix[2][0] + cameraMatrix[3][1] * cameraMatrix[2][1] + cameraMatrix[3][2] * cameraMatrix[2][2]
-		//);
-			glm::vec3 cameraPos = eye_center;
-			glUniform3fv(glGetUniformLocation(model.programID, "cameraPosition"), 1, glm::value_ptr(cameraPos));
-			glUniform3fv(glGetUniformLocation(model.programID, "viewPos"), 1, glm::value_ptr(cameraPos)); // ADDED NOW
-			glUniform3fv(glGetUniformLocation(model.programID, "sphereLightPos"), 1, glm::value_ptr(sphereLightPos));
-			glUniform3fv(glGetUniformLocation(model.programID, "sphereLightColor"), 1, glm::value_ptr(sphereLightColor));
-			glUniform1f(glGetUniformLocation(model.programID, "sphereLightIntensity"), sphereLightIntensity);
-
-			// Set light data
-			glUniform3fv(model.lightPositionID, 1, &lightPosition[0]);
-			glUniform3fv(model.lightIntensityID, 1, &lightIntensity[0]);
-
-			for (const auto& instance : instances) {
-				// Create a model transformation matrix
-				glm::mat4 modelMatrix = glm::mat4(1.0f);
-				// rotating because model is rotated wrong direction
-				modelMatrix = glm::rotate(modelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f)); // Rotate 90 degrees around X-axis
-				modelMatrix = glm::translate(modelMatrix, instance.position);
-				modelMatrix = glm::scale(modelMatrix, instance.scale);
-				modelMatrix = glm::rotate(modelMatrix, glm::radians(instance.rotation), glm::vec3(0.0f, 0.0f, 1.0f));
-
-				
-				glUniformMatrix4fv(glGetUniformLocation(model.programID, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(modelMatrix));
-
-				// Calculate the normal matrix for correct lighting
-        		glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
-        		glUniformMatrix3fv(glGetUniformLocation(model.programID, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
-
-				// Calculate the MVP matrix
-				glm::mat4 mvp = cameraMatrix * modelMatrix;
-
-				// Pass the MVP matrix to the shader
-				glUniformMatrix4fv(model.mvpMatrixID, 1, GL_FALSE, &mvp[0][0]);
-				
-				// Draw the model
-				model.drawModel(model.primitiveObjects, model.model);
+			// Lights and camera position come from the FrameData block
+			model.programID.setUniform(model.viewProjectionUniform, cameraMatrix);
+
+			// Placement only changes when the instance list is edited
+			if (modelInstancesChanged) {
+				std::vector<glm::mat4> modelMatrices(instances.size());
+				for (size_t instanceIndex = 0; instanceIndex < instances.size(); instanceIndex++) {
+					const ModelInstance &instance = instances[instanceIndex];
+
+					// Create a model transformation matrix
+					glm::mat4 modelMatrix = glm::mat4(1.0f);
+					// rotating because model is rotated wrong direction
+					modelMatrix = glm::rotate(modelMatrix, glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f)); // Rotate 90 degrees around X-axis
+					modelMatrix = glm::translate(modelMatrix, instance.position);
+					modelMatrix = glm::scale(modelMatrix, instance.scale);
+					modelMatrix = glm::rotate(modelMatrix, glm::radians(instance.rotation), glm::vec3(0.0f, 0.0f, 1.0f));
+					modelMatrices[instanceIndex] = modelMatrix;
+				}
+				model.setInstanceTransforms(modelMatrices);
+				modelInstancesChanged = false;
 			}
-		}
 
-		struct Sign {
-			glm::vec3 position;  
-			glm::vec3 scale;     
-			float rotation;
+			// One instanced draw per primitive, posed by MyModel::updatePoses
+			model.drawInstances();
+		}
 
-			
-			GLuint VAO, VBO, EBO, textureID;
-			GLuint programID;          
-			GLuint mvpMatrixID;
-			GLuint modelMatrixID;
-			GLuint viewMatrixID;        
-			GLuint textureSamplerID; 
-			GLuint projectionMatrixID;
+	// Times AnimationBatch::evaluate on random (clip, time) requests: scalar
+	// reference, SSE kernels, and SSE split across the worker pool. Triggered with N.
+	void benchmarkAnimation(MyModel &model, WorkerPool &pool) {
+		AnimationBatch *batch = &model.animationBatch;
+		if (batch->paletteSize() == 0) {
+			std::cerr << "No skinned model to benchmark animation with." << std::endl;
+			return;
+		}
 
-			
-			void initialize(glm::vec3 position, glm::vec3 scale, float rotation) {
-				this->position = position;
-				this->scale = scale;
-				this->rotation = rotation;
+		const size_t counts[] = { 100, 1000, 10000 };
+		const char *modes[] = { "scalar", "sse", "sse + pool" };
+		for (size_t count : counts) {
+			std::vector<AnimationRequest> requests(count);
+			for (AnimationRequest &request : requests) {
+				request.clip = batch->clipCount() > 0 ? rand() % (int)batch->clipCount() : -1;
+				request.time = request.clip >= 0 ? batch->clipDuration(request.clip) * (rand() / (float)RAND_MAX) : 0.0f;
+				request.cursors = nullptr;
+			}
+			std::vector<float> output(count * batch->paletteSize() * 16);
+
+			for (int mode = 0; mode < 3; mode++) {
+				batch->useSIMD = mode > 0;
+				double start = glfwGetTime();
+				batch->evaluate(requests.data(), count, output.data(), mode == 2 ? &pool : nullptr);
+				double ms = (glfwGetTime() - start) * 1000.0;
+				std::cout << "Animation " << std::setw(5) << count << " instances, " << std::setw(10) << modes[mode] << ": "
+					<< std::fixed << std::setprecision(2) << ms << " ms, " << count / std::max(ms, 1e-3) << " instances/ms"
+					<< std::defaultfloat << std::endl;
+			}
+		}
+		batch->useSIMD = true;
+	}
 
+		// Every sign in one instanced draw: the sign images are the layers of one
+		// texture array, each sign is an instance record (locations 3-5, divisor 1)
+		// and sign.vert does the placement and the bobbing
+		struct SignField {
+			struct SignInstance {
+				glm::vec3 position;
+				float rotation;			// Radians about Y
+				glm::vec3 scale;
+				float layer;			// signtext<layer + 1>.png
+				float bobPhase;
+			};
+
+			std::vector<SignInstance> instances;
+			bool instancesChanged = false;
+
+			// Sphere around every sign position and the widest sign, refreshed with the
+			// instance records so render needs no per-sign work for requestDetail
+			glm::vec3 boundsCenter = glm::vec3(0.0f);
+			float boundsRadius = 0.0f;
+			float widestSign = 0.0f;
+
+			GLuint VAO, VBO, EBO, instanceBufferID, textureID;
+			ShaderProgram programID;
+			Uniform<glm::mat4> viewProjectionUniform;
+			Uniform<int> textureUniform;
+
+			void initialize() {
 				GLfloat vertices[] = {
 					// positions          // UVs		// Normals
 					-0.5f,  0.5f, 0.0f,  1.0f, 0.0f,  0.0f, 0.0f, 1.0f, 
@@ -1271,6 +2403,7 @@ GLuint groundTextureID;
 			glGenVertexArrays(1, &VAO);
 			glGenBuffers(1, &VBO);
 			glGenBuffers(1, &EBO);
+			glGenBuffers(1, &instanceBufferID);
 
 			glBindVertexArray(VAO);
 
@@ -1290,15 +2423,28 @@ GLuint groundTextureID;
 			glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (void*)(3 * sizeof(GLfloat)));
 			glEnableVertexAttribArray(2);
 
-			// Normals
 			// Normal attribute
 			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (void*)(5 * sizeof(GLfloat)));
 			glEnableVertexAttribArray(1);
 
+			// Instance records: position and rotation, scale and layer, bob phase
+			glBindBuffer(GL_ARRAY_BUFFER, instanceBufferID);
+			glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(SignInstance), (void*)offsetof(SignInstance, position));
+			glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(SignInstance), (void*)offsetof(SignInstance, scale));
+			glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, sizeof(SignInstance), (void*)offsetof(SignInstance, bobPhase));
+			for (int location = 3; location <= 5; location++) {
+				glEnableVertexAttribArray(location);
+				glVertexAttribDivisor(location, 1);
+			}
 
 			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-			textureID = LoadTextureTileBox("../lab2/signtext9.png", GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+			std::vector<std::string> signFiles;
+			for (int i = 1; i <= 9; i++) {
+				signFiles.push_back("../lab2/signtext" + std::to_string(i) + ".png");
+			}
+			textureID = textureLoader.loadArray(signFiles, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
 
 			programID = LoadShadersFromFile("../lab2/sign.vert", "../lab2/sign.frag");
 			if (programID == 0) {
@@ -1306,52 +2452,72 @@ GLuint groundTextureID;
             	return;
         	}
 
-			// Get uniform locations
-			modelMatrixID = glGetUniformLocation(programID, "model");
-			viewMatrixID = glGetUniformLocation(programID, "view");
-			//textureSamplerID = glGetUniformLocation(programID, "textureSampler");
-			projectionMatrixID = glGetUniformLocation(programID, "projection");
-			textureSamplerID = glGetUniformLocation(programID, "texture1");	
+			viewProjectionUniform = programID.uniform<glm::mat4>("viewProjection");
+			textureUniform = programID.uniform<int>("signTextures");
 			}
 
+			// 'rotation' in degrees about Y, 'layer' 0-8 for signtext1..9.png
+			void addSign(glm::vec3 position, glm::vec3 scale, float rotation, int layer, float bobPhase) {
+				SignInstance instance;
+				instance.position = position;
+				instance.rotation = glm::radians(rotation);
+				instance.scale = scale;
+				instance.layer = (float)layer;
+				instance.bobPhase = bobPhase;
+				instances.push_back(instance);
+				instancesChanged = true;
+			}
 
-			void render(const glm::mat4& vpMatrix, float time) {
-				
-				glUseProgram(programID);
-
-				// oscillation for sign to "bob" up and down
-				float oscillation = sin(time * 3.5f) * 0.3f;
-
-				// Model matrix for positioning and scaling
-				glm::mat4 modelMatrix  = glm::mat4(1.0f);
-				modelMatrix  = glm::translate(modelMatrix , position + glm::vec3(0.0f, oscillation, 0.0f));
-				modelMatrix  = glm::scale(modelMatrix , scale);
-				modelMatrix  = glm::rotate(modelMatrix , glm::radians(rotation), glm::vec3(0.0f, 1.0f, 0.0f));
+			void updateBounds() {
+				glm::vec3 lower = instances[0].position, upper = instances[0].position;
+				widestSign = 0.0f;
+				for (const SignInstance &instance : instances) {
+					lower = glm::min(lower, instance.position);
+					upper = glm::max(upper, instance.position);
+					widestSign = std::max(widestSign, instance.scale.x);
+				}
+				boundsCenter = (lower + upper) * 0.5f;
+				boundsRadius = 0.0f;
+				for (const SignInstance &instance : instances) {
+					boundsRadius = std::max(boundsRadius, glm::distance(boundsCenter, instance.position));
+				}
+			}
 
-				glm::mat4 mvp = vpMatrix * modelMatrix;
+			void render(const glm::mat4& vpMatrix) {
+				if (instances.empty()) return;
 
-				glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
+				glUseProgram(programID);
+				programID.setUniform(viewProjectionUniform, vpMatrix);
+
+				// Signs rarely change, the records are uploaded only after addSign
+				if (instancesChanged) {
+					glBindBuffer(GL_ARRAY_BUFFER, instanceBufferID);
+					glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(SignInstance), instances.data(), GL_STATIC_DRAW);
+					glBindBuffer(GL_ARRAY_BUFFER, 0);
+					updateBounds();
+					instancesChanged = false;
+				}
 
-				// Set uniform values
-				glUniformMatrix4fv(glGetUniformLocation(programID, "MVP"), 1, GL_FALSE, glm::value_ptr(mvp));
-				glUniformMatrix4fv(glGetUniformLocation(programID, "model"), 1, GL_FALSE, glm::value_ptr(modelMatrix));
-				glUniformMatrix3fv(glGetUniformLocation(programID, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
+				// No sign is closer than the bounding sphere's surface, so the widest sign
+				// there is an upper bound on how much of the texture array is needed
+				float closest = std::max(glm::distance(eye_center, boundsCenter) - boundsRadius, 0.0f);
+				textureLoader.requestDetail(textureID, ScreenSize(widestSign, closest));
 
 				// Bind texture
 				glActiveTexture(GL_TEXTURE0);
-				glBindTexture(GL_TEXTURE_2D, textureID);
-				glUniform1i(glGetUniformLocation(programID, "texture1"), 0);
-
+				glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+				programID.setUniform(textureUniform, 0);
 
-				// Bind VAO and draw the quad
+				// Bind VAO and draw every sign
 				glBindVertexArray(VAO);
-				glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+				glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, (GLsizei)instances.size());
 				glBindVertexArray(0);
     }
 			// Cleanup resources
 			void cleanup() {
 				glDeleteBuffers(1, &VBO);
 				glDeleteBuffers(1, &EBO);
+				glDeleteBuffers(1, &instanceBufferID);
 				glDeleteVertexArrays(1, &VAO);
 				glDeleteTextures(1, &textureID);
 				glDeleteProgram(programID);
@@ -1409,6 +2575,25 @@ int main(void)
 		return -1;
 	}
 
+	if (programBinaryCache) {
+		EnableProgramBinaryCache(glfwGetProcAddress, "shader_cache");
+	}
+
+	// Start every program now, the driver builds them while textures and models load.
+	// Paths have to match the LoadShadersFromFile calls that pick them up.
+	PrecompileShaders(glfwGetProcAddress, {
+		{ "../lab2/box.vert", "../lab2/box.frag" },
+		{ "../lab2/ground.vert", "../lab2/ground.frag" },
+		{ "../lab2/sphere.vert", "../lab2/sphere.frag" },
+		{ "../lab2/bot.vert", "../lab2/bot.frag" },
+		{ "../lab2/particle.vert", "../lab2/particle.frag" },
+		{ "../lab2/particle_burst.vert", "../lab2/particle.frag" },
+		{ "../lab2/rain.vert", "../lab2/rain.frag" },
+		{ "../lab2/fullscreen.vert", "../lab2/depth_downsample.frag" },
+		{ "../lab2/fullscreen.vert", "../lab2/rain_composite.frag" },
+		{ "../lab2/sign.vert", "../lab2/sign.frag" },
+	});
+
 	// Background
 	glClearColor(0.2f, 0.2f, 0.25f, 0.0f);
 
@@ -1427,6 +2612,10 @@ int main(void)
 
 	
 
+	// Shared CPU worker threads (rain simulation, animation, texture decoding)
+	WorkerPool workerPool;
+	textureLoader.initialize(&workerPool, "texture_cache", (size_t)textureBudgetMegabytes << 20);
+
     Skybox skybox;
 		// Random scale values
 
@@ -1434,21 +2623,28 @@ int main(void)
     glm::vec3 scale(600.0f, 600.0f, 400.0f); // Uniform size for skybox
     skybox.initialize(position, scale);
 
-	GLuint groundProgramID = LoadShadersFromFile("../lab2/ground.vert", "../lab2/ground.frag");
-	GLuint groundMVPMatID = glGetUniformLocation(groundProgramID, "MVP");
-	GLuint groundSamplerID = glGetUniformLocation(groundProgramID, "textureSampler");
+	FrameUniformBuffer frameUniforms;
+	frameUniforms.initialize();
+
+	ShaderProgram groundProgram = LoadShadersFromFile("../lab2/ground.vert", "../lab2/ground.frag");
+	GroundUniforms groundUniforms;
+	groundUniforms.initialize(groundProgram);
 
 	// Set the ground modelMatrix (if needed, you can adjust its position later in the loop)
 	modelMatrix = glm::translate(modelMatrix, glm::vec3(0.0f, 0.0f, 0.0f)); 
 
 	// Compute normalMatrix based on modelMatrix
 	
+	// GPU particles (transform feedback rain, splashes, sparks)
+	ParticleEngine particleEngine;
+	ParticleSystem *lightSparks = nullptr;
+
 	// RAIN
 	RainSystem rainSystem;
 
 
-	// SIGN
-	Sign mySign;
+	// SIGNS
+	SignField signField;
 
 	//glm::mat3 normalMatrix = glm::mat3(1.0f);
 	//glUniformMatrix3fv(glGetUniformLocation(groundProgramID, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
@@ -1468,11 +2664,56 @@ int main(void)
 	setupSphere(10.0f); // sphere radius
 
 	MyModel b;
+	b.workerPool = &workerPool;
 	b.initializeModel();
 
-	rainSystem.initialize();  // RAIN
+	// Spread the instances over the clips and out of phase with each other
+	for (size_t i = 0; i < modelInstances.size(); i++) {
+		modelInstances[i].animation.clip = b.animationBatch.clipCount() == 0 ? 0 : int(i % b.animationBatch.clipCount());
+		modelInstances[i].animation.timeOffset = i * 1.37f;
+		modelInstances[i].animation.speed = 0.8f + 0.05f * (i % 9);
+	}
+	b.updatePoses(modelInstances, 0.0f);
+
+	if (!particleEngine.initialize()) {
+		return -1;
+	}
+
+	// Roofs of the bot buildings, rasterized once for rain collisions
+	HeightField heightField;
+	heightField.build([&](const glm::mat4 &topDown) {
+		renderInstances(topDown, modelInstances, b);
+	});
+
+	rainSystem.initialize(rainMode, rainQuality, &workerPool, &particleEngine, &heightField);  // RAIN
+
+	LowResRainPass lowResRain;
+	lowResRain.initialize();
+
+	// Sparks shed by the orbiting sphere light
+	ParticleEmitterDesc sparkDesc;
+	sparkDesc.maxParticles = 2000;
+	sparkDesc.spawnMin = glm::vec3(-0.5f);
+	sparkDesc.spawnMax = glm::vec3(0.5f);
+	sparkDesc.velocityMin = glm::vec3(-4.0f, -1.0f, -4.0f);
+	sparkDesc.velocityMax = glm::vec3(4.0f, 6.0f, 4.0f);
+	sparkDesc.lifetime = glm::vec2(0.4f, 1.2f);
+	sparkDesc.gravity = glm::vec3(0.0f, -9.8f, 0.0f);
+	sparkDesc.shape = PARTICLE_POINT;
+	sparkDesc.pointSize = 3.0f;
+	sparkDesc.color = glm::vec4(1.0f, 0.35f, 0.1f, 1.0f);
+	sparkDesc.additive = true;
+	lightSparks = particleEngine.createSystem(sparkDesc);
 	// 0.0f, 0.0f, 5.0f
-	mySign.initialize(glm::vec3(25.0f, 15.0f, 105.0f), glm::vec3(35.0f, 15.0f, 15.0f), 45.0f);
+	signField.initialize();
+	signField.addSign(glm::vec3(25.0f, 15.0f, 105.0f), glm::vec3(35.0f, 15.0f, 15.0f), 45.0f, 8, 0.0f);
+	// The rest of the signs on a ring, facing the middle
+	for (int i = 0; i < signRingCount; i++) {
+		float angle = glm::two_pi<float>() * i / signRingCount;
+		glm::vec3 position(150.0f * cos(angle), 15.0f, 150.0f * sin(angle));
+		float rotation = glm::degrees(atan2(-cos(angle), -sin(angle)));
+		signField.addSign(position, glm::vec3(35.0f, 15.0f, 15.0f), rotation, i % 9, i * 0.9f);
+	}
 
 
 	// Camera setup
@@ -1486,6 +2727,15 @@ int main(void)
 	//glm::float32 zFar = 1800.0f;
 	projectionMatrix = glm::perspective(glm::radians(FoV), 4.0f / 3.0f, zNear, zFar);
 
+	// Every loader has run, a precompiled program left over means a path mismatch
+	DiscardUnclaimedShaders();
+
+	// GLFW's clock starts at glfwInit
+	const ShaderLoadStats &shaderStats = GetShaderLoadStats();
+	printf("Startup %.0f ms, %d shader programs in %.1f ms (%d from the binary cache%s)\n",
+		glfwGetTime() * 1000.0, shaderStats.programs, shaderStats.milliseconds, shaderStats.cacheHits,
+		programBinaryCache ? "" : ", disabled");
+
 	// Time and frame rate tracking
 	static double lastTime = glfwGetTime();
 	float time = 0.0f;			// Animation time 
@@ -1499,16 +2749,40 @@ int main(void)
 
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+		lowResRain.setDivisor(rainResolutionDivisor);
+		lowResRain.beginScene();
+
 		processInput();
 
+		// Stream in texture levels wanted by last frame's draws, within the budget
+		textureLoader.setBudget((size_t)textureBudgetMegabytes << 20);
+		textureLoader.update();
+
 		// Update states for animation
         double currentTime = glfwGetTime();
         float deltaTime = float(currentTime - lastTime);
 		lastTime = currentTime;
 
+		// Skinning pre-pass, its vertices are shared by every pass that draws the bots this frame
+		if (bakedAnimation && !b.useBakedAnimation && !b.hasBakedAnimation()) {
+			std::cout << "The model has no baked clips, instances stay posed on the CPU." << std::endl;
+		}
+		b.useBakedAnimation = bakedAnimation;
+		b.updatePoses(modelInstances, (float)currentTime);
+		if (animationBenchmarkRequested) {
+			animationBenchmarkRequested = false;
+			benchmarkAnimation(b, workerPool);
+		}
+
 		
 
+		rainSystem.setMode(rainMode);
+		rainSystem.setViewer(eye_center, lookat - eye_center);
 		rainSystem.update(deltaTime); // RAIN updating
+		if (rainBenchmarkRequested) {
+			rainBenchmarkRequested = false;
+			rainSystem.benchmarkSoA(1000000, 60);
+		}
 
 		viewMatrix = glm::lookAt(eye_center, lookat, up);
 		glm::mat4 vp = projectionMatrix * viewMatrix;
@@ -1519,26 +2793,38 @@ int main(void)
     	sphereLightPos.z = 60.0f + radius * sin(time); 
     	sphereLightPos.y = 15.0f;  
 
+		lightSparks->origin = sphereLightPos;
+		particleEngine.update(deltaTime);
+
+		// Lights, fog and camera for every lit pass, in one upload
+		FrameData frameData;
+		frameData.cameraPosition = eye_center;
+		frameData.sphereLightPos = sphereLightPos;
+		frameData.sphereLightColor = sphereLightColor;
+		frameData.sphereLightIntensity = sphereLightIntensity;
+		frameData.lightPosition = lightPosition;
+		frameData.lightIntensity = lightIntensity;
+		frameData.fogColor = glm::vec3(0.3f, 0.3f, 0.3f);
+		frameData.fogDensity = 0.004f;
+		frameData.fogStart = 200.0f;
+		frameData.fogEnd = 300.0f;
+		frameData.time = time;
+		frameData.padding = 0.0f;
+		frameUniforms.update(frameData);
+
 		// Render the skybox first
 		glUseProgram(skybox.programID);
 		glBindVertexArray(skybox.vertexArrayID); 
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, skybox.textureID);
+		// Each face spans 90 degrees of view, the atlas is four faces across
+		textureLoader.requestDetail(skybox.textureID, 4.0f * ScreenSize(2.0f, 1.0f));
 		glDepthFunc(GL_LEQUAL); 
 		glDisable(GL_CULL_FACE); // Disable culling for the skybox
 		skybox.render(vp);
 
 		// Render the ground
-		glUseProgram(groundProgramID);
-
-		// Pass sphere light properties
-		glUniform3fv(glGetUniformLocation(groundProgramID, "sphereLightPos"), 1, glm::value_ptr(sphereLightPos));
-		glUniform3fv(glGetUniformLocation(groundProgramID, "sphereLightColor"), 1, glm::value_ptr(sphereLightColor));
-		glUniform1f(glGetUniformLocation(groundProgramID, "sphereLightIntensity"), sphereLightIntensity);
-
-		// Pass view position (camera position)
-		glm::vec3 viewPos = eye_center;
-		glUniform3fv(glGetUniformLocation(groundProgramID, "viewPos"), 1, glm::value_ptr(viewPos));
+		glUseProgram(groundProgram);
 
 		glBindVertexArray(groundVAO);
 		glActiveTexture(GL_TEXTURE0);
@@ -1547,9 +2833,11 @@ int main(void)
 		modelMatrix = glm::translate(modelMatrix, glm::vec3(0.0f, 0.0f, 0.0f)); // Adjust position if needed
 
 		glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
-		glUniformMatrix3fv(glGetUniformLocation(groundProgramID, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
+		groundProgram.setUniform(groundUniforms.normalMatrix, normalMatrix);
 
-		renderGround(vp, modelMatrix, groundVAO, groundTextureID, groundProgramID, groundMVPMatID, groundSamplerID, eye_center);
+		renderGround(vp, modelMatrix, groundVAO, groundTextureID, groundProgram, groundUniforms);
+		// One repeat is 30 units across, sharpest right under the camera
+		textureLoader.requestDetail(groundTextureID, ScreenSize(30.0f, eye_center.y));
 		//renderGround(vp, groundVAO, groundTextureID, groundProgramID, groundMVPMatID, groundSamplerID);
 		
 		// Render the building
@@ -1560,16 +2848,13 @@ int main(void)
 
 		renderInstances(vp, modelInstances, b);
 
-		rainSystem.render(vp);
+		signField.render(vp);
 
-		glUseProgram(mySign.programID);
-
-		// Pass light and view uniform values once
-		glUniform3fv(glGetUniformLocation(mySign.programID, "sphereLightPos"), 1, glm::value_ptr(sphereLightPos));
-		glUniform3fv(glGetUniformLocation(mySign.programID, "sphereLightColor"), 1, glm::value_ptr(sphereLightColor));
-		glUniform1f(glGetUniformLocation(mySign.programID, "sphereLightIntensity"), sphereLightIntensity);
-		glUniform3fv(glGetUniformLocation(mySign.programID, "viewPos"), 1, glm::value_ptr(viewPos));
-		mySign.render(vp, glfwGetTime());
+		// Transparent effects last, optionally at reduced resolution
+		lowResRain.beginRain();
+		rainSystem.render(vp);
+		particleEngine.render(vp);
+		lowResRain.endRain();
 
 				// FPS tracking 
 		// Count number of frames over a few seconds and take average
@@ -1600,7 +2885,15 @@ int main(void)
 
 	rainSystem.cleanup();
 
-	mySign.cleanup();
+	particleEngine.cleanup();
+
+	lowResRain.cleanup();
+
+	heightField.cleanup();
+
+	signField.cleanup();
+	textureLoader.cleanup();
+	frameUniforms.cleanup();
 	
 	// Close OpenGL window and terminate GLFW
 	glfwTerminate();
@@ -1633,6 +2926,38 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
         std::cout << "Reset." << std::endl;
     }
 
+    if (key == GLFW_KEY_G && action == GLFW_PRESS)
+    {
+        rainMode = RainMode((rainMode + 1) % RAIN_MODE_COUNT);
+    }
+
+    if (key == GLFW_KEY_B && action == GLFW_PRESS)
+    {
+        bakedAnimation = !bakedAnimation;
+        std::cout << "Baked animation: " << (bakedAnimation ? "on" : "off") << std::endl;
+    }
+
+    if (key == GLFW_KEY_N && action == GLFW_PRESS)
+    {
+        animationBenchmarkRequested = true;
+    }
+
+    if (key == GLFW_KEY_M && action == GLFW_PRESS)
+    {
+        rainBenchmarkRequested = true;
+    }
+
+    if (key == GLFW_KEY_H && action == GLFW_PRESS)
+    {
+        rainResolutionDivisor = rainResolutionDivisor >= 4 ? 1 : rainResolutionDivisor * 2;
+    }
+
+    if (key == GLFW_KEY_T && action == GLFW_PRESS)
+    {
+        textureBudgetMegabytes = textureBudgetMegabytes <= 1 ? 64 : textureBudgetMegabytes / 4;
+        std::cout << "Texture budget: " << textureBudgetMegabytes << " MB" << std::endl;
+    }
+
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, GL_TRUE);
 }
@@ -0,0 +1,8 @@
+#version 330 core
+in vec4 particleColor;
+
+out vec4 FragColor;
+
+void main() {
+    FragColor = particleColor;
+}
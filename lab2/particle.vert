@@ -0,0 +1,42 @@
+#version 330 core
+// Draws one particle per instance: a streak (2 vertices) or a point (1 vertex)
+
+layout(location = 0) in vec4 positionAge;
+layout(location = 1) in vec4 velocityLife;
+
+uniform mat4 VP;
+uniform bool streak;
+uniform vec2 streakLength;  // min, max
+uniform float pointSize;
+uniform vec4 color;
+
+out vec4 particleColor;
+
+uint hash(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+void main() {
+    vec3 position = positionAge.xyz;
+    float alpha = color.a;
+
+    if (streak) {
+        // Length is a fixed property of the particle slot
+        if (gl_VertexID == 1) {
+            float t = float(hash(uint(gl_InstanceID)) >> 8) * (1.0 / 16777216.0);
+            position += normalize(velocityLife.xyz) * mix(streakLength.x, streakLength.y, t);
+        }
+    } else {
+        // Points fade out over their lifetime
+        alpha *= 1.0 - clamp(positionAge.w / velocityLife.w, 0.0, 1.0);
+    }
+
+    particleColor = vec4(color.rgb, alpha);
+    gl_PointSize = pointSize;
+    gl_Position = VP * vec4(position, 1.0);
+}
@@ -0,0 +1,53 @@
+#version 330 core
+// Collision sub-emitter: instance = parent particle, vertex = burst point.
+// Each point is evaluated from the parent's last impact, so bursts need no state.
+
+layout(location = 2) in vec4 impact;    // xyz collision point, w time of the collision (< 0 = none)
+
+uniform mat4 VP;
+uniform float time;
+uniform int burstCount;
+uniform float burstLifetime;
+uniform float burstSpeed;
+uniform vec3 gravity;
+uniform float pointSize;
+uniform vec4 color;
+
+out vec4 particleColor;
+
+uint hash(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+float random01(inout uint state) {
+    state = hash(state);
+    return float(state >> 8) * (1.0 / 16777216.0);
+}
+
+void main() {
+    float t = time - impact.w;
+    gl_PointSize = pointSize;
+
+    if (impact.w < 0.0 || t > burstLifetime) {
+        // No live burst for this parent, clip the point away
+        particleColor = vec4(0.0);
+        gl_Position = vec4(0.0, 0.0, 2.0, 1.0);
+        return;
+    }
+
+    uint state = hash(uint(gl_InstanceID * burstCount + gl_VertexID) ^ floatBitsToUint(impact.w));
+    float angle = random01(state) * 6.2831853;
+    float spread = random01(state);
+    vec3 velocity = vec3(cos(angle) * spread, 0.5 + 0.5 * random01(state), sin(angle) * spread) * burstSpeed;
+
+    vec3 position = impact.xyz + velocity * t + 0.5 * gravity * t * t;
+    position.y = max(position.y, impact.y);
+
+    particleColor = vec4(color.rgb, color.a * (1.0 - t / burstLifetime));
+    gl_Position = VP * vec4(position, 1.0);
+}
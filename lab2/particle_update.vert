@@ -0,0 +1,91 @@
+#version 330 core
+// Transform feedback pass: advances one particle per vertex, nothing is rasterized
+
+layout(location = 0) in vec4 positionAge;   // xyz position, w age in seconds
+layout(location = 1) in vec4 velocityLife;  // xyz velocity, w lifetime in seconds
+layout(location = 2) in vec4 impact;        // xyz last collision point, w time of the collision (< 0 = none)
+
+out vec4 outPositionAge;
+out vec4 outVelocityLife;
+out vec4 outImpact;
+
+uniform float deltaTime;
+uniform float time;
+uniform uint seed;
+uniform uint frame;
+
+// Emitter
+uniform vec3 origin;
+uniform vec3 spawnMin;
+uniform vec3 spawnMax;
+uniform vec3 velocityMin;
+uniform vec3 velocityMax;
+uniform vec2 lifetimeRange;
+uniform vec3 gravity;
+uniform vec2 wrapExtent;    // x/z half extent of the toroidal wrap around origin, 0 = off
+uniform bool collide;
+uniform float collisionHeight;
+uniform bool useHeightField;
+uniform sampler2D heightField;          // Roof height under each xz, r channel
+uniform vec4 heightFieldTransform;      // uv = xz * .xy + .zw
+
+uint hash(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+float random01(inout uint state) {
+    state = hash(state);
+    return float(state >> 8) * (1.0 / 16777216.0);
+}
+
+vec3 random3(inout uint state) {
+    return vec3(random01(state), random01(state), random01(state));
+}
+
+void main() {
+    vec3 position = positionAge.xyz;
+    vec3 velocity = velocityLife.xyz;
+    float age = positionAge.w + deltaTime;
+    float lifetime = velocityLife.w;
+    vec4 lastImpact = impact;
+
+    velocity += gravity * deltaTime;
+    position += velocity * deltaTime;
+
+    if (wrapExtent.x > 0.0) {
+        vec2 offset = position.xz - origin.xz;
+        position.xz -= 2.0 * wrapExtent * floor((offset + wrapExtent) / (2.0 * wrapExtent));
+    }
+
+    bool dead = age >= lifetime;
+    if (collide) {
+        float floorHeight = collisionHeight;
+        if (useHeightField) {
+            vec2 uv = position.xz * heightFieldTransform.xy + heightFieldTransform.zw;
+            if (all(greaterThanEqual(uv, vec2(0.0))) && all(lessThan(uv, vec2(1.0)))) {
+                floorHeight = max(floorHeight, textureLod(heightField, uv, 0.0).r);
+            }
+        }
+        if (position.y < floorHeight) {
+            lastImpact = vec4(position.x, floorHeight, position.z, time);
+            dead = true;
+        }
+    }
+
+    if (dead) {
+        uint state = hash(uint(gl_VertexID) ^ hash(seed + frame * 0x9e3779b9U));
+        position = origin + mix(spawnMin, spawnMax, random3(state));
+        velocity = mix(velocityMin, velocityMax, random3(state));
+        lifetime = mix(lifetimeRange.x, lifetimeRange.y, random01(state));
+        age = 0.0;
+    }
+
+    outPositionAge = vec4(position, age);
+    outVelocityLife = vec4(velocity, lifetime);
+    outImpact = lastImpact;
+}
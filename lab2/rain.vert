@@ -3,7 +3,94 @@ layout(location = 0) in vec3 position;
 
 uniform mat4 VP;
 
+// Stateless mode: each drop is derived from gl_VertexID / 2, time and a seed
+uniform bool statelessRain;
+uniform float time;
+uniform uint seed;
+uniform float spawnHeight;
+uniform vec3 anchor;       // Centre of the camera-relative rain volume in x and z, its bottom in y
+uniform float extent;      // Half size of the volume in x and z
+uniform vec2 speedRange;   // min, max fall speed
+uniform sampler2D heightField;          // Roof height under each xz, r channel
+uniform vec4 heightFieldTransform;      // uv = xz * .xy + .zw
+
+// Integer hash (lowbias32), good enough to decorrelate neighbouring drops
+uint hash(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+float random01(inout uint state) {
+    state = hash(state);
+    return float(state >> 8) * (1.0 / 16777216.0);
+}
+
+// Ground level outside the field, like HeightField::heightAt, not the clamped edge texel
+float roofHeight(vec2 xz) {
+    vec2 uv = xz * heightFieldTransform.xy + heightFieldTransform.zw;
+    bool inside = all(greaterThanEqual(uv, vec2(0.0))) && all(lessThan(uv, vec2(1.0)));
+    return inside ? textureLod(heightField, uv, 0.0).r : 0.0;
+}
+
+// Returns false only for a drop still under a roof after its last respawn
+bool statelessDrop(out vec3 worldPosition) {
+    uint drop = uint(gl_VertexID) / 2u;
+
+    // Speed and phase stay fixed for the drop's lifetime
+    uint state = hash(drop ^ (seed * 0x9e3779b9U));
+    float speed = mix(speedRange.x, speedRange.y, random01(state));
+    float phase = random01(state) * spawnHeight;
+
+    // Fall distance wraps every spawnHeight, which is the respawn at the top
+    float travelled = phase + speed * time;
+    float cycle = floor(travelled / spawnHeight);
+    float fallen = travelled - cycle * spawnHeight;
+    float t = fallen / speed;
+
+    // A drop that lands on a roof respawns at the top, falling for as long as it has
+    // been under the roof. Each life re-rolls the spawn point, drift and length.
+    state = hash(state ^ uint(cycle));
+    vec3 head;
+    vec3 velocity;
+    float len;
+    bool alive = false;
+    for (int life = 0; life < 4 && !alive; life++) {
+        float x = (random01(state) * 2.0 - 1.0) * extent;
+        float z = (random01(state) * 2.0 - 1.0) * extent;
+        velocity = vec3(random01(state) - 0.5, -speed, random01(state) - 0.5);
+        len = 0.5 + random01(state); // Length between 0.5 and 1.5 units
+
+        head = vec3(x, spawnHeight, z) + velocity * t;
+
+        // The drop tile repeats every 2 * extent in x and z and every spawnHeight in y;
+        // pick the copy inside the volume around the anchor
+        vec2 offset = head.xz - anchor.xz;
+        head.xz -= 2.0 * extent * floor((offset + extent) / (2.0 * extent));
+        head.y -= spawnHeight * floor((head.y - anchor.y) / spawnHeight);
+
+        float roof = roofHeight(head.xz);
+        alive = head.y >= roof;
+        t = (roof - head.y) / speed;
+    }
+
+    if ((gl_VertexID & 1) == 1) {
+        head += normalize(velocity) * len;
+    }
+    worldPosition = head;
+    return alive;
+}
+
 void main() {
-    gl_Position = VP * vec4(position, 1.0);
+    vec3 worldPosition = position;
+    if (statelessRain && !statelessDrop(worldPosition)) {
+        // Both endpoints see the same head, so the whole line is clipped away
+        gl_Position = vec4(0.0, 0.0, 2.0, 1.0);
+        return;
+    }
+    gl_Position = VP * vec4(worldPosition, 1.0);
     //gl_PointSize = 2.0; // Adjust rain drop size
-}
\ No newline at end of file
+}
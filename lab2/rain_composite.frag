@@ -0,0 +1,50 @@
+#version 330 core
+// Depth-aware upsample of the low resolution rain target. Each full-res pixel
+// blends the four nearest low-res texels, weighting the bilinear weights by how
+// close each texel's scene depth is to its own, so rain does not bleed across
+// the edges of buildings. Where no texel is near the pixel's depth, as on a
+// thin foreground edge, the rain fades out instead of painting over it.
+in vec2 uv;
+
+uniform sampler2D rainColor;     // Low res, premultiplied alpha
+uniform sampler2D rainDepth;     // Low res, the depth the rain was tested against
+uniform sampler2D sceneDepth;    // Full res
+uniform vec2 clipRange;          // zNear, zFar
+
+out vec4 FragColor;
+
+float linearDepth(float depth) {
+    float z = depth * 2.0 - 1.0;
+    return 2.0 * clipRange.x * clipRange.y / (clipRange.y + clipRange.x - z * (clipRange.y - clipRange.x));
+}
+
+void main() {
+    float depth = linearDepth(texelFetch(sceneDepth, ivec2(gl_FragCoord.xy), 0).r);
+
+    ivec2 lowSize = textureSize(rainColor, 0);
+    vec2 position = uv * vec2(lowSize) - 0.5;
+    ivec2 base = ivec2(floor(position));
+    vec2 f = position - vec2(base);
+
+    vec4 color = vec4(0.0);
+    float totalWeight = 0.0;
+    float closest = 1e9;             // Smallest relative depth difference of the four
+    for (int i = 0; i < 4; i++) {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 texel = clamp(base + offset, ivec2(0), lowSize - 1);
+
+        vec2 bilinear = mix(1.0 - f, f, vec2(offset));
+        float sampleDepth = linearDepth(texelFetch(rainDepth, texel, 0).r);
+        float difference = abs(sampleDepth - depth) / depth;
+        float similarity = 1.0 / (1e-3 + difference);
+        closest = min(closest, difference);
+        float weight = bilinear.x * bilinear.y * similarity;
+
+        color += texelFetch(rainColor, texel, 0) * weight;
+        totalWeight += weight;
+    }
+
+    // Renormalising alone would give full strength rain even when every texel is off
+    float confidence = 1.0 - smoothstep(0.05, 0.25, closest);
+    FragColor = color / max(totalWeight, 1e-5) * confidence;
+}
@@ -0,0 +1,322 @@
+#include "animation.h"
+
+#include <tiny_gltf.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+bool readAccessorFloats(const tinygltf::Model &model, int accessorIndex, std::vector<float> &out)
+{
+	if (accessorIndex < 0 || accessorIndex >= (int)model.accessors.size()) return false;
+	const tinygltf::Accessor &accessor = model.accessors[accessorIndex];
+
+	// Empty accessors are valid, and would wrap the bounds check below around
+	if (accessor.count == 0) {
+		out.clear();
+		return true;
+	}
+	if (accessor.bufferView < 0) return false;
+
+	const tinygltf::BufferView &bufferView = model.bufferViews[accessor.bufferView];
+	const tinygltf::Buffer &buffer = model.buffers[bufferView.buffer];
+	int components = tinygltf::GetNumComponentsInType(accessor.type);
+	int componentSize = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+	int stride = accessor.ByteStride(bufferView);
+	if (components <= 0 || componentSize <= 0 || stride <= 0) return false;
+
+	size_t begin = bufferView.byteOffset + accessor.byteOffset;
+	if (begin + (accessor.count - 1) * stride + components * componentSize > buffer.data.size()) {
+		std::cerr << "Accessor " << accessorIndex << " runs past its buffer." << std::endl;
+		return false;
+	}
+
+	out.resize(accessor.count * components);
+	const unsigned char *base = buffer.data.data() + begin;
+	for (size_t i = 0; i < accessor.count; i++) {
+		const unsigned char *element = base + i * stride;
+		for (int c = 0; c < components; c++) {
+			const unsigned char *src = element + c * componentSize;
+			float value = 0.0f;
+			switch (accessor.componentType) {
+			case TINYGLTF_COMPONENT_TYPE_FLOAT:
+				memcpy(&value, src, sizeof(float));
+				break;
+			case TINYGLTF_COMPONENT_TYPE_BYTE:
+				value = *(const int8_t *)src;
+				if (accessor.normalized) value = std::max(value / 127.0f, -1.0f);
+				break;
+			case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+				value = *src;
+				if (accessor.normalized) value /= 255.0f;
+				break;
+			case TINYGLTF_COMPONENT_TYPE_SHORT: {
+				int16_t v;
+				memcpy(&v, src, sizeof(v));
+				value = v;
+				if (accessor.normalized) value = std::max(value / 32767.0f, -1.0f);
+				break;
+			}
+			case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
+				uint16_t v;
+				memcpy(&v, src, sizeof(v));
+				value = v;
+				if (accessor.normalized) value /= 65535.0f;
+				break;
+			}
+			case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT: {
+				uint32_t v;
+				memcpy(&v, src, sizeof(v));
+				value = (float)v;
+				break;
+			}
+			default:
+				return false;
+			}
+			out[i * components + c] = value;
+		}
+	}
+	return true;
+}
+
+bool packSkinInfluences(const tinygltf::Model &model, int jointsAccessor, int weightsAccessor,
+	std::vector<unsigned char> &packed)
+{
+	std::vector<float> joints, weights;
+	if (!readAccessorFloats(model, jointsAccessor, joints) || !readAccessorFloats(model, weightsAccessor, weights) ||
+		model.accessors[jointsAccessor].type != TINYGLTF_TYPE_VEC4 ||
+		model.accessors[weightsAccessor].type != TINYGLTF_TYPE_VEC4 ||
+		joints.size() != weights.size()) {
+		return false;
+	}
+
+	size_t vertexCount = joints.size() / 4;
+	packed.resize(vertexCount * 8);
+	for (size_t v = 0; v < vertexCount; v++) {
+		const float *joint = &joints[v * 4];
+		const float *weight = &weights[v * 4];
+		unsigned char *out = &packed[v * 8];
+
+		float total = 0.0f;
+		for (int i = 0; i < 4; i++) {
+			if (joint[i] < 0.0f || joint[i] > 255.0f) return false;
+			total += std::max(weight[i], 0.0f);
+		}
+
+		// Round each weight, then hand the rounding error to the largest one so the sum is exactly 255
+		int sum = 0;
+		int largest = 0;
+		for (int i = 0; i < 4; i++) {
+			float normalized = total > 0.0f ? std::max(weight[i], 0.0f) / total : (i == 0 ? 1.0f : 0.0f);
+			int quantized = (int)(normalized * 255.0f + 0.5f);
+			out[i] = (unsigned char)joint[i];
+			out[4 + i] = (unsigned char)quantized;
+			sum += quantized;
+			if (out[4 + i] > out[4 + largest]) largest = i;
+		}
+		out[4 + largest] = (unsigned char)(out[4 + largest] + 255 - sum);
+	}
+	return true;
+}
+
+std::vector<AnimationClip> loadAnimationClips(const tinygltf::Model &model)
+{
+	std::vector<AnimationClip> clips;
+
+	for (const tinygltf::Animation &animation : model.animations) {
+		AnimationClip clip;
+		clip.name = animation.name;
+
+		for (const tinygltf::AnimationChannel &source : animation.channels) {
+			if (source.target_node < 0 || source.sampler < 0) continue;
+			const tinygltf::AnimationSampler &sampler = animation.samplers[source.sampler];
+
+			AnimationChannel channel;
+			channel.targetNode = source.target_node;
+			if (source.target_path == "translation") {
+				channel.path = ANIMATION_TRANSLATION;
+				channel.components = 3;
+			} else if (source.target_path == "rotation") {
+				channel.path = ANIMATION_ROTATION;
+				channel.components = 4;
+			} else if (source.target_path == "scale") {
+				channel.path = ANIMATION_SCALE;
+				channel.components = 3;
+			} else {
+				continue;	// Morph target weights are not supported
+			}
+
+			if (sampler.interpolation == "STEP") {
+				channel.interpolation = INTERPOLATION_STEP;
+			} else if (sampler.interpolation == "CUBICSPLINE") {
+				channel.interpolation = INTERPOLATION_CUBICSPLINE;
+			} else {
+				channel.interpolation = INTERPOLATION_LINEAR;
+			}
+
+			if (!readAccessorFloats(model, sampler.input, channel.times) ||
+				!readAccessorFloats(model, sampler.output, channel.values) ||
+				channel.times.empty()) {
+				std::cerr << "Skipping unreadable channel in animation " << clip.name << std::endl;
+				continue;
+			}
+
+			size_t valuesPerKey = channel.components * (channel.interpolation == INTERPOLATION_CUBICSPLINE ? 3 : 1);
+			if (channel.values.size() != channel.times.size() * valuesPerKey) {
+				std::cerr << "Mismatched keyframe count in animation " << clip.name << std::endl;
+				continue;
+			}
+
+			clip.duration = std::max(clip.duration, channel.times.back());
+			if (std::find(clip.animatedNodes.begin(), clip.animatedNodes.end(), channel.targetNode) == clip.animatedNodes.end()) {
+				clip.animatedNodes.push_back(channel.targetNode);
+			}
+			clip.channels.push_back(std::move(channel));
+		}
+
+		std::cout << "Animation " << clip.name << ": " << clip.channels.size() << " channels, "
+			<< clip.duration << "s" << std::endl;
+		clips.push_back(std::move(clip));
+	}
+
+	return clips;
+}
+
+void flattenNodeHierarchy(const tinygltf::Model &model, std::vector<int> &order, std::vector<int> &parents)
+{
+	size_t nodeCount = model.nodes.size();
+	parents.assign(nodeCount, -1);
+	for (size_t i = 0; i < nodeCount; i++) {
+		for (int child : model.nodes[i].children) {
+			parents[child] = (int)i;
+		}
+	}
+
+	// Depth-first from every root, children pushed after their parent
+	order.clear();
+	order.reserve(nodeCount);
+	std::vector<int> stack;
+	for (size_t i = 0; i < nodeCount; i++) {
+		if (parents[i] >= 0) continue;
+		stack.push_back((int)i);
+		while (!stack.empty()) {
+			int nodeIndex = stack.back();
+			stack.pop_back();
+			order.push_back(nodeIndex);
+			const std::vector<int> &children = model.nodes[nodeIndex].children;
+			for (auto it = children.rbegin(); it != children.rend(); ++it) {
+				stack.push_back(*it);
+			}
+		}
+	}
+}
+
+std::vector<NodePose> loadRestPoses(const tinygltf::Model &model)
+{
+	std::vector<NodePose> poses(model.nodes.size());
+
+	for (size_t i = 0; i < model.nodes.size(); i++) {
+		const tinygltf::Node &node = model.nodes[i];
+		NodePose &pose = poses[i];
+
+		if (node.matrix.size() == 16) {
+			// Matrix nodes cannot be animated, this only keeps the rest pose consistent
+			glm::mat4 m;
+			for (int j = 0; j < 16; j++) m[j / 4][j % 4] = (float)node.matrix[j];
+			pose.translation = glm::vec3(m[3]);
+			pose.scale = glm::vec3(glm::length(glm::vec3(m[0])), glm::length(glm::vec3(m[1])), glm::length(glm::vec3(m[2])));
+			glm::mat3 rotation(glm::vec3(m[0]) / pose.scale.x, glm::vec3(m[1]) / pose.scale.y, glm::vec3(m[2]) / pose.scale.z);
+			pose.rotation = glm::quat_cast(rotation);
+			continue;
+		}
+
+		if (node.translation.size() == 3) {
+			pose.translation = glm::vec3(node.translation[0], node.translation[1], node.translation[2]);
+		}
+		if (node.rotation.size() == 4) {
+			pose.rotation = glm::quat((float)node.rotation[3], (float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2]);
+		}
+		if (node.scale.size() == 3) {
+			pose.scale = glm::vec3(node.scale[0], node.scale[1], node.scale[2]);
+		}
+	}
+
+	return poses;
+}
+
+int findKeyframeIndex(const std::vector<float> &times, float time, int &cursor)
+{
+	int last = (int)times.size() - 1;
+	if (last <= 0 || time <= times[0]) {
+		cursor = 0;
+		return 0;
+	}
+	if (time >= times[last]) {
+		cursor = last - 1;
+		return cursor;
+	}
+
+	// Forward playback lands in the same or one of the next few intervals
+	int index = std::min(std::max(cursor, 0), last - 1);
+	if (times[index] <= time) {
+		for (int step = 0; step < 4 && index < last; step++, index++) {
+			if (time < times[index + 1]) {
+				cursor = index;
+				return index;
+			}
+		}
+	}
+
+	// Time jumped (seek or loop): binary search
+	index = (int)(std::upper_bound(times.begin(), times.end(), time) - times.begin()) - 1;
+	cursor = index;
+	return index;
+}
+
+static glm::vec4 loadKey(const AnimationChannel &channel, size_t key, int part)
+{
+	// CUBICSPLINE stores [in-tangent, value, out-tangent] per key
+	int parts = channel.interpolation == INTERPOLATION_CUBICSPLINE ? 3 : 1;
+	const float *v = &channel.values[(key * parts + part) * channel.components];
+	return glm::vec4(v[0], v[1], v[2], channel.components == 4 ? v[3] : 0.0f);
+}
+
+glm::vec4 sampleChannel(const AnimationChannel &channel, float time, int &cursor)
+{
+	int valuePart = channel.interpolation == INTERPOLATION_CUBICSPLINE ? 1 : 0;
+	if (channel.times.size() == 1) {
+		return loadKey(channel, 0, valuePart);
+	}
+
+	int k0 = findKeyframeIndex(channel.times, time, cursor);
+	int k1 = k0 + 1;
+	float t0 = channel.times[k0];
+	float t1 = channel.times[k1];
+	float dt = t1 - t0;
+	float u = dt > 0.0f ? glm::clamp((time - t0) / dt, 0.0f, 1.0f) : 0.0f;
+
+	if (channel.interpolation == INTERPOLATION_STEP) {
+		return loadKey(channel, u >= 1.0f ? k1 : k0, 0);
+	}
+
+	if (channel.interpolation == INTERPOLATION_CUBICSPLINE) {
+		float u2 = u * u;
+		float u3 = u2 * u;
+		glm::vec4 value = (2.0f * u3 - 3.0f * u2 + 1.0f) * loadKey(channel, k0, 1)
+			+ (u3 - 2.0f * u2 + u) * dt * loadKey(channel, k0, 2)
+			+ (-2.0f * u3 + 3.0f * u2) * loadKey(channel, k1, 1)
+			+ (u3 - u2) * dt * loadKey(channel, k1, 0);
+		if (channel.path == ANIMATION_ROTATION) {
+			value = glm::normalize(value);
+		}
+		return value;
+	}
+
+	glm::vec4 a = loadKey(channel, k0, 0);
+	glm::vec4 b = loadKey(channel, k1, 0);
+	if (channel.path == ANIMATION_ROTATION) {
+		glm::quat q = glm::slerp(glm::quat(a.w, a.x, a.y, a.z), glm::quat(b.w, b.x, b.y, b.z), u);
+		return glm::vec4(q.x, q.y, q.z, q.w);
+	}
+	return glm::mix(a, b, u);
+}
@@ -0,0 +1,87 @@
+#ifndef _ANIMATION_H_
+#define _ANIMATION_H_
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <string>
+#include <vector>
+
+namespace tinygltf {
+class Model;
+}
+
+// glTF keyframe animation. Sampler accessors are decoded once at load into
+// contiguous float arrays; sampling then only touches those arrays and a
+// per-channel cursor, so forward playback finds its keyframe in O(1).
+
+enum AnimationPath {
+	ANIMATION_TRANSLATION,
+	ANIMATION_ROTATION,
+	ANIMATION_SCALE
+};
+
+enum AnimationInterpolation {
+	INTERPOLATION_LINEAR,
+	INTERPOLATION_STEP,
+	INTERPOLATION_CUBICSPLINE
+};
+
+// Local transform of a node split into its animatable parts
+struct NodePose {
+	glm::vec3 translation = glm::vec3(0.0f);
+	glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+	glm::vec3 scale = glm::vec3(1.0f);
+};
+
+struct AnimationChannel {
+	int targetNode = -1;
+	AnimationPath path = ANIMATION_TRANSLATION;
+	AnimationInterpolation interpolation = INTERPOLATION_LINEAR;
+	int components = 3;				// 3 for translation and scale, 4 for rotation (x, y, z, w)
+	std::vector<float> times;
+	std::vector<float> values;		// 'components' floats per key; in-tangent, value, out-tangent for CUBICSPLINE
+};
+
+struct AnimationClip {
+	std::string name;
+	float duration = 0.0f;
+	std::vector<AnimationChannel> channels;
+	std::vector<int> animatedNodes;	// Every node targeted by at least one channel, no duplicates
+};
+
+// Which clip an instance plays and how its clock relates to the global time
+struct AnimationPlayback {
+	int clip = 0;
+	float timeOffset = 0.0f;
+	float speed = 1.0f;
+};
+
+// Read an accessor as tightly packed floats. Integer components are mapped to
+// [0, 1] / [-1, 1] when the accessor is normalized and kept as is otherwise.
+bool readAccessorFloats(const tinygltf::Model &model, int accessorIndex, std::vector<float> &out);
+
+// Convert JOINTS_0 / WEIGHTS_0 to the compact skinning format: per vertex 4 x
+// uint8 joint indices followed by 4 x unorm8 weights summing to exactly 255.
+// Fails when a joint index does not fit in 8 bits.
+bool packSkinInfluences(const tinygltf::Model &model, int jointsAccessor, int weightsAccessor,
+	std::vector<unsigned char> &packed);
+
+// Decode every animation in the model
+std::vector<AnimationClip> loadAnimationClips(const tinygltf::Model &model);
+
+// Node indices ordered so that every parent comes before its children, and
+// the parent of every node (-1 for roots)
+void flattenNodeHierarchy(const tinygltf::Model &model, std::vector<int> &order, std::vector<int> &parents);
+
+// Rest pose of every node, from its TRS properties or decomposed from its matrix
+std::vector<NodePose> loadRestPoses(const tinygltf::Model &model);
+
+// Index of the keyframe interval [times[i], times[i + 1]) containing 'time'.
+// The cursor from the previous call is tried first and stepped forward; a
+// binary search is only needed when the playback time jumps.
+int findKeyframeIndex(const std::vector<float> &times, float time, int &cursor);
+
+// Value of one channel at 'time', rotations as (x, y, z, w)
+glm::vec4 sampleChannel(const AnimationChannel &channel, float time, int &cursor);
+
+#endif
@@ -0,0 +1,647 @@
+#include "animation_batch.h"
+#include "simd.h"
+#include "worker_pool.h"
+
+#include <tiny_gltf.h>
+#include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+// Four instances side by side, one per lane. The lane kernels below only use
+// these, so targets without SSE run the same code one lane at a time.
+#ifdef RENDER_SSE
+typedef __m128 Lanes;
+
+static inline Lanes load(const float *p) { return _mm_loadu_ps(p); }
+static inline void store(float *p, Lanes v) { _mm_storeu_ps(p, v); }
+static inline Lanes splat(float x) { return _mm_set1_ps(x); }
+static inline Lanes add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+static inline Lanes sub(Lanes a, Lanes b) { return _mm_sub_ps(a, b); }
+static inline Lanes mul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+static inline Lanes inverseSqrt(Lanes a) { return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(a)); }
+
+// v with the sign flipped in the lanes where d is negative
+static inline Lanes flipWhereNegative(Lanes v, Lanes d)
+{
+	return _mm_xor_ps(v, _mm_and_ps(_mm_cmplt_ps(d, _mm_setzero_ps()), _mm_set1_ps(-0.0f)));
+}
+
+static inline void transpose(Lanes &a, Lanes &b, Lanes &c, Lanes &d) { _MM_TRANSPOSE4_PS(a, b, c, d); }
+#else
+struct Lanes { float v[4]; };
+
+static inline Lanes load(const float *p) { Lanes r; memcpy(r.v, p, sizeof(r.v)); return r; }
+static inline void store(float *p, Lanes v) { memcpy(p, v.v, sizeof(v.v)); }
+static inline Lanes splat(float x) { Lanes r = { { x, x, x, x } }; return r; }
+static inline Lanes add(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] += b.v[i]; return a; }
+static inline Lanes sub(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] -= b.v[i]; return a; }
+static inline Lanes mul(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] *= b.v[i]; return a; }
+static inline Lanes inverseSqrt(Lanes a) { for (int i = 0; i < 4; i++) a.v[i] = 1.0f / std::sqrt(a.v[i]); return a; }
+
+static inline Lanes flipWhereNegative(Lanes v, Lanes d)
+{
+	for (int i = 0; i < 4; i++) if (d.v[i] < 0.0f) v.v[i] = -v.v[i];
+	return v;
+}
+
+static inline void transpose(Lanes &a, Lanes &b, Lanes &c, Lanes &d)
+{
+	Lanes *rows[4] = { &a, &b, &c, &d };
+	for (int i = 0; i < 4; i++) {
+		for (int j = i + 1; j < 4; j++) std::swap(rows[i]->v[j], rows[j]->v[i]);
+	}
+}
+#endif
+
+static inline Lanes madd(Lanes a, Lanes b, Lanes c) { return add(mul(a, b), c); }
+
+// out = a * b, column-major, reference path
+static inline void multiply(const float *a, const float *b, float *out)
+{
+	glm::mat4 r = glm::make_mat4(a) * glm::make_mat4(b);
+	memcpy(out, glm::value_ptr(r), 16 * sizeof(float));
+}
+
+// Column-major T * R * S, quaternion as x, y, z, w
+static void composeTRS(const float *t, const float *q, const float *s, float *m)
+{
+	float x = q[0], y = q[1], z = q[2], w = q[3];
+	float xx = x * x, yy = y * y, zz = z * z;
+	float xy = x * y, xz = x * z, yz = y * z;
+	float wx = w * x, wy = w * y, wz = w * z;
+
+	m[0] = (1.0f - 2.0f * (yy + zz)) * s[0];
+	m[1] = 2.0f * (xy + wz) * s[0];
+	m[2] = 2.0f * (xz - wy) * s[0];
+	m[3] = 0.0f;
+	m[4] = 2.0f * (xy - wz) * s[1];
+	m[5] = (1.0f - 2.0f * (xx + zz)) * s[1];
+	m[6] = 2.0f * (yz + wx) * s[1];
+	m[7] = 0.0f;
+	m[8] = 2.0f * (xz + wy) * s[2];
+	m[9] = 2.0f * (yz - wx) * s[2];
+	m[10] = (1.0f - 2.0f * (xx + yy)) * s[2];
+	m[11] = 0.0f;
+	m[12] = t[0];
+	m[13] = t[1];
+	m[14] = t[2];
+	m[15] = 1.0f;
+}
+
+// composeTRS for four instances: t and s are 3 lanes, q 4 lanes, m 16 lanes
+static void composeLanes(const float *t, const float *q, const float *s, float *m)
+{
+	Lanes x = load(q), y = load(q + 4), z = load(q + 8), w = load(q + 12);
+	Lanes xx = mul(x, x), yy = mul(y, y), zz = mul(z, z);
+	Lanes xy = mul(x, y), xz = mul(x, z), yz = mul(y, z);
+	Lanes wx = mul(w, x), wy = mul(w, y), wz = mul(w, z);
+	Lanes sx = load(s), sy = load(s + 4), sz = load(s + 8);
+	Lanes one = splat(1.0f), two = splat(2.0f), zero = splat(0.0f);
+
+	store(m + 0, mul(sub(one, mul(two, add(yy, zz))), sx));
+	store(m + 4, mul(mul(two, add(xy, wz)), sx));
+	store(m + 8, mul(mul(two, sub(xz, wy)), sx));
+	store(m + 12, zero);
+	store(m + 16, mul(mul(two, sub(xy, wz)), sy));
+	store(m + 20, mul(sub(one, mul(two, add(xx, zz))), sy));
+	store(m + 24, mul(mul(two, add(yz, wx)), sy));
+	store(m + 28, zero);
+	store(m + 32, mul(mul(two, add(xz, wy)), sz));
+	store(m + 36, mul(mul(two, sub(yz, wx)), sz));
+	store(m + 40, mul(sub(one, mul(two, add(xx, yy))), sz));
+	store(m + 44, zero);
+	store(m + 48, load(t));
+	store(m + 52, load(t + 4));
+	store(m + 56, load(t + 8));
+	store(m + 60, one);
+}
+
+// out = a * b for four instances, 16 lanes each; out must not alias a or b
+static void multiplyLanes(const float *a, const float *b, float *out)
+{
+	Lanes columns[16];
+	for (int i = 0; i < 16; i++) columns[i] = load(a + i * 4);
+	for (int c = 0; c < 4; c++) {
+		Lanes b0 = load(b + c * 16), b1 = load(b + c * 16 + 4), b2 = load(b + c * 16 + 8), b3 = load(b + c * 16 + 12);
+		for (int r = 0; r < 4; r++) {
+			Lanes v = madd(columns[12 + r], b3, madd(columns[8 + r], b2, madd(columns[4 + r], b1, mul(columns[r], b0))));
+			store(out + (c * 4 + r) * 4, v);
+		}
+	}
+}
+
+// a * b with a 16 lanes and b one matrix shared by every lane. Lane i's
+// result is written to out[i] as a plain column-major matrix.
+static void multiplyLanesOut(const float *a, const float *b, float *const *out, int count)
+{
+	Lanes columns[16];
+	for (int i = 0; i < 16; i++) columns[i] = load(a + i * 4);
+	for (int c = 0; c < 4; c++) {
+		Lanes b0 = splat(b[c * 4]), b1 = splat(b[c * 4 + 1]), b2 = splat(b[c * 4 + 2]), b3 = splat(b[c * 4 + 3]);
+		Lanes rows[4];
+		for (int r = 0; r < 4; r++) {
+			rows[r] = madd(columns[12 + r], b3, madd(columns[8 + r], b2, madd(columns[4 + r], b1, mul(columns[r], b0))));
+		}
+		// Rows of the column across lanes become one column per lane
+		transpose(rows[0], rows[1], rows[2], rows[3]);
+		for (int i = 0; i < count; i++) store(out[i] + c * 4, rows[i]);
+	}
+}
+
+bool AnimationBatch::initialize(const tinygltf::Model &model)
+{
+	if (model.skins.empty()) return false;
+
+	nodeCount = model.nodes.size();
+	flattenNodeHierarchy(model, nodeOrder, nodeParents);
+
+	std::vector<NodePose> rest = loadRestPoses(model);
+	restTranslations.assign(nodeCount * 4, 0.0f);
+	restRotations.assign(nodeCount * 4, 0.0f);
+	restScales.assign(nodeCount * 4, 0.0f);
+	restLocals.resize(nodeCount * 16);
+	for (size_t i = 0; i < nodeCount; i++) {
+		memcpy(&restTranslations[i * 4], glm::value_ptr(rest[i].translation), 3 * sizeof(float));
+		const glm::quat &q = rest[i].rotation;
+		restRotations[i * 4 + 0] = q.x;
+		restRotations[i * 4 + 1] = q.y;
+		restRotations[i * 4 + 2] = q.z;
+		restRotations[i * 4 + 3] = q.w;
+		memcpy(&restScales[i * 4], glm::value_ptr(rest[i].scale), 3 * sizeof(float));
+
+		const tinygltf::Node &node = model.nodes[i];
+		if (node.matrix.size() == 16) {
+			for (int j = 0; j < 16; j++) restLocals[i * 16 + j] = (float)node.matrix[j];
+		} else {
+			composeTRS(&restTranslations[i * 4], &restRotations[i * 4], &restScales[i * 4], &restLocals[i * 16]);
+		}
+	}
+
+	restLaneLocals.resize(nodeCount * 64);
+	for (size_t i = 0; i < nodeCount * 16; i++) {
+		for (int lane = 0; lane < 4; lane++) restLaneLocals[i * 4 + lane] = restLocals[i];
+	}
+
+	clips.clear();
+	for (AnimationClip &source : loadAnimationClips(model)) {
+		Clip clip;
+		clip.name = source.name;
+		clip.duration = source.duration;
+		clip.animatedNodes = source.animatedNodes;
+
+		for (AnimationChannel &sourceChannel : source.channels) {
+			Channel channel;
+			channel.node = sourceChannel.targetNode;
+			channel.path = sourceChannel.path;
+			channel.interpolation = sourceChannel.interpolation;
+			channel.times = sourceChannel.times;
+
+			size_t keyCount = channel.times.size();
+			if (channel.interpolation != INTERPOLATION_CUBICSPLINE) {
+				channel.keys.assign(keyCount * 4, 0.0f);
+				for (size_t k = 0; k < keyCount; k++) {
+					memcpy(&channel.keys[k * 4], &sourceChannel.values[k * sourceChannel.components],
+						sourceChannel.components * sizeof(float));
+				}
+			}
+
+			// Baked exporters write one key per frame; detect that to skip the search
+			channel.uniform = false;
+			channel.firstTime = channel.times.front();
+			channel.inverseStep = 0.0f;
+			if (keyCount > 2) {
+				float step = (channel.times.back() - channel.firstTime) / (keyCount - 1);
+				bool uniform = step > 0.0f;
+				for (size_t k = 0; uniform && k < keyCount; k++) {
+					uniform = std::fabs(channel.times[k] - (channel.firstTime + k * step)) <= step * 1e-3f;
+				}
+				channel.uniform = uniform;
+				channel.inverseStep = uniform ? 1.0f / step : 0.0f;
+			}
+
+			channel.source = std::move(sourceChannel);
+			clip.channels.push_back(std::move(channel));
+		}
+		clips.push_back(std::move(clip));
+	}
+
+	paletteNodes.clear();
+	inverseBindMatrices.clear();
+	for (const tinygltf::Skin &skin : model.skins) {
+		std::vector<float> matrices;
+		bool hasInverseBind = skin.inverseBindMatrices >= 0 &&
+			readAccessorFloats(model, skin.inverseBindMatrices, matrices) &&
+			matrices.size() == skin.joints.size() * 16;
+
+		for (size_t j = 0; j < skin.joints.size(); j++) {
+			paletteNodes.push_back(skin.joints[j]);
+			if (hasInverseBind) {
+				inverseBindMatrices.insert(inverseBindMatrices.end(), &matrices[j * 16], &matrices[j * 16] + 16);
+			} else {
+				const float *identity = glm::value_ptr(glm::mat4(1.0f));
+				inverseBindMatrices.insert(inverseBindMatrices.end(), identity, identity + 16);
+			}
+		}
+	}
+
+	return true;
+}
+
+size_t AnimationBatch::channelCount() const
+{
+	size_t count = 0;
+	for (const Clip &clip : clips) count = std::max(count, clip.channels.size());
+	return count;
+}
+
+float AnimationBatch::sampleSegment(const Channel &channel, bool compressed, float time, int *cursor,
+	glm::vec4 &a, glm::vec4 &b) const
+{
+	int localCursor = 0;
+	if (compressed) {
+		return sampleCompressedSegment(channel.compressed, time, cursor ? *cursor : localCursor, a, b);
+	}
+	if (channel.interpolation == INTERPOLATION_CUBICSPLINE) {
+		a = b = ::sampleChannel(channel.source, time, cursor ? *cursor : localCursor);
+		return 0.0f;
+	}
+
+	const std::vector<float> &times = channel.times;
+	int last = (int)times.size() - 1;
+	if (last <= 0) {
+		a = b = glm::make_vec4(&channel.keys[0]);
+		return 0.0f;
+	}
+
+	int k0;
+	if (cursor) {
+		k0 = findKeyframeIndex(times, time, *cursor);
+	} else if (time <= times[0]) {
+		k0 = 0;
+	} else if (time >= times[last]) {
+		k0 = last - 1;
+	} else if (channel.uniform) {
+		k0 = std::min(std::max((int)((time - channel.firstTime) * channel.inverseStep), 0), last - 1);
+		if (time < times[k0] && k0 > 0) k0--;
+		else if (time >= times[k0 + 1] && k0 < last - 1) k0++;
+	} else {
+		k0 = (int)(std::upper_bound(times.begin(), times.end(), time) - times.begin()) - 1;
+	}
+
+	float t0 = times[k0];
+	float dt = times[k0 + 1] - t0;
+	float u = dt > 0.0f ? std::min(std::max((time - t0) / dt, 0.0f), 1.0f) : 0.0f;
+	a = glm::make_vec4(&channel.keys[k0 * 4]);
+	b = glm::make_vec4(&channel.keys[k0 * 4 + 4]);
+
+	if (channel.interpolation == INTERPOLATION_STEP) {
+		if (u >= 1.0f) a = b;
+		else b = a;
+		return 0.0f;
+	}
+	return u;
+}
+
+void AnimationBatch::evaluateOne(const AnimationRequest &request, Scratch &s, float *palette) const
+{
+	memcpy(s.locals.data(), restLocals.data(), restLocals.size() * sizeof(float));
+
+	if (request.clip >= 0 && request.clip < (int)clips.size()) {
+		const Clip &clip = clips[request.clip];
+
+		for (int node : clip.animatedNodes) {
+			memcpy(&s.translations[node * 4], &restTranslations[node * 4], 4 * sizeof(float));
+			memcpy(&s.rotations[node * 4], &restRotations[node * 4], 4 * sizeof(float));
+			memcpy(&s.scales[node * 4], &restScales[node * 4], 4 * sizeof(float));
+		}
+
+		for (size_t c = 0; c < clip.channels.size(); c++) {
+			const Channel &channel = clip.channels[c];
+			float *target = channel.path == ANIMATION_TRANSLATION ? &s.translations[channel.node * 4]
+				: channel.path == ANIMATION_ROTATION ? &s.rotations[channel.node * 4]
+				: &s.scales[channel.node * 4];
+			int *cursor = request.cursors ? &request.cursors[c] : nullptr;
+
+			glm::vec4 a, b;
+			float u = sampleSegment(channel, clip.compressed, request.time, cursor, a, b);
+			glm::vec4 value = glm::mix(a, b, u);
+			if (channel.path == ANIMATION_ROTATION) {
+				glm::quat q = glm::slerp(glm::quat(a.w, a.x, a.y, a.z), glm::quat(b.w, b.x, b.y, b.z), u);
+				value = glm::vec4(q.x, q.y, q.z, q.w);
+			}
+			memcpy(target, glm::value_ptr(value), 4 * sizeof(float));
+		}
+
+		for (int node : clip.animatedNodes) {
+			composeTRS(&s.translations[node * 4], &s.rotations[node * 4], &s.scales[node * 4], &s.locals[node * 16]);
+		}
+	}
+
+	// Parents first, one multiply per node
+	for (int node : nodeOrder) {
+		int parent = nodeParents[node];
+		if (parent < 0) {
+			memcpy(&s.globals[node * 16], &s.locals[node * 16], 16 * sizeof(float));
+		} else {
+			multiply(&s.globals[parent * 16], &s.locals[node * 16], &s.globals[node * 16]);
+		}
+	}
+
+	for (size_t j = 0; j < paletteNodes.size(); j++) {
+		multiply(&s.globals[paletteNodes[j] * 16], &inverseBindMatrices[j * 16], palette + j * 16);
+	}
+}
+
+void AnimationBatch::evaluateLanes(const AnimationRequest *const *requests, int count, Scratch &s,
+	float *const *palettes) const
+{
+	memcpy(s.laneLocals.data(), restLaneLocals.data(), restLaneLocals.size() * sizeof(float));
+
+	// Every lane plays the same clip, only the times and cursors differ
+	int clipIndex = requests[0]->clip;
+	if (clipIndex >= 0 && clipIndex < (int)clips.size()) {
+		const Clip &clip = clips[clipIndex];
+
+		for (int node : clip.animatedNodes) {
+			for (int c = 0; c < 3; c++) {
+				store(&s.laneTranslations[node * 12 + c * 4], splat(restTranslations[node * 4 + c]));
+				store(&s.laneScales[node * 12 + c * 4], splat(restScales[node * 4 + c]));
+			}
+			for (int c = 0; c < 4; c++) {
+				store(&s.laneRotations[node * 16 + c * 4], splat(restRotations[node * 4 + c]));
+			}
+		}
+
+		for (size_t c = 0; c < clip.channels.size(); c++) {
+			const Channel &channel = clip.channels[c];
+
+			// Key search and decoding per instance; unused lanes repeat the last one
+			glm::vec4 a[4], b[4];
+			float u[4];
+			for (int i = 0; i < 4; i++) {
+				if (i < count) {
+					const AnimationRequest &request = *requests[i];
+					int *cursor = request.cursors ? &request.cursors[c] : nullptr;
+					u[i] = sampleSegment(channel, clip.compressed, request.time, cursor, a[i], b[i]);
+				} else {
+					a[i] = a[count - 1];
+					b[i] = b[count - 1];
+					u[i] = u[count - 1];
+				}
+			}
+
+			Lanes ax = load(glm::value_ptr(a[0])), ay = load(glm::value_ptr(a[1]));
+			Lanes az = load(glm::value_ptr(a[2])), aw = load(glm::value_ptr(a[3]));
+			Lanes bx = load(glm::value_ptr(b[0])), by = load(glm::value_ptr(b[1]));
+			Lanes bz = load(glm::value_ptr(b[2])), bw = load(glm::value_ptr(b[3]));
+			transpose(ax, ay, az, aw);
+			transpose(bx, by, bz, bw);
+			Lanes t = load(u);
+
+			if (channel.path != ANIMATION_ROTATION) {
+				float *target = channel.path == ANIMATION_TRANSLATION ? &s.laneTranslations[channel.node * 12]
+					: &s.laneScales[channel.node * 12];
+				store(target, madd(sub(bx, ax), t, ax));
+				store(target + 4, madd(sub(by, ay), t, ay));
+				store(target + 8, madd(sub(bz, az), t, az));
+				continue;
+			}
+
+			// nlerp along the shorter arc
+			Lanes d = madd(ax, bx, madd(ay, by, madd(az, bz, mul(aw, bw))));
+			bx = flipWhereNegative(bx, d);
+			by = flipWhereNegative(by, d);
+			bz = flipWhereNegative(bz, d);
+			bw = flipWhereNegative(bw, d);
+			Lanes rx = madd(sub(bx, ax), t, ax), ry = madd(sub(by, ay), t, ay);
+			Lanes rz = madd(sub(bz, az), t, az), rw = madd(sub(bw, aw), t, aw);
+			Lanes scale = inverseSqrt(madd(rx, rx, madd(ry, ry, madd(rz, rz, mul(rw, rw)))));
+
+			float *target = &s.laneRotations[channel.node * 16];
+			store(target, mul(rx, scale));
+			store(target + 4, mul(ry, scale));
+			store(target + 8, mul(rz, scale));
+			store(target + 12, mul(rw, scale));
+
+			// nlerp drifts from slerp as the arc grows; lanes with large jumps between keys take the slow path
+			float dots[4];
+			store(dots, d);
+			for (int i = 0; i < count; i++) {
+				if (std::fabs(dots[i]) >= 0.95f) continue;
+				glm::quat q = glm::slerp(glm::quat(a[i].w, a[i].x, a[i].y, a[i].z), glm::quat(b[i].w, b[i].x, b[i].y, b[i].z), u[i]);
+				target[i] = q.x;
+				target[4 + i] = q.y;
+				target[8 + i] = q.z;
+				target[12 + i] = q.w;
+			}
+		}
+
+		for (int node : clip.animatedNodes) {
+			composeLanes(&s.laneTranslations[node * 12], &s.laneRotations[node * 16], &s.laneScales[node * 12],
+				&s.laneLocals[node * 64]);
+		}
+	}
+
+	// Parents first, one multiply per node for all four instances
+	for (int node : nodeOrder) {
+		int parent = nodeParents[node];
+		if (parent < 0) {
+			memcpy(&s.laneGlobals[node * 64], &s.laneLocals[node * 64], 64 * sizeof(float));
+		} else {
+			multiplyLanes(&s.laneGlobals[parent * 64], &s.laneLocals[node * 64], &s.laneGlobals[node * 64]);
+		}
+	}
+
+	float *out[4];
+	for (size_t j = 0; j < paletteNodes.size(); j++) {
+		for (int i = 0; i < count; i++) out[i] = palettes[i] + j * 16;
+		multiplyLanesOut(&s.laneGlobals[paletteNodes[j] * 64], &inverseBindMatrices[j * 16], out, count);
+	}
+}
+
+void AnimationBatch::prepareScratch(Scratch &s) const
+{
+	if (s.locals.size() == nodeCount * 16) return;
+	s.translations.assign(nodeCount * 4, 0.0f);
+	s.rotations.assign(nodeCount * 4, 0.0f);
+	s.scales.assign(nodeCount * 4, 0.0f);
+	s.locals.assign(nodeCount * 16, 0.0f);
+	s.globals.assign(nodeCount * 16, 0.0f);
+	s.laneTranslations.assign(nodeCount * 12, 0.0f);
+	s.laneRotations.assign(nodeCount * 16, 0.0f);
+	s.laneScales.assign(nodeCount * 12, 0.0f);
+	s.laneLocals.assign(nodeCount * 64, 0.0f);
+	s.laneGlobals.assign(nodeCount * 64, 0.0f);
+}
+
+void AnimationBatch::removeRootMotion()
+{
+	std::vector<bool> joint(nodeCount, false);
+	for (int node : paletteNodes) joint[node] = true;
+
+	for (Clip &clip : clips) {
+		if (clip.compressed) continue;
+
+		for (Channel &channel : clip.channels) {
+			int node = channel.node;
+			if (channel.path != ANIMATION_TRANSLATION || node < 0 || !joint[node]) continue;
+			if (nodeParents[node] >= 0 && joint[nodeParents[node]]) continue;
+
+			// CUBICSPLINE keys are in-tangent, value, out-tangent
+			AnimationChannel &source = channel.source;
+			bool cubic = channel.interpolation == INTERPOLATION_CUBICSPLINE;
+			size_t stride = source.components * (cubic ? 3 : 1);
+			size_t valueOffset = cubic ? source.components : 0;
+			if (source.components != 3 || source.values.size() < stride) continue;
+
+			const float *rest = &restTranslations[node * 4];
+			float firstHeight = source.values[valueOffset + 1];
+			for (size_t k = 0; k * stride < source.values.size(); k++) {
+				float *key = &source.values[k * stride];
+				if (cubic) {
+					key[0] = key[2] = 0.0f;
+					key[6] = key[8] = 0.0f;
+				}
+				float *value = key + valueOffset;
+				value[0] = rest[0];
+				value[1] = rest[1] + value[1] - firstHeight;
+				value[2] = rest[2];
+				if (!channel.keys.empty()) memcpy(&channel.keys[k * 4], value, 3 * sizeof(float));
+			}
+		}
+	}
+}
+
+void AnimationBatch::compress(const AnimationCompressionSettings &settings)
+{
+	Scratch original, compressed;
+	prepareScratch(original);
+	prepareScratch(compressed);
+	std::vector<float> palette(paletteNodes.size() * 16);
+
+	// Skeleton size from the rest pose joint positions
+	AnimationRequest restRequest = { -1, 0.0f, nullptr };
+	evaluateOne(restRequest, original, palette.data());
+	glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+	for (int node : paletteNodes) {
+		glm::vec3 position = glm::make_vec3(&original.globals[node * 16 + 12]);
+		low = glm::min(low, position);
+		high = glm::max(high, position);
+	}
+	float skeletonSize = paletteNodes.empty() ? 1.0f : glm::length(high - low);
+
+	for (size_t c = 0; c < clips.size(); c++) {
+		Clip &clip = clips[c];
+		if (clip.compressed) continue;
+
+		size_t originalBytes = 0, compressedBytes = 0;
+		size_t originalKeys = 0, compressedKeys = 0;
+		for (Channel &channel : clip.channels) {
+			channel.compressed = compressChannel(channel.source, settings, skeletonSize);
+			originalBytes += channelSizeInBytes(channel.source);
+			compressedBytes += channel.compressed.sizeInBytes();
+			originalKeys += channel.source.times.size();
+			compressedKeys += channel.compressed.times.size();
+		}
+
+		// Worst model space joint position over the clip, sampled at 60 Hz
+		float maxError = 0.0f;
+		int steps = std::max(1, (int)std::ceil(clip.duration * 60.0f));
+		for (int step = 0; step <= steps; step++) {
+			AnimationRequest request = { (int)c, clip.duration * step / steps, nullptr };
+			clip.compressed = false;
+			evaluateOne(request, original, palette.data());
+			clip.compressed = true;
+			evaluateOne(request, compressed, palette.data());
+
+			for (int node : paletteNodes) {
+				glm::vec3 a = glm::make_vec3(&original.globals[node * 16 + 12]);
+				glm::vec3 b = glm::make_vec3(&compressed.globals[node * 16 + 12]);
+				maxError = std::max(maxError, glm::length(a - b));
+			}
+		}
+
+		// Only the compressed keys stay resident
+		for (Channel &channel : clip.channels) {
+			std::vector<float>().swap(channel.times);
+			std::vector<float>().swap(channel.keys);
+			channel.source = AnimationChannel();
+		}
+
+		std::cout << "Compressed clip " << clip.name << ": " << std::fixed << std::setprecision(1)
+			<< originalBytes / 1024.0 << " KB -> " << compressedBytes / 1024.0 << " KB ("
+			<< (float)originalBytes / std::max<size_t>(compressedBytes, 1) << ":1), "
+			<< 100.0 * compressedKeys / std::max<size_t>(originalKeys, 1) << "% of keys kept, max joint error "
+			<< std::setprecision(4) << maxError << std::defaultfloat << std::endl;
+	}
+}
+
+void AnimationBatch::evaluate(const AnimationRequest *requests, size_t count, float *out, WorkerPool *pool)
+{
+	if (count == 0 || paletteNodes.empty()) return;
+
+	// Small batches are not worth waking the workers for
+	bool parallel = pool != nullptr && count >= 64;
+	size_t chunks = parallel ? pool->chunkCount() : 1;
+	if (scratch.size() < chunks) scratch.resize(chunks);
+	for (size_t c = 0; c < chunks; c++) {
+		prepareScratch(scratch[c]);
+	}
+
+	size_t stride = paletteNodes.size() * 16;
+	if (!useSIMD) {
+		auto job = [&](size_t begin, size_t end, unsigned int chunk) {
+			for (size_t i = begin; i < end; i++) {
+				evaluateOne(requests[i], scratch[chunk], out + i * stride);
+			}
+		};
+		if (parallel) {
+			pool->parallelFor(count, 16, job);
+		} else {
+			job(0, count, 0);
+		}
+		return;
+	}
+
+	// Lanes must share a clip: counting sort by clip, rest pose requests first,
+	// then groups of up to four within each clip's run
+	auto bucket = [&](const AnimationRequest &request) {
+		return request.clip >= 0 && request.clip < (int)clips.size() ? (size_t)request.clip + 1 : 0;
+	};
+	clipStarts.assign(clips.size() + 2, 0);
+	for (size_t i = 0; i < count; i++) clipStarts[bucket(requests[i]) + 1]++;
+	for (size_t b = 1; b < clipStarts.size(); b++) clipStarts[b] += clipStarts[b - 1];
+
+	requestOrder.resize(count);
+	groupStarts.clear();
+	for (size_t b = 0; b + 1 < clipStarts.size(); b++) {
+		for (size_t first = clipStarts[b]; first < clipStarts[b + 1]; first += 4) groupStarts.push_back(first);
+	}
+	groupStarts.push_back(count);
+	for (size_t i = 0; i < count; i++) requestOrder[clipStarts[bucket(requests[i])]++] = i;
+
+	auto job = [&](size_t begin, size_t end, unsigned int chunk) {
+		const AnimationRequest *lanes[4];
+		float *palettes[4];
+		for (size_t g = begin; g < end; g++) {
+			int lanesUsed = (int)(groupStarts[g + 1] - groupStarts[g]);
+			for (int i = 0; i < lanesUsed; i++) {
+				size_t index = requestOrder[groupStarts[g] + i];
+				lanes[i] = &requests[index];
+				palettes[i] = out + index * stride;
+			}
+			evaluateLanes(lanes, lanesUsed, scratch[chunk], palettes);
+		}
+	};
+
+	size_t groups = groupStarts.size() - 1;
+	if (parallel) {
+		pool->parallelFor(groups, 4, job);
+	} else {
+		job(0, groups, 0);
+	}
+}
@@ -0,0 +1,117 @@
+#ifndef _ANIMATION_BATCH_H_
+#define _ANIMATION_BATCH_H_
+
+#include "animation.h"
+#include "animation_compression.h"
+
+#include <cstddef>
+#include <vector>
+
+class WorkerPool;
+
+// One pose to evaluate: clip index (-1 for the rest pose), seconds into the
+// clip, and optionally the instance's per-channel cursors (see findKeyframeIndex)
+struct AnimationRequest {
+	int clip;
+	float time;
+	int *cursors;
+};
+
+// Pose evaluation for many instances at once. Requests are grouped by clip
+// and evaluated four at a time, one instance per SSE lane: the working set is
+// structure of arrays (every x, y, z, w and matrix element holds four
+// instances), so sampling (nlerp for rotations), TRS composition, the
+// hierarchy walk and the palette product are vertical SSE kernels. Only the
+// key search and decoding are per instance. Each palette is written straight
+// into the caller's upload buffer and groups are split across a WorkerPool.
+class AnimationBatch {
+public:
+	// Copies clips, hierarchy and skins out of the model; false if it has no skins
+	bool initialize(const tinygltf::Model &model);
+
+	// Matrices per request, every skin's joints back to back
+	size_t paletteSize() const { return paletteNodes.size(); }
+
+	size_t clipCount() const { return clips.size(); }
+	float clipDuration(int clip) const { return clips[clip].duration; }
+
+	// Cursors a request needs: the most channels of any clip
+	size_t channelCount() const;
+
+	// Play locomotion clips in place: root joints keep the rest pose's horizontal
+	// translation and only bob vertically relative to their first key, so every
+	// clip starts over the rest pose. Call before compress.
+	void removeRootMotion();
+
+	// Replace the keys of every clip with quantized, curve-fitted ones (see
+	// compressChannel) and print the size and worst joint position error per clip
+	void compress(const AnimationCompressionSettings &settings = AnimationCompressionSettings());
+
+	// Writes count * paletteSize() column-major matrices to 'out'
+	void evaluate(const AnimationRequest *requests, size_t count, float *out, WorkerPool *pool = nullptr);
+
+	// Reference path with glm and slerp, one request at a time, for benchmarking
+	// against the lane kernels
+	bool useSIMD = true;
+
+private:
+	struct Channel {
+		int node;
+		AnimationPath path;
+		AnimationInterpolation interpolation;
+		std::vector<float> times;
+		std::vector<float> keys;	// 4 floats per key (xyz0 or quaternion xyzw), LINEAR and STEP only
+		bool uniform;				// Evenly spaced keys, index found without searching
+		float firstTime;
+		float inverseStep;
+		AnimationChannel source;	// CUBICSPLINE channels fall back to sampleChannel
+		CompressedChannel compressed;
+	};
+
+	struct Clip {
+		std::string name;
+		float duration;
+		bool compressed = false;	// Sample Channel::compressed, the float keys are released
+		std::vector<Channel> channels;
+		std::vector<int> animatedNodes;
+	};
+
+	// Per-thread working set, sized once
+	struct Scratch {
+		// Reference path, one instance
+		std::vector<float> translations, rotations, scales;	// 4 floats per node
+		std::vector<float> locals, globals;					// 16 floats per node
+
+		// Lane kernels, four instances: every component is 4 floats, so a node
+		// takes 12 floats of translation, 16 of rotation, 12 of scale, 64 per matrix
+		std::vector<float> laneTranslations, laneRotations, laneScales;
+		std::vector<float> laneLocals, laneGlobals;
+	};
+
+	void prepareScratch(Scratch &scratch) const;
+	void evaluateOne(const AnimationRequest &request, Scratch &scratch, float *palette) const;
+	void evaluateLanes(const AnimationRequest *const *requests, int count, Scratch &scratch, float *const *palettes) const;
+	float sampleSegment(const Channel &channel, bool compressed, float time, int *cursor, glm::vec4 &a, glm::vec4 &b) const;
+
+	size_t nodeCount = 0;
+	std::vector<int> nodeOrder;
+	std::vector<int> nodeParents;
+	std::vector<float> restTranslations, restRotations, restScales;
+	std::vector<float> restLocals;
+	std::vector<float> restLaneLocals;	// restLocals repeated across the four lanes
+
+	std::vector<Clip> clips;
+
+	std::vector<int> paletteNodes;
+	std::vector<float> inverseBindMatrices;
+
+	std::vector<Scratch> scratch;
+
+	// evaluate's grouping: requests sorted by clip, where each clip's run
+	// starts, and the first sorted request of every group of four lanes
+	std::vector<size_t> requestOrder;
+	std::vector<size_t> clipStarts;
+	std::vector<size_t> groupStarts;
+};
+
+#endif
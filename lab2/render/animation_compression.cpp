@@ -0,0 +1,219 @@
+#include "animation_compression.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const float kSqrt2 = 1.41421356f;
+
+size_t CompressedChannel::sizeInBytes() const
+{
+	return times.size() * sizeof(float) + values.size() * sizeof(uint16_t) + 2 * sizeof(glm::vec3);
+}
+
+size_t channelSizeInBytes(const AnimationChannel &channel)
+{
+	return (channel.times.size() + channel.values.size()) * sizeof(float);
+}
+
+// Drop the largest component (recomputed on decode from unit length) after
+// making it positive; the other three lie in [-1/sqrt(2), 1/sqrt(2)]
+static void encodeRotation(glm::vec4 q, uint16_t *out)
+{
+	int largest = 0;
+	for (int i = 1; i < 4; i++) {
+		if (std::fabs(q[i]) > std::fabs(q[largest])) largest = i;
+	}
+	if (q[largest] < 0.0f) q = -q;
+
+	uint16_t v[3];
+	for (int i = 0, j = 0; i < 4; i++) {
+		if (i == largest) continue;
+		float unit = glm::clamp(q[i] * kSqrt2 * 0.5f + 0.5f, 0.0f, 1.0f);
+		v[j++] = (uint16_t)(unit * 32767.0f + 0.5f);
+	}
+	out[0] = (uint16_t)(((largest >> 1) << 15) | v[0]);
+	out[1] = (uint16_t)(((largest & 1) << 15) | v[1]);
+	out[2] = v[2];
+}
+
+static glm::vec4 decodeRotation(const uint16_t *in)
+{
+	int largest = ((in[0] >> 15) << 1) | (in[1] >> 15);
+	float c[3];
+	for (int j = 0; j < 3; j++) {
+		c[j] = ((in[j] & 0x7fff) / 32767.0f * 2.0f - 1.0f) / kSqrt2;
+	}
+
+	glm::vec4 q;
+	for (int i = 0, j = 0; i < 4; i++) {
+		q[i] = i == largest ? 0.0f : c[j++];
+	}
+	q[largest] = std::sqrt(std::max(0.0f, 1.0f - c[0] * c[0] - c[1] * c[1] - c[2] * c[2]));
+	return glm::normalize(q);
+}
+
+static glm::vec4 decodeValue(const CompressedChannel &channel, const uint16_t *v)
+{
+	if (channel.path == ANIMATION_ROTATION) {
+		return decodeRotation(v);
+	}
+	glm::vec3 unit(v[0], v[1], v[2]);
+	return glm::vec4(channel.rangeMin + unit / 65535.0f * channel.rangeExtent, 0.0f);
+}
+
+static glm::vec4 decodeKey(const CompressedChannel &channel, size_t key)
+{
+	return decodeValue(channel, &channel.values[key * 3]);
+}
+
+static glm::vec4 interpolate(AnimationPath path, const glm::vec4 &a, const glm::vec4 &b, float u)
+{
+	if (path == ANIMATION_ROTATION) {
+		glm::quat q = glm::slerp(glm::quat(a.w, a.x, a.y, a.z), glm::quat(b.w, b.x, b.y, b.z), u);
+		return glm::vec4(q.x, q.y, q.z, q.w);
+	}
+	return glm::mix(a, b, u);
+}
+
+// Rotations compare by angle, translations by distance, scales per component
+static float keyError(AnimationPath path, const glm::vec4 &a, const glm::vec4 &b)
+{
+	if (path == ANIMATION_ROTATION) {
+		return 2.0f * std::acos(std::min(std::fabs(glm::dot(a, b)), 1.0f));
+	}
+	if (path == ANIMATION_TRANSLATION) {
+		return glm::length(glm::vec3(a) - glm::vec3(b));
+	}
+	glm::vec3 d = glm::abs(glm::vec3(a) - glm::vec3(b));
+	return std::max(d.x, std::max(d.y, d.z));
+}
+
+CompressedChannel compressChannel(const AnimationChannel &source, const AnimationCompressionSettings &settings,
+	float skeletonSize)
+{
+	CompressedChannel channel;
+	channel.targetNode = source.targetNode;
+	channel.path = source.path;
+	channel.interpolation = source.interpolation == INTERPOLATION_STEP ? INTERPOLATION_STEP : INTERPOLATION_LINEAR;
+
+	// Plain keys to fit against; splines are sampled densely first
+	std::vector<float> times;
+	std::vector<glm::vec4> keys;
+	int cursor = 0;
+	if (source.interpolation == INTERPOLATION_CUBICSPLINE && source.times.size() > 1) {
+		float start = source.times.front();
+		float span = source.times.back() - start;
+		int count = std::max(2, (int)std::ceil(span * settings.resampleRate) + 1);
+		for (int i = 0; i < count; i++) {
+			float time = i + 1 < count ? start + span * i / (count - 1) : source.times.back();
+			times.push_back(time);
+			keys.push_back(sampleChannel(source, time, cursor));
+		}
+	} else {
+		times = source.times;
+		for (float time : source.times) {
+			keys.push_back(sampleChannel(source, time, cursor));
+		}
+	}
+	size_t count = keys.size();
+	if (count == 0) return channel;
+
+	// Quantize every key up front so the fit accounts for quantization error
+	float tolerance = settings.rotationTolerance;
+	if (channel.path != ANIMATION_ROTATION) {
+		glm::vec3 low = glm::vec3(keys[0]);
+		glm::vec3 high = low;
+		for (const glm::vec4 &key : keys) {
+			low = glm::min(low, glm::vec3(key));
+			high = glm::max(high, glm::vec3(key));
+		}
+		channel.rangeMin = low;
+		channel.rangeExtent = high - low;
+
+		// Never tighter than the quantization step
+		tolerance = channel.path == ANIMATION_TRANSLATION ? settings.translationTolerance * skeletonSize : settings.scaleTolerance;
+		tolerance = std::max(tolerance, glm::length(channel.rangeExtent) / 65535.0f);
+	}
+
+	std::vector<uint16_t> encoded(count * 3);
+	std::vector<glm::vec4> decoded(count);
+	for (size_t k = 0; k < count; k++) {
+		uint16_t *v = &encoded[k * 3];
+		if (channel.path == ANIMATION_ROTATION) {
+			encodeRotation(keys[k], v);
+		} else {
+			glm::vec3 unit = (glm::vec3(keys[k]) - channel.rangeMin) / glm::max(channel.rangeExtent, glm::vec3(1e-20f));
+			for (int c = 0; c < 3; c++) {
+				v[c] = (uint16_t)(glm::clamp(unit[c], 0.0f, 1.0f) * 65535.0f + 0.5f);
+			}
+		}
+		decoded[k] = decodeValue(channel, v);
+	}
+
+	// Greedy fit: extend each segment from the last kept key until one of the
+	// keys it skips would be off by more than the tolerance
+	std::vector<size_t> kept(1, 0);
+	if (channel.interpolation == INTERPOLATION_STEP) {
+		for (size_t k = 1; k < count; k++) {
+			if (k + 1 == count || keyError(channel.path, decoded[k], decoded[kept.back()]) > 0.0f) kept.push_back(k);
+		}
+	} else {
+		size_t anchor = 0;
+		for (size_t end = 2; end < count; end++) {
+			float t0 = times[anchor];
+			float dt = times[end] - t0;
+			bool fits = true;
+			for (size_t k = anchor + 1; fits && k < end; k++) {
+				float u = dt > 0.0f ? (times[k] - t0) / dt : 0.0f;
+				fits = keyError(channel.path, interpolate(channel.path, decoded[anchor], decoded[end], u), keys[k]) <= tolerance;
+			}
+			if (!fits) {
+				anchor = end - 1;
+				kept.push_back(anchor);
+			}
+		}
+		if (count > 1) kept.push_back(count - 1);
+	}
+
+	// A channel that never moves needs a single key
+	if (kept.size() == 2 && keyError(channel.path, decoded[kept[0]], decoded[kept[1]]) == 0.0f) {
+		kept.pop_back();
+	}
+
+	channel.times.reserve(kept.size());
+	channel.values.reserve(kept.size() * 3);
+	for (size_t k : kept) {
+		channel.times.push_back(times[k]);
+		channel.values.insert(channel.values.end(), &encoded[k * 3], &encoded[k * 3] + 3);
+	}
+	return channel;
+}
+
+float sampleCompressedSegment(const CompressedChannel &channel, float time, int &cursor, glm::vec4 &a, glm::vec4 &b)
+{
+	if (channel.times.size() == 1) {
+		a = b = decodeKey(channel, 0);
+		return 0.0f;
+	}
+
+	int k0 = findKeyframeIndex(channel.times, time, cursor);
+	int k1 = k0 + 1;
+	float t0 = channel.times[k0];
+	float dt = channel.times[k1] - t0;
+	float u = dt > 0.0f ? glm::clamp((time - t0) / dt, 0.0f, 1.0f) : 0.0f;
+
+	if (channel.interpolation == INTERPOLATION_STEP) {
+		a = b = decodeKey(channel, u >= 1.0f ? k1 : k0);
+		return 0.0f;
+	}
+	a = decodeKey(channel, k0);
+	b = decodeKey(channel, k1);
+	return u;
+}
+
+glm::vec4 sampleCompressedChannel(const CompressedChannel &channel, float time, int &cursor)
+{
+	glm::vec4 a, b;
+	float u = sampleCompressedSegment(channel, time, cursor, a, b);
+	return u > 0.0f ? interpolate(channel.path, a, b, u) : a;
+}
@@ -0,0 +1,49 @@
+#ifndef _ANIMATION_COMPRESSION_H_
+#define _ANIMATION_COMPRESSION_H_
+
+#include "animation.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Compact storage for animation channels. Keys that linear interpolation of
+// the kept keys reproduces within tolerance are dropped, then every value is
+// quantized to 48 bits: rotations as smallest-three quaternions (2 bit index,
+// 3 x 15 bits), translations and scales as 3 x 16 bits within the channel's
+// range. Sampling decodes only the two keys around the requested time.
+
+struct AnimationCompressionSettings {
+	float rotationTolerance = 0.001f;		// Radians
+	float translationTolerance = 0.0002f;	// Fraction of the skeleton's size
+	float scaleTolerance = 0.001f;
+	float resampleRate = 60.0f;				// CUBICSPLINE channels become linear keys at this rate
+};
+
+struct CompressedChannel {
+	int targetNode = -1;
+	AnimationPath path = ANIMATION_TRANSLATION;
+	AnimationInterpolation interpolation = INTERPOLATION_LINEAR;	// LINEAR or STEP
+	std::vector<float> times;
+	std::vector<uint16_t> values;			// 3 per key
+	glm::vec3 rangeMin = glm::vec3(0.0f);	// Translation and scale dequantization
+	glm::vec3 rangeExtent = glm::vec3(0.0f);
+
+	size_t sizeInBytes() const;
+};
+
+// Bytes used by the decoded float keys of a channel
+size_t channelSizeInBytes(const AnimationChannel &channel);
+
+// 'skeletonSize' turns the relative translation tolerance into model units
+CompressedChannel compressChannel(const AnimationChannel &channel, const AnimationCompressionSettings &settings,
+	float skeletonSize);
+
+// Same contract as sampleChannel: rotations as (x, y, z, w), cursor updated for the next call
+glm::vec4 sampleCompressedChannel(const CompressedChannel &channel, float time, int &cursor);
+
+// The decoded keys around 'time' and the fraction between them, for callers
+// that interpolate themselves. STEP and single key channels return one key twice.
+float sampleCompressedSegment(const CompressedChannel &channel, float time, int &cursor, glm::vec4 &a, glm::vec4 &b);
+
+#endif
@@ -0,0 +1,249 @@
+#include "particles.h"
+#include "shader.h"
+
+#include <glm/gtc/type_ptr.hpp>
+#include <cstdlib>
+#include <iostream>
+
+// Interleaved per-particle state, matches the outputs of particle_update.vert
+struct ParticleState {
+	glm::vec4 positionAge;		// xyz position, w age in seconds
+	glm::vec4 velocityLife;		// xyz velocity, w lifetime in seconds
+	glm::vec4 impact;			// xyz last collision point, w time of the collision (< 0 = none)
+};
+
+static float random01() {
+	return (rand() % 10000) / 10000.0f;
+}
+
+static glm::vec3 randomIn(const glm::vec3 &lo, const glm::vec3 &hi) {
+	return glm::mix(lo, hi, glm::vec3(random01(), random01(), random01()));
+}
+
+static void setupStateAttributes(GLuint divisor) {
+	for (GLuint i = 0; i < 3; i++) {
+		glEnableVertexAttribArray(i);
+		glVertexAttribPointer(i, 4, GL_FLOAT, GL_FALSE, sizeof(ParticleState),
+			(void*)(i * sizeof(glm::vec4)));
+		glVertexAttribDivisor(i, divisor);
+	}
+}
+
+bool ParticleEngine::initialize()
+{
+	const char *varyings[] = { "outPositionAge", "outVelocityLife", "outImpact" };
+	updateProgramID = LoadTransformFeedbackShaderFromFile("../lab2/particle_update.vert", varyings, 3);
+	renderProgramID = LoadShadersFromFile("../lab2/particle.vert", "../lab2/particle.frag");
+	burstProgramID = LoadShadersFromFile("../lab2/particle_burst.vert", "../lab2/particle.frag");
+	if (updateProgramID == 0 || renderProgramID == 0 || burstProgramID == 0) {
+		std::cerr << "Failed to load particle shaders." << std::endl;
+		return false;
+	}
+
+	updDeltaTimeID = glGetUniformLocation(updateProgramID, "deltaTime");
+	updTimeID = glGetUniformLocation(updateProgramID, "time");
+	updSeedID = glGetUniformLocation(updateProgramID, "seed");
+	updFrameID = glGetUniformLocation(updateProgramID, "frame");
+	updOriginID = glGetUniformLocation(updateProgramID, "origin");
+	updSpawnMinID = glGetUniformLocation(updateProgramID, "spawnMin");
+	updSpawnMaxID = glGetUniformLocation(updateProgramID, "spawnMax");
+	updVelocityMinID = glGetUniformLocation(updateProgramID, "velocityMin");
+	updVelocityMaxID = glGetUniformLocation(updateProgramID, "velocityMax");
+	updLifetimeID = glGetUniformLocation(updateProgramID, "lifetimeRange");
+	updGravityID = glGetUniformLocation(updateProgramID, "gravity");
+	updWrapExtentID = glGetUniformLocation(updateProgramID, "wrapExtent");
+	updCollideID = glGetUniformLocation(updateProgramID, "collide");
+	updCollisionHeightID = glGetUniformLocation(updateProgramID, "collisionHeight");
+	updHeightFieldID = glGetUniformLocation(updateProgramID, "heightField");
+	updUseHeightFieldID = glGetUniformLocation(updateProgramID, "useHeightField");
+	updHeightFieldTransformID = glGetUniformLocation(updateProgramID, "heightFieldTransform");
+
+	renVPID = glGetUniformLocation(renderProgramID, "VP");
+	renStreakID = glGetUniformLocation(renderProgramID, "streak");
+	renStreakLengthID = glGetUniformLocation(renderProgramID, "streakLength");
+	renPointSizeID = glGetUniformLocation(renderProgramID, "pointSize");
+	renColorID = glGetUniformLocation(renderProgramID, "color");
+
+	burVPID = glGetUniformLocation(burstProgramID, "VP");
+	burTimeID = glGetUniformLocation(burstProgramID, "time");
+	burBurstCountID = glGetUniformLocation(burstProgramID, "burstCount");
+	burLifetimeID = glGetUniformLocation(burstProgramID, "burstLifetime");
+	burSpeedID = glGetUniformLocation(burstProgramID, "burstSpeed");
+	burGravityID = glGetUniformLocation(burstProgramID, "gravity");
+	burPointSizeID = glGetUniformLocation(burstProgramID, "pointSize");
+	burColorID = glGetUniformLocation(burstProgramID, "color");
+
+	return true;
+}
+
+ParticleSystem *ParticleEngine::createSystem(const ParticleEmitterDesc &desc)
+{
+	ParticleSystem *system = new ParticleSystem();
+	system->desc = desc;
+	system->seed = (unsigned int)systems.size() * 0x9e3779b9u + 1u;
+
+	// One-time fill so the emitter starts in a steady state instead of a single wave.
+	// Colliding particles are spread between the plane and their spawn height.
+	std::vector<ParticleState> initial(desc.maxParticles);
+	for (ParticleState &particle : initial) {
+		glm::vec3 position = system->origin + randomIn(desc.spawnMin, desc.spawnMax);
+		float lifetime = glm::mix(desc.lifetime.x, desc.lifetime.y, random01());
+		float age = random01() * lifetime;
+		if (desc.collide) {
+			position.y = glm::mix(desc.collisionHeight, position.y, random01());
+			age = 0.0f;
+		}
+		particle.positionAge = glm::vec4(position, age);
+		particle.velocityLife = glm::vec4(randomIn(desc.velocityMin, desc.velocityMax), lifetime);
+		particle.impact = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+	}
+
+	glGenBuffers(2, system->buffers);
+	glGenVertexArrays(2, system->updateVAOs);
+	glGenVertexArrays(2, system->renderVAOs);
+
+	for (int i = 0; i < 2; i++) {
+		glBindBuffer(GL_ARRAY_BUFFER, system->buffers[i]);
+		glBufferData(GL_ARRAY_BUFFER, initial.size() * sizeof(ParticleState), initial.data(), GL_DYNAMIC_COPY);
+
+		glBindVertexArray(system->updateVAOs[i]);
+		setupStateAttributes(0);
+
+		glBindVertexArray(system->renderVAOs[i]);
+		setupStateAttributes(1);
+	}
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	systems.push_back(system);
+	return system;
+}
+
+void ParticleEngine::update(float deltaTime)
+{
+	time += deltaTime;
+	frame++;
+
+	glUseProgram(updateProgramID);
+	glUniform1f(updDeltaTimeID, deltaTime);
+	glUniform1f(updTimeID, time);
+	glUniform1ui(updFrameID, frame);
+
+	glEnable(GL_RASTERIZER_DISCARD);
+	for (ParticleSystem *system : systems) {
+		if (system->enabled) updateSystem(*system);
+	}
+	glDisable(GL_RASTERIZER_DISCARD);
+
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	glBindVertexArray(0);
+}
+
+void ParticleEngine::updateSystem(ParticleSystem &system)
+{
+	const ParticleEmitterDesc &desc = system.desc;
+
+	glUniform1ui(updSeedID, system.seed);
+	glUniform3fv(updOriginID, 1, glm::value_ptr(system.origin));
+	glUniform3fv(updSpawnMinID, 1, glm::value_ptr(desc.spawnMin));
+	glUniform3fv(updSpawnMaxID, 1, glm::value_ptr(desc.spawnMax));
+	glUniform3fv(updVelocityMinID, 1, glm::value_ptr(desc.velocityMin));
+	glUniform3fv(updVelocityMaxID, 1, glm::value_ptr(desc.velocityMax));
+	glUniform2fv(updLifetimeID, 1, glm::value_ptr(desc.lifetime));
+	glUniform3fv(updGravityID, 1, glm::value_ptr(desc.gravity));
+	glUniform2fv(updWrapExtentID, 1, glm::value_ptr(desc.wrapExtent));
+	glUniform1i(updCollideID, desc.collide);
+	glUniform1f(updCollisionHeightID, desc.collisionHeight);
+	glUniform1i(updUseHeightFieldID, desc.heightFieldTexture != 0);
+	if (desc.heightFieldTexture != 0) {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, desc.heightFieldTexture);
+		glUniform1i(updHeightFieldID, 0);
+		glUniform4fv(updHeightFieldTransformID, 1, glm::value_ptr(desc.heightFieldTransform));
+	}
+
+	int destination = 1 - system.source;
+	glBindVertexArray(system.updateVAOs[system.source]);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, system.buffers[destination]);
+
+	glBeginTransformFeedback(GL_POINTS);
+	glDrawArrays(GL_POINTS, 0, desc.maxParticles);
+	glEndTransformFeedback();
+
+	system.source = destination;
+}
+
+void ParticleEngine::render(const glm::mat4 &vp)
+{
+	glEnable(GL_BLEND);
+	glEnable(GL_PROGRAM_POINT_SIZE);
+	glDepthMask(GL_FALSE);
+
+	for (ParticleSystem *system : systems) {
+		if (system->enabled) renderSystem(*system, vp);
+	}
+
+	glDepthMask(GL_TRUE);
+	glDisable(GL_PROGRAM_POINT_SIZE);
+	glDisable(GL_BLEND);
+	glBindVertexArray(0);
+}
+
+void ParticleEngine::renderSystem(ParticleSystem &system, const glm::mat4 &vp)
+{
+	const ParticleEmitterDesc &desc = system.desc;
+	// Alpha tracks coverage so the result also composites from an off-screen target
+	if (desc.additive) {
+		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE, GL_ZERO, GL_ONE);
+	} else {
+		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	}
+	glBindVertexArray(system.renderVAOs[system.source]);
+
+	glUseProgram(renderProgramID);
+	glUniformMatrix4fv(renVPID, 1, GL_FALSE, glm::value_ptr(vp));
+	glUniform1i(renStreakID, desc.shape == PARTICLE_STREAK);
+	glUniform2fv(renStreakLengthID, 1, glm::value_ptr(desc.streakLength));
+	glUniform1f(renPointSizeID, desc.pointSize);
+	glUniform4fv(renColorID, 1, glm::value_ptr(desc.color));
+
+	// One instance per particle: two vertices for a streak, one for a point
+	if (desc.shape == PARTICLE_STREAK) {
+		glDrawArraysInstanced(GL_LINES, 0, 2, desc.maxParticles);
+	} else {
+		glDrawArraysInstanced(GL_POINTS, 0, 1, desc.maxParticles);
+	}
+
+	if (!system.hasBurst) return;
+
+	// Collision bursts: one instance per parent, burstCount points each
+	const ParticleBurstDesc &burst = system.burst;
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glUseProgram(burstProgramID);
+	glUniformMatrix4fv(burVPID, 1, GL_FALSE, glm::value_ptr(vp));
+	glUniform1f(burTimeID, time);
+	glUniform1i(burBurstCountID, burst.burstCount);
+	glUniform1f(burLifetimeID, burst.lifetime);
+	glUniform1f(burSpeedID, burst.speed);
+	glUniform3fv(burGravityID, 1, glm::value_ptr(burst.gravity));
+	glUniform1f(burPointSizeID, burst.pointSize);
+	glUniform4fv(burColorID, 1, glm::value_ptr(burst.color));
+
+	glDrawArraysInstanced(GL_POINTS, 0, burst.burstCount, desc.maxParticles);
+}
+
+void ParticleEngine::cleanup()
+{
+	for (ParticleSystem *system : systems) {
+		glDeleteBuffers(2, system->buffers);
+		glDeleteVertexArrays(2, system->updateVAOs);
+		glDeleteVertexArrays(2, system->renderVAOs);
+		delete system;
+	}
+	systems.clear();
+
+	glDeleteProgram(updateProgramID);
+	glDeleteProgram(renderProgramID);
+	glDeleteProgram(burstProgramID);
+}
@@ -0,0 +1,126 @@
+#ifndef _PARTICLES_H_
+#define _PARTICLES_H_
+
+#include <glad/gl.h>
+#include <glm/glm.hpp>
+#include <vector>
+
+// GPU particle engine built on GL 3.3 transform feedback. Particle state lives
+// in two ping-ponged VBOs; particle_update.vert advances every particle once per
+// frame with rasterization disabled, so the CPU never touches particle data
+// after the initial fill.
+
+enum ParticleShape {
+	PARTICLE_STREAK,	// Line along the velocity, e.g. rain
+	PARTICLE_POINT		// Point sprite fading out over its lifetime, e.g. sparks
+};
+
+// Spawn and simulation parameters for one emitter. Spawn positions are picked
+// uniformly in [spawnMin, spawnMax] relative to the emitter origin.
+struct ParticleEmitterDesc {
+	int maxParticles = 1000;
+	glm::vec3 spawnMin = glm::vec3(-1.0f);
+	glm::vec3 spawnMax = glm::vec3(1.0f);
+	glm::vec3 velocityMin = glm::vec3(0.0f);
+	glm::vec3 velocityMax = glm::vec3(0.0f);
+	glm::vec2 lifetime = glm::vec2(1.0f, 1.0f);	// min, max seconds
+	glm::vec3 gravity = glm::vec3(0.0f);
+
+	// Non-zero wraps x and z toroidally into origin +- wrapExtent, so the volume
+	// can follow a moving origin (the camera) without respawning particles
+	glm::vec2 wrapExtent = glm::vec2(0.0f);
+
+	// Particles crossing y = collisionHeight record an impact and respawn.
+	// With a height field (GL_R32F, heights in world units) the plane is raised
+	// to the height under the particle; uv = xz * transform.xy + transform.zw.
+	bool collide = false;
+	float collisionHeight = 0.0f;
+	GLuint heightFieldTexture = 0;
+	glm::vec4 heightFieldTransform = glm::vec4(0.0f);
+
+	ParticleShape shape = PARTICLE_POINT;
+	glm::vec2 streakLength = glm::vec2(0.5f, 1.5f);	// min, max for PARTICLE_STREAK
+	float pointSize = 2.0f;
+	glm::vec4 color = glm::vec4(1.0f);
+	bool additive = false;
+};
+
+// Sub-emitter fired by collisions: every impact plays a burst of burstCount
+// points. The burst is evaluated analytically from the parent's last impact,
+// so the pool is simply burstCount slots per parent particle.
+struct ParticleBurstDesc {
+	int burstCount = 4;
+	float lifetime = 0.3f;
+	float speed = 3.0f;
+	glm::vec3 gravity = glm::vec3(0.0f, -9.8f, 0.0f);
+	float pointSize = 2.0f;
+	glm::vec4 color = glm::vec4(1.0f);
+};
+
+class ParticleSystem {
+public:
+	ParticleEmitterDesc desc;
+	glm::vec3 origin = glm::vec3(0.0f);	// Moves the whole spawn volume, e.g. to follow a light
+	bool enabled = true;
+
+	bool hasBurst = false;
+	ParticleBurstDesc burst;
+
+	// Fire a burst of points from every collision of this emitter
+	void setCollisionBurst(const ParticleBurstDesc &burstDesc) {
+		burst = burstDesc;
+		hasBurst = true;
+	}
+
+private:
+	friend class ParticleEngine;
+
+	GLuint buffers[2];
+	GLuint updateVAOs[2];	// Per-vertex state, input of the update pass
+	GLuint renderVAOs[2];	// Per-instance state, drawn as streaks or points
+	int source = 0;			// Buffer holding the current state
+	unsigned int seed = 0;
+};
+
+class ParticleEngine {
+public:
+	bool initialize();
+
+	// Create an emitter and fill its buffers once; the engine owns the result
+	ParticleSystem *createSystem(const ParticleEmitterDesc &desc);
+
+	// Advance every enabled system on the GPU
+	void update(float deltaTime);
+
+	// Draw every enabled system and its collision bursts
+	void render(const glm::mat4 &vp);
+
+	void cleanup();
+
+private:
+	void updateSystem(ParticleSystem &system);
+	void renderSystem(ParticleSystem &system, const glm::mat4 &vp);
+
+	std::vector<ParticleSystem *> systems;
+	float time = 0.0f;
+	unsigned int frame = 0;
+
+	GLuint updateProgramID = 0;
+	GLuint renderProgramID = 0;
+	GLuint burstProgramID = 0;
+
+	// particle_update.vert
+	GLint updDeltaTimeID, updTimeID, updSeedID, updFrameID, updOriginID;
+	GLint updSpawnMinID, updSpawnMaxID, updVelocityMinID, updVelocityMaxID;
+	GLint updLifetimeID, updGravityID, updWrapExtentID, updCollideID, updCollisionHeightID;
+	GLint updHeightFieldID, updUseHeightFieldID, updHeightFieldTransformID;
+
+	// particle.vert
+	GLint renVPID, renStreakID, renStreakLengthID, renPointSizeID, renColorID;
+
+	// particle_burst.vert
+	GLint burVPID, burTimeID, burBurstCountID, burLifetimeID, burSpeedID, burGravityID;
+	GLint burPointSizeID, burColorID;
+};
+
+#endif
@@ -5,50 +5,510 @@
 #include <fstream>
 #include <sstream> 
 #include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 
-GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_file_path)
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+ShaderProgram::ShaderProgram(GLuint program) : programID(program)
 {
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+	if (program == 0) return;
+
+	GLint count = 0, maxLength = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	std::vector<char> name(maxLength + 1);
+	for (GLint i = 0; i < count; i++) {
+		UniformSlot slot;
+		GLsizei length = 0;
+		glGetActiveUniform(program, i, (GLsizei)name.size(), &length, &slot.size, &slot.type, name.data());
+		slot.name.assign(name.data(), length);
+		// Arrays are reported as "name[0]", look them up by their bare name
+		if (slot.name.size() > 3 && slot.name.compare(slot.name.size() - 3, 3, "[0]") == 0) {
+			slot.name.resize(slot.name.size() - 3);
+		}
+		slot.location = glGetUniformLocation(program, name.data());
+		slot.cached = false;
+		// Uniform block members have no location and cannot be set directly
+		if (slot.location >= 0) uniforms.push_back(slot);
+	}
+
+	glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &count);
+	glGetProgramiv(program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+	name.resize(maxLength + 1);
+	for (GLint i = 0; i < count; i++) {
+		GLint size;
+		GLenum type;
+		GLsizei length = 0;
+		glGetActiveAttrib(program, i, (GLsizei)name.size(), &length, &size, &type, name.data());
+		AttributeSlot slot;
+		slot.name.assign(name.data(), length);
+		slot.location = glGetAttribLocation(program, name.data());
+		attributes.push_back(slot);
+	}
+
+	// GLSL 330 cannot pick a block's binding point itself
+	GLuint frameData = glGetUniformBlockIndex(program, "FrameData");
+	if (frameData != GL_INVALID_INDEX) {
+		glUniformBlockBinding(program, frameData, kFrameDataBinding);
+	}
+}
+
+int ShaderProgram::findUniform(const char *name, GLenum type) const
+{
+	for (size_t i = 0; i < uniforms.size(); i++) {
+		if (uniforms[i].name != name) continue;
+
+		// Samplers and booleans are set as ints
+		GLenum actual = uniforms[i].type;
+		bool intLike = actual == GL_BOOL || (actual >= GL_SAMPLER_1D && actual <= GL_SAMPLER_2D_SHADOW) ||
+			actual == GL_SAMPLER_2D_ARRAY || actual == GL_SAMPLER_BUFFER || actual == GL_INT_SAMPLER_BUFFER ||
+			actual == GL_UNSIGNED_INT_SAMPLER_BUFFER || actual == GL_SAMPLER_2D_MULTISAMPLE;
+		if (actual != type && !(type == GL_INT && intLike)) {
+			printf("Uniform %s has type 0x%x, set as 0x%x\n", name, actual, type);
+			return -1;
+		}
+		return (int)i;
+	}
+	return -1;
+}
+
+GLint ShaderProgram::attribute(const char *name) const
+{
+	for (const AttributeSlot &slot : attributes) {
+		if (slot.name == name) return slot.location;
+	}
+	return -1;
+}
+
+void ShaderProgram::invalidate()
+{
+	for (UniformSlot &slot : uniforms) {
+		slot.cached = false;
+	}
+}
+
+void ShaderProgram::upload(GLint location, const int &value) { glUniform1i(location, value); }
+void ShaderProgram::upload(GLint location, const float &value) { glUniform1f(location, value); }
+void ShaderProgram::upload(GLint location, const glm::ivec2 &value) { glUniform2i(location, value.x, value.y); }
+void ShaderProgram::upload(GLint location, const glm::vec2 &value) { glUniform2fv(location, 1, &value[0]); }
+void ShaderProgram::upload(GLint location, const glm::vec3 &value) { glUniform3fv(location, 1, &value[0]); }
+void ShaderProgram::upload(GLint location, const glm::vec4 &value) { glUniform4fv(location, 1, &value[0]); }
+void ShaderProgram::upload(GLint location, const glm::mat3 &value) { glUniformMatrix3fv(location, 1, GL_FALSE, &value[0][0]); }
+void ShaderProgram::upload(GLint location, const glm::mat4 &value) { glUniformMatrix4fv(location, 1, GL_FALSE, &value[0][0]); }
+
+// Compile-time switches go right after #version, which has to stay the first statement
+static void InsertDefines(std::string &code, const char *defines)
+{
+	if (defines == nullptr || *defines == '\0') return;
+	size_t position = 0;
+	size_t version = code.find("#version");
+	if (version != std::string::npos) {
+		size_t lineEnd = code.find('\n', version);
+		position = lineEnd == std::string::npos ? code.size() : lineEnd + 1;
+	}
+	code.insert(position, defines);
+}
+
+// Reads a shader and splices in the files named by its #include "file" lines,
+// resolved relative to the including file
+static bool ReadShaderFile(const std::string &path, std::string &code, int depth = 0)
+{
+	std::ifstream stream(path, std::ios::in);
+	if (!stream.is_open() || depth > 8) {
+		return false;
+	}
+
+	std::string directory;
+	size_t slash = path.find_last_of("/\\");
+	if (slash != std::string::npos) directory = path.substr(0, slash + 1);
+
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(stream, line)) {
+		lineNumber++;
+		size_t directive = line.find("#include");
+		if (directive != std::string::npos && line.find_first_not_of(" \t") == directive) {
+			size_t open = line.find('"', directive);
+			size_t close = open == std::string::npos ? std::string::npos : line.find('"', open + 1);
+			if (close == std::string::npos ||
+				!ReadShaderFile(directory + line.substr(open + 1, close - open - 1), code, depth + 1)) {
+				printf("Cannot include %s in %s.\n", line.c_str(), path.c_str());
+				return false;
+			}
+			// Keep line numbers of the including file meaningful in compile errors
+			code += "#line " + std::to_string(lineNumber + 1) + "\n";
+			continue;
+		}
+		code += line;
+		code += '\n';
+	}
+	return true;
+}
+
+// Program binary cache, GL_ARB_get_program_binary (core in 4.1, not in the 3.3 loader)
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+
+typedef void (GLAD_API_PTR *GetProgramBinaryProc)(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+typedef void (GLAD_API_PTR *ProgramBinaryProc)(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+typedef void (GLAD_API_PTR *ProgramParameteriProc)(GLuint program, GLenum pname, GLint value);
+
+static struct ProgramBinaryCache {
+	bool enabled = false;
+	std::string directory;
+	std::string driver;			// Vendor, renderer and version, part of every key
+	GetProgramBinaryProc getProgramBinary = nullptr;
+	ProgramBinaryProc programBinary = nullptr;
+	ProgramParameteriProc programParameteri = nullptr;
+} programCache;
+
+static ShaderLoadStats shaderLoadStats;
+
+// Header in front of the driver's blob
+struct ProgramBinaryHeader {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t length;
+};
+static const uint32_t kProgramBinaryMagic = 0x42504c47;	// "GLPB"
+
+static bool HasExtension(const char *name)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++) {
+		const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+		if (extension != nullptr && strcmp(extension, name) == 0) return true;
+	}
+	return false;
+}
+
+bool EnableProgramBinaryCache(GLADloadfunc load, const char *directory)
+{
+	programCache = ProgramBinaryCache();
+
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (major * 10 + minor < 41 && !HasExtension("GL_ARB_get_program_binary")) {
+		printf("Program binary cache off: GL_ARB_get_program_binary not supported\n");
+		return false;
+	}
+	programCache.getProgramBinary = (GetProgramBinaryProc)load("glGetProgramBinary");
+	programCache.programBinary = (ProgramBinaryProc)load("glProgramBinary");
+	programCache.programParameteri = (ProgramParameteriProc)load("glProgramParameteri");
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (!programCache.getProgramBinary || !programCache.programBinary || !programCache.programParameteri || formats == 0) {
+		printf("Program binary cache off: the driver offers no binary formats\n");
+		return false;
+	}
+
+#ifdef _WIN32
+	_mkdir(directory);
+#else
+	mkdir(directory, 0755);
+#endif
+	programCache.directory = directory;
+	programCache.directory += '/';
+	programCache.driver = std::string((const char *)glGetString(GL_VENDOR)) + '\n' +
+		(const char *)glGetString(GL_RENDERER) + '\n' + (const char *)glGetString(GL_VERSION);
+	programCache.enabled = true;
+	return true;
+}
+
+const ShaderLoadStats &GetShaderLoadStats()
+{
+	return shaderLoadStats;
+}
+
+// FNV-1a over both stages and the driver, as the cache file name
+static std::string ProgramCachePath(const std::string &vertexCode, const std::string &fragmentCode)
+{
+	uint64_t hash = 14695981039346656037ull;
+	const std::string *parts[] = { &vertexCode, &fragmentCode, &programCache.driver };
+	for (const std::string *part : parts) {
+		for (size_t i = 0; i <= part->size(); i++) {
+			hash = (hash ^ (unsigned char)part->c_str()[i]) * 1099511628211ull;
+		}
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+	return programCache.directory + name;
+}
+
+// Linked program from the cache, 0 on a miss or when the driver refuses the binary
+static GLuint LoadCachedProgram(const std::string &path)
+{
+	std::ifstream stream(path, std::ios::in | std::ios::binary);
+	ProgramBinaryHeader header;
+	if (!stream.read((char *)&header, sizeof(header)) || header.magic != kProgramBinaryMagic) {
+		return 0;
+	}
+	std::vector<char> binary(header.length);
+	if (!stream.read(binary.data(), binary.size())) {
+		return 0;
+	}
+
+	GLuint ProgramID = glCreateProgram();
+	programCache.programBinary(ProgramID, header.format, binary.data(), (GLsizei)binary.size());
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if (!Result) {
+		// Stale after a driver change the version string did not show, replaced below
+		glDeleteProgram(ProgramID);
+		return 0;
+	}
+	return ProgramID;
+}
+
+static void StoreCachedProgram(const std::string &path, GLuint program)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	programCache.getProgramBinary(program, length, &length, &format, binary.data());
+	ProgramBinaryHeader header = { kProgramBinaryMagic, format, (uint32_t)length };
+
+	std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	stream.write((const char *)&header, sizeof(header));
+	stream.write(binary.data(), length);
+	if (!stream) {
+		printf("Cannot write program binary %s\n", path.c_str());
+	}
+}
+
+// A program whose compile and link have been issued but not checked yet
+struct PendingProgram {
+	std::string vertexPath;
+	std::string fragmentPath;
+	std::string cachePath;
+	GLuint vertexShader = 0;
+	GLuint fragmentShader = 0;
+	GLuint program = 0;
+	bool fromCache = false;
+	std::chrono::steady_clock::time_point issued;
+};
+
+// Issued by PrecompileShaders, claimed by LoadShadersFromFile
+static std::vector<PendingProgram> pendingPrograms;
+
+typedef void (GLAD_API_PTR *MaxShaderCompilerThreadsProc)(GLuint count);
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Reads both stages, then restores the program from the binary cache or
+// starts compiling and linking it. Nothing here reads a compile or link status.
+static bool IssueProgram(const char *vertex_file_path, const char *fragment_file_path, PendingProgram &pending)
+{
+	pending.issued = std::chrono::steady_clock::now();
+	pending.vertexPath = vertex_file_path;
+	pending.fragmentPath = fragment_file_path;
 
 	// Read the Vertex Shader code from the file
 	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if (VertexShaderStream.is_open())
-	{
-		std::stringstream sstr;
-		sstr << VertexShaderStream.rdbuf();
-		VertexShaderCode = sstr.str();
-		VertexShaderStream.close();
-	}
-	else
+	if (!ReadShaderFile(vertex_file_path, VertexShaderCode))
 	{
 		printf("Vertex shader not found %s.\n", vertex_file_path);
-		return 0;
+		return false;
 	}
 
 	// Read the Fragment Shader code from the file
 	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if (FragmentShaderStream.is_open())
-	{
-		std::stringstream sstr;
-		sstr << FragmentShaderStream.rdbuf();
-		FragmentShaderCode = sstr.str();
-		FragmentShaderStream.close();
-	}
-	else
+	if (!ReadShaderFile(fragment_file_path, FragmentShaderCode))
 	{
 		printf("Fragment shader not found %s.\n", fragment_file_path);
-		return 0;
+		return false;
+	}
+
+	if (programCache.enabled) {
+		pending.cachePath = ProgramCachePath(VertexShaderCode, FragmentShaderCode);
+		pending.program = LoadCachedProgram(pending.cachePath);
+		if (pending.program != 0) {
+			pending.fromCache = true;
+			return true;
+		}
+	}
+
+	// Compile Vertex Shader
+	printf("Compiling vertex shader : %s\n", vertex_file_path);
+	pending.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+	char const *VertexSourcePointer = VertexShaderCode.c_str();
+	glShaderSource(pending.vertexShader, 1, &VertexSourcePointer, NULL);
+	glCompileShader(pending.vertexShader);
+
+	// Compile Fragment Shader
+	printf("Compiling fragment shader : %s\n", fragment_file_path);
+	pending.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+	char const *FragmentSourcePointer = FragmentShaderCode.c_str();
+	glShaderSource(pending.fragmentShader, 1, &FragmentSourcePointer, NULL);
+	glCompileShader(pending.fragmentShader);
+
+	// Link the program, a stage that failed to compile makes the link fail too
+	printf("Linking program\n");
+	pending.program = glCreateProgram();
+	glAttachShader(pending.program, pending.vertexShader);
+	glAttachShader(pending.program, pending.fragmentShader);
+	if (programCache.enabled) {
+		programCache.programParameteri(pending.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	}
+	glLinkProgram(pending.program);
+	return true;
+}
+
+static bool CheckShader(GLuint shader, const char *stage, const std::string &path)
+{
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &Result);
+	if (!Result) {
+		printf("Error compiling %s shader : %s\n", stage, path.c_str());
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &InfoLogLength);
+		if (InfoLogLength > 0) {
+			std::vector<char> ShaderErrorMessage(InfoLogLength + 1);
+			glGetShaderInfoLog(shader, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+			printf("%s\n", &ShaderErrorMessage[0]);
+		}
+	}
+	return Result == GL_TRUE;
+}
+
+// Waits for the driver, reports errors and timing and stores new binaries.
+// Returns the program, 0 when it failed.
+static GLuint FinishProgram(PendingProgram &pending)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	GLuint ProgramID = pending.program;
+
+	if (!pending.fromCache) {
+		// Blocks until the driver is done with the link
+		GLint Result = GL_FALSE;
+		int InfoLogLength;
+		glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+		bool vertexCompiled = CheckShader(pending.vertexShader, "vertex", pending.vertexPath);
+		bool fragmentCompiled = CheckShader(pending.fragmentShader, "fragment", pending.fragmentPath);
+		if (!Result && vertexCompiled && fragmentCompiled) {
+			printf("Error linking program\n");
+			glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+			if (InfoLogLength > 0)
+			{
+				std::vector<char> ProgramErrorMessage(InfoLogLength + 1);
+				glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+				printf("%s\n", &ProgramErrorMessage[0]);
+			}
+		}
+
+		glDetachShader(ProgramID, pending.vertexShader);
+		glDetachShader(ProgramID, pending.fragmentShader);
+		glDeleteShader(pending.vertexShader);
+		glDeleteShader(pending.fragmentShader);
+
+		if (!Result) {
+			glDeleteProgram(ProgramID);
+			return 0;
+		}
+		if (programCache.enabled) {
+			StoreCachedProgram(pending.cachePath, ProgramID);
+		}
+	}
+
+	printf("Program %s, %s : %s, ready %.1f ms after issue, waited %.1f ms\n",
+		pending.vertexPath.c_str(), pending.fragmentPath.c_str(), pending.fromCache ? "binary cache" : "compiled",
+		MillisecondsSince(pending.issued), MillisecondsSince(start));
+	shaderLoadStats.programs++;
+	if (pending.fromCache) shaderLoadStats.cacheHits++;
+	return ProgramID;
+}
+
+void PrecompileShaders(GLADloadfunc load, const std::vector<ShaderFiles> &programs)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// Let the driver compile on its own threads, as many as it likes
+	MaxShaderCompilerThreadsProc maxShaderCompilerThreads = nullptr;
+	if (HasExtension("GL_KHR_parallel_shader_compile")) {
+		maxShaderCompilerThreads = (MaxShaderCompilerThreadsProc)load("glMaxShaderCompilerThreadsKHR");
+	} else if (HasExtension("GL_ARB_parallel_shader_compile")) {
+		maxShaderCompilerThreads = (MaxShaderCompilerThreadsProc)load("glMaxShaderCompilerThreadsARB");
+	}
+	if (maxShaderCompilerThreads != nullptr) {
+		maxShaderCompilerThreads(0xFFFFFFFF);
+	}
+	printf("Precompiling %d shader programs%s\n", (int)programs.size(),
+		maxShaderCompilerThreads != nullptr ? " on driver threads" : "");
+
+	for (const ShaderFiles &files : programs) {
+		PendingProgram pending;
+		if (IssueProgram(files.vertex, files.fragment, pending)) {
+			pendingPrograms.push_back(pending);
+		}
+	}
+	shaderLoadStats.milliseconds += MillisecondsSince(start);
+}
+
+ShaderProgram LoadShadersFromFile(const char *vertex_file_path, const char *fragment_file_path)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	GLuint ProgramID = 0;
+	PendingProgram pending;
+	bool precompiled = false;
+	for (size_t i = 0; i < pendingPrograms.size(); i++) {
+		if (pendingPrograms[i].vertexPath == vertex_file_path && pendingPrograms[i].fragmentPath == fragment_file_path) {
+			pending = pendingPrograms[i];
+			pendingPrograms.erase(pendingPrograms.begin() + i);
+			precompiled = true;
+			break;
+		}
+	}
+	if (precompiled || IssueProgram(vertex_file_path, fragment_file_path, pending)) {
+		ProgramID = FinishProgram(pending);
+	}
+
+	shaderLoadStats.milliseconds += MillisecondsSince(start);
+	return ProgramID;
+}
+
+void DiscardUnclaimedShaders()
+{
+	for (const PendingProgram &pending : pendingPrograms) {
+		printf("Precompiled program %s, %s was never loaded, deleting it\n",
+			pending.vertexPath.c_str(), pending.fragmentPath.c_str());
+		if (!pending.fromCache) {
+			glDetachShader(pending.program, pending.vertexShader);
+			glDetachShader(pending.program, pending.fragmentShader);
+			glDeleteShader(pending.vertexShader);
+			glDeleteShader(pending.fragmentShader);
+		}
+		glDeleteProgram(pending.program);
+	}
+	pendingPrograms.clear();
+}
+
+ShaderProgram LoadShadersFromString(std::string VertexShaderCode, std::string FragmentShaderCode)
+{
+	// Create the shaders
+	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
 
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
 
 	// Compile Vertex Shader
-	printf("Compiling vertex shader : %s\n", vertex_file_path);
+	printf("Compiling vertex shader\n");
 	char const *VertexSourcePointer = VertexShaderCode.c_str();
 	glShaderSource(VertexShaderID, 1, &VertexSourcePointer, NULL);
 	glCompileShader(VertexShaderID);
@@ -56,7 +516,7 @@ GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_fi
 	// Check Vertex Shader
 	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
 	if (!Result) {
-		printf("Error compiling vertex shader : %s\n", vertex_file_path);
+		printf("Error compiling vertex shader\n");
 		glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
 		if (InfoLogLength > 0) {
 			std::vector<char> VertexShaderErrorMessage(InfoLogLength + 1);
@@ -67,7 +527,7 @@ GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_fi
 	}
 
 	// Compile Fragment Shader
-	printf("Compiling fragment shader : %s\n", fragment_file_path);
+	printf("Compiling fragment shader\n");
 	char const *FragmentSourcePointer = FragmentShaderCode.c_str();
 	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer, NULL);
 	glCompileShader(FragmentShaderID);
@@ -75,7 +535,7 @@ GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_fi
 	// Check Fragment Shader
 	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
 	if (!Result) {
-		printf("Error compiling fragment shader : %s\n", fragment_file_path);
+		printf("Error compiling fragment shader\n");
 		glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
 		if (InfoLogLength > 0)
 		{
@@ -116,17 +576,25 @@ GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_fi
 	return ProgramID;
 }
 
-GLuint LoadShadersFromString(std::string VertexShaderCode, std::string FragmentShaderCode)
+ShaderProgram LoadTransformFeedbackShaderFromFile(const char *vertex_file_path, const char *const *varyings, int varyingCount,
+	const char *defines)
 {
-	// Create the shaders
+	// Read the Vertex Shader code from the file
+	std::string VertexShaderCode;
+	if (!ReadShaderFile(vertex_file_path, VertexShaderCode))
+	{
+		printf("Vertex shader not found %s.\n", vertex_file_path);
+		return 0;
+	}
+	InsertDefines(VertexShaderCode, defines);
+
 	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
 
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
 
 	// Compile Vertex Shader
-	printf("Compiling vertex shader\n");
+	printf("Compiling transform feedback shader : %s\n", vertex_file_path);
 	char const *VertexSourcePointer = VertexShaderCode.c_str();
 	glShaderSource(VertexShaderID, 1, &VertexSourcePointer, NULL);
 	glCompileShader(VertexShaderID);
@@ -134,41 +602,22 @@ GLuint LoadShadersFromString(std::string VertexShaderCode, std::string FragmentS
 	// Check Vertex Shader
 	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
 	if (!Result) {
-		printf("Error compiling vertex shader\n");
+		printf("Error compiling vertex shader : %s\n", vertex_file_path);
 		glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
 		if (InfoLogLength > 0) {
 			std::vector<char> VertexShaderErrorMessage(InfoLogLength + 1);
 			glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
 			printf("%s\n", &VertexShaderErrorMessage[0]);
 		}
+		glDeleteShader(VertexShaderID);
 		return 0;
 	}
 
-	// Compile Fragment Shader
-	printf("Compiling fragment shader\n");
-	char const *FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer, NULL);
-	glCompileShader(FragmentShaderID);
-
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	if (!Result) {
-		printf("Error compiling fragment shader\n");
-		glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-		if (InfoLogLength > 0)
-		{
-			std::vector<char> FragmentShaderErrorMessage(InfoLogLength + 1);
-			glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-			printf("%s\n", &FragmentShaderErrorMessage[0]);
-		}
-		return 0;
-	}
-
-	// Link the program
+	// Varyings have to be declared before linking
 	printf("Linking program\n");
 	GLuint ProgramID = glCreateProgram();
 	glAttachShader(ProgramID, VertexShaderID);
-	glAttachShader(ProgramID, FragmentShaderID);
+	glTransformFeedbackVaryings(ProgramID, varyingCount, varyings, GL_INTERLEAVED_ATTRIBS);
 	glLinkProgram(ProgramID);
 
 	// Check the program
@@ -182,14 +631,13 @@ GLuint LoadShadersFromString(std::string VertexShaderCode, std::string FragmentS
 			glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
 			printf("%s\n", &ProgramErrorMessage[0]);
 		}
+		glDeleteShader(VertexShaderID);
+		glDeleteProgram(ProgramID);
 		return 0;
 	}
 
 	glDetachShader(ProgramID, VertexShaderID);
-	glDetachShader(ProgramID, FragmentShaderID);
-
 	glDeleteShader(VertexShaderID);
-	glDeleteShader(FragmentShaderID);
 
 	return ProgramID;
 }
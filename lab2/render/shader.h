@@ -2,10 +2,143 @@
 #define _SHADER_H_
 
 #include <glad/gl.h>
+#include <glm/glm.hpp>
+#include <cstring>
 #include <string>
+#include <vector>
 
-GLuint LoadShadersFromFile(const char *vertex_file_path, const char *fragment_file_path);
+// Uniform buffer binding of the FrameData block (frame_data.glsl); every
+// loaded program that declares the block is pointed at it
+const GLuint kFrameDataBinding = 0;
 
-GLuint LoadShadersFromString(std::string VertexShaderCode, std::string FragmentShaderCode);
+// Handle of an active uniform of a ShaderProgram, typed by the value it takes.
+// Invalid (index -1) when the uniform does not exist or was optimized out;
+// setting an invalid handle does nothing.
+template <typename T>
+struct Uniform {
+	int index = -1;
+	bool valid() const { return index >= 0; }
+};
+
+// A linked program and its active uniforms and attributes, enumerated once at
+// link time. Uniform handles are resolved by name at initialization; the
+// setters remember the last value sent for each uniform and skip the GL call
+// when it has not changed, so per-frame code can set everything unconditionally.
+// Setters upload to the current program: call glUseProgram first. Keep a single
+// copy of a program whose uniforms are set, each copy has its own cache.
+class ShaderProgram {
+public:
+	ShaderProgram(GLuint program = 0);
+
+	GLuint id() const { return programID; }
+	operator GLuint() const { return programID; }
+
+	// Handle for setUniform; warns when the GLSL type does not match T
+	template <typename T>
+	Uniform<T> uniform(const char *name) const {
+		Uniform<T> handle;
+		handle.index = findUniform(name, UniformType<T>::type);
+		return handle;
+	}
+
+	// Location of an active vertex attribute, -1 if there is none
+	GLint attribute(const char *name) const;
+
+	template <typename T>
+	void setUniform(Uniform<T> handle, const T &value) {
+		if (handle.index < 0) return;
+		UniformSlot &slot = uniforms[handle.index];
+		if (slot.cached && memcmp(slot.value, &value, sizeof(T)) == 0) return;
+		memcpy(slot.value, &value, sizeof(T));
+		slot.cached = true;
+		upload(slot.location, value);
+	}
+
+	// Forget the cached values, e.g. after setting uniforms with plain GL calls
+	void invalidate();
+
+private:
+	template <typename T> struct UniformType;
+
+	struct UniformSlot {
+		std::string name;
+		GLint location;
+		GLenum type;
+		GLint size;
+		bool cached;
+		float value[16];
+	};
+	struct AttributeSlot {
+		std::string name;
+		GLint location;
+	};
+
+	int findUniform(const char *name, GLenum type) const;
+	static void upload(GLint location, const int &value);
+	static void upload(GLint location, const float &value);
+	static void upload(GLint location, const glm::ivec2 &value);
+	static void upload(GLint location, const glm::vec2 &value);
+	static void upload(GLint location, const glm::vec3 &value);
+	static void upload(GLint location, const glm::vec4 &value);
+	static void upload(GLint location, const glm::mat3 &value);
+	static void upload(GLint location, const glm::mat4 &value);
+
+	GLuint programID = 0;
+	std::vector<UniformSlot> uniforms;
+	std::vector<AttributeSlot> attributes;
+};
+
+template <> struct ShaderProgram::UniformType<int> { static const GLenum type = GL_INT; };
+template <> struct ShaderProgram::UniformType<float> { static const GLenum type = GL_FLOAT; };
+template <> struct ShaderProgram::UniformType<glm::ivec2> { static const GLenum type = GL_INT_VEC2; };
+template <> struct ShaderProgram::UniformType<glm::vec2> { static const GLenum type = GL_FLOAT_VEC2; };
+template <> struct ShaderProgram::UniformType<glm::vec3> { static const GLenum type = GL_FLOAT_VEC3; };
+template <> struct ShaderProgram::UniformType<glm::vec4> { static const GLenum type = GL_FLOAT_VEC4; };
+template <> struct ShaderProgram::UniformType<glm::mat3> { static const GLenum type = GL_FLOAT_MAT3; };
+template <> struct ShaderProgram::UniformType<glm::mat4> { static const GLenum type = GL_FLOAT_MAT4; };
+
+// Shader files may pull in others with #include "file", relative to the including file
+ShaderProgram LoadShadersFromFile(const char *vertex_file_path, const char *fragment_file_path);
+
+// Keeps the programs linked by LoadShadersFromFile in 'directory' as driver
+// binaries (GL_ARB_get_program_binary). Entries are keyed by a hash of both
+// sources and the GL vendor, renderer and version, so an edited shader or a
+// driver update misses; a miss or a binary the driver rejects is compiled from
+// source and stored again. Returns false, leaving the cache off, when the
+// driver has no binary formats. 'load' resolves the entry points glad 3.3 lacks.
+bool EnableProgramBinaryCache(GLADloadfunc load, const char *directory);
+
+struct ShaderFiles {
+	const char *vertex;
+	const char *fragment;
+};
+
+// Issues the compile and link of every program up front and returns without
+// reading any status, so that a driver with GL_KHR_parallel_shader_compile (or
+// the ARB version) builds them on its own threads while the caller loads
+// textures and models. LoadShadersFromFile with the same paths then only waits
+// for the result. Programs found in the binary cache are restored right away.
+void PrecompileShaders(GLADloadfunc load, const std::vector<ShaderFiles> &programs);
+
+// Deletes the programs PrecompileShaders issued that no LoadShadersFromFile
+// picked up, with a warning for each, as their paths do not match any loader.
+// Call once every loader has run.
+void DiscardUnclaimedShaders();
+
+// Programs loaded by LoadShadersFromFile so far and the time callers spent
+// blocked in the loader, PrecompileShaders included
+struct ShaderLoadStats {
+	int programs = 0;
+	int cacheHits = 0;
+	double milliseconds = 0.0;
+};
+const ShaderLoadStats &GetShaderLoadStats();
+
+ShaderProgram LoadShadersFromString(std::string VertexShaderCode, std::string FragmentShaderCode);
+
+// Vertex-only program whose outputs are captured interleaved into a transform feedback buffer.
+// 'defines' (e.g. "#define FOO\n") is inserted after the #version line.
+ShaderProgram LoadTransformFeedbackShaderFromFile(const char *vertex_file_path, const char *const *varyings, int varyingCount,
+	const char *defines = nullptr);
 
 #endif
@@ -0,0 +1,11 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+// SSE2 is baseline on every x86-64 target we build for, so the SIMD paths
+// switch on RENDER_SSE and every other target takes their scalar versions
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RENDER_SSE 1
+#include <emmintrin.h>
+#endif
+
+#endif
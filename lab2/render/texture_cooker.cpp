@@ -0,0 +1,363 @@
+#include "texture_cooker.h"
+
+#include <stb/stb_image.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+
+struct CookedTextureHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t levelCount;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+};
+
+static const uint32_t kCookedMagic = 0x5845544c;	// "LTEX"
+static const uint32_t kCookedVersion = 1;
+
+size_t CookedTexture::rowPitch(size_t level) const
+{
+	uint32_t levelWidth = levels[level].width;
+	return format == COOKED_BC1 ? (levelWidth + 3) / 4 * 8 : levelWidth * 3;
+}
+
+size_t CookedTexture::size() const
+{
+	size_t size = 0;
+	for (const CookedLevel &level : levels) {
+		size += level.size;
+	}
+	return size;
+}
+
+size_t CookedTexture::uncompressedSize() const
+{
+	size_t size = 0;
+	for (const CookedLevel &level : levels) {
+		size += (size_t)level.width * level.height * 3;
+	}
+	return size;
+}
+
+// sRGB transfer curve, mips are averaged on linear values
+static const float *SrgbToLinearTable()
+{
+	static float table[256];
+	static bool initialized = [] {
+		for (int i = 0; i < 256; i++) {
+			float c = i / 255.0f;
+			table[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+		}
+		return true;
+	}();
+	(void)initialized;
+	return table;
+}
+
+static uint8_t LinearToSrgb(float c)
+{
+	c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+	return (uint8_t)std::min(255.0f, std::max(0.0f, c * 255.0f + 0.5f));
+}
+
+// 2x2 box filter, the last row or column is repeated on odd sizes
+static void Downsample(const uint8_t *source, int width, int height, uint8_t *target, int targetWidth, int targetHeight,
+	WorkerPool *pool)
+{
+	const float *toLinear = SrgbToLinearTable();
+	auto rows = [&](size_t begin, size_t end, unsigned int) {
+		for (size_t y = begin; y < end; y++) {
+			int y0 = std::min((int)y * 2, height - 1);
+			int y1 = std::min((int)y * 2 + 1, height - 1);
+			for (int x = 0; x < targetWidth; x++) {
+				int x0 = std::min(x * 2, width - 1);
+				int x1 = std::min(x * 2 + 1, width - 1);
+				for (int c = 0; c < 3; c++) {
+					float sum = toLinear[source[(y0 * width + x0) * 3 + c]] + toLinear[source[(y0 * width + x1) * 3 + c]] +
+						toLinear[source[(y1 * width + x0) * 3 + c]] + toLinear[source[(y1 * width + x1) * 3 + c]];
+					target[(y * targetWidth + x) * 3 + c] = LinearToSrgb(sum * 0.25f);
+				}
+			}
+		}
+	};
+	if (pool != nullptr) {
+		pool->parallelFor(targetHeight, 8, rows);
+	} else {
+		rows(0, targetHeight, 0);
+	}
+}
+
+static uint16_t PackRGB565(const float *color)
+{
+	int r = (int)(std::min(255.0f, std::max(0.0f, color[0])) * 31.0f / 255.0f + 0.5f);
+	int g = (int)(std::min(255.0f, std::max(0.0f, color[1])) * 63.0f / 255.0f + 0.5f);
+	int b = (int)(std::min(255.0f, std::max(0.0f, color[2])) * 31.0f / 255.0f + 0.5f);
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static void UnpackRGB565(uint16_t packed, float *color)
+{
+	int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+	color[0] = (float)((r << 3) | (r >> 2));
+	color[1] = (float)((g << 2) | (g >> 4));
+	color[2] = (float)((b << 3) | (b >> 2));
+}
+
+// Picks the nearest of the four palette entries for each texel, returns the squared error
+static float AssignIndices(const float texels[16][3], uint16_t color0, uint16_t color1, uint32_t &indices)
+{
+	float palette[4][3];
+	UnpackRGB565(color0, palette[0]);
+	UnpackRGB565(color1, palette[1]);
+	for (int c = 0; c < 3; c++) {
+		palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+		palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+	}
+
+	float error = 0.0f;
+	indices = 0;
+	for (int i = 0; i < 16; i++) {
+		int best = 0;
+		float bestDistance = 1e30f;
+		for (int p = 0; p < 4; p++) {
+			float distance = 0.0f;
+			for (int c = 0; c < 3; c++) {
+				float d = texels[i][c] - palette[p][c];
+				distance += d * d;
+			}
+			if (distance < bestDistance) {
+				bestDistance = distance;
+				best = p;
+			}
+		}
+		indices |= (uint32_t)best << (2 * i);
+		error += bestDistance;
+	}
+	return error;
+}
+
+// Endpoints from the principal axis of the block's colors, then one least
+// squares pass refitting them to the chosen indices
+static void EncodeBC1Block(const float texels[16][3], uint8_t *out)
+{
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 3; c++) mean[c] += texels[i][c] / 16.0f;
+	}
+	float covariance[6] = { 0.0f };
+	for (int i = 0; i < 16; i++) {
+		float d[3] = { texels[i][0] - mean[0], texels[i][1] - mean[1], texels[i][2] - mean[2] };
+		covariance[0] += d[0] * d[0]; covariance[1] += d[0] * d[1]; covariance[2] += d[0] * d[2];
+		covariance[3] += d[1] * d[1]; covariance[4] += d[1] * d[2]; covariance[5] += d[2] * d[2];
+	}
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	for (int iteration = 0; iteration < 8; iteration++) {
+		float next[3] = {
+			covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+			covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+			covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2],
+		};
+		float length = std::max(std::fabs(next[0]), std::max(std::fabs(next[1]), std::fabs(next[2])));
+		if (length < 1e-6f) break;
+		for (int c = 0; c < 3; c++) axis[c] = next[c] / length;
+	}
+
+	float low = 1e30f, high = -1e30f;
+	for (int i = 0; i < 16; i++) {
+		float t = 0.0f;
+		for (int c = 0; c < 3; c++) t += (texels[i][c] - mean[c]) * axis[c];
+		low = std::min(low, t);
+		high = std::max(high, t);
+	}
+	float axisLength = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	float start[3], end[3];
+	for (int c = 0; c < 3; c++) {
+		start[c] = mean[c] + axis[c] * high / std::max(axisLength, 1e-6f);
+		end[c] = mean[c] + axis[c] * low / std::max(axisLength, 1e-6f);
+	}
+
+	uint16_t color0 = PackRGB565(start), color1 = PackRGB565(end);
+	uint32_t indices;
+	float error;
+	if (color0 == color1) {
+		indices = 0;		// Flat block, every texel is color0
+		error = 0.0f;
+	} else {
+		// Four-color mode needs color0 > color1
+		if (color0 < color1) std::swap(color0, color1);
+		error = AssignIndices(texels, color0, color1, indices);
+
+		// Weights of color0 for indices 0..3
+		static const float weight[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[3] = { 0.0f }, bx[3] = { 0.0f };
+		for (int i = 0; i < 16; i++) {
+			float a = weight[(indices >> (2 * i)) & 3], b = 1.0f - a;
+			aa += a * a; ab += a * b; bb += b * b;
+			for (int c = 0; c < 3; c++) {
+				ax[c] += a * texels[i][c];
+				bx[c] += b * texels[i][c];
+			}
+		}
+		float determinant = aa * bb - ab * ab;
+		if (std::fabs(determinant) > 1e-6f) {
+			float refined0[3], refined1[3];
+			for (int c = 0; c < 3; c++) {
+				refined0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+				refined1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+			}
+			uint16_t candidate0 = PackRGB565(refined0), candidate1 = PackRGB565(refined1);
+			if (candidate0 != candidate1) {
+				if (candidate0 < candidate1) std::swap(candidate0, candidate1);
+				uint32_t candidateIndices;
+				float candidateError = AssignIndices(texels, candidate0, candidate1, candidateIndices);
+				if (candidateError < error) {
+					color0 = candidate0;
+					color1 = candidate1;
+					indices = candidateIndices;
+				}
+			}
+		}
+	}
+
+	out[0] = (uint8_t)(color0 & 0xff);
+	out[1] = (uint8_t)(color0 >> 8);
+	out[2] = (uint8_t)(color1 & 0xff);
+	out[3] = (uint8_t)(color1 >> 8);
+	for (int i = 0; i < 4; i++) out[4 + i] = (uint8_t)(indices >> (8 * i));
+}
+
+static void EncodeBC1(const uint8_t *pixels, int width, int height, uint8_t *out, WorkerPool *pool)
+{
+	int blocksWide = (width + 3) / 4;
+	int blocksHigh = (height + 3) / 4;
+	auto blockRows = [&](size_t begin, size_t end, unsigned int) {
+		float texels[16][3];
+		for (size_t by = begin; by < end; by++) {
+			for (int bx = 0; bx < blocksWide; bx++) {
+				// Blocks hanging over the edge repeat the last row and column
+				for (int i = 0; i < 16; i++) {
+					int x = std::min(bx * 4 + (i & 3), width - 1);
+					int y = std::min((int)by * 4 + (i >> 2), height - 1);
+					for (int c = 0; c < 3; c++) texels[i][c] = pixels[(y * width + x) * 3 + c];
+				}
+				EncodeBC1Block(texels, out + (by * blocksWide + bx) * 8);
+			}
+		}
+	};
+	if (pool != nullptr) {
+		pool->parallelFor(blocksHigh, 4, blockRows);
+	} else {
+		blockRows(0, blocksHigh, 0);
+	}
+}
+
+bool CookTexture(const char *sourcePath, CookedFormat format, WorkerPool *pool, CookedTexture &cooked)
+{
+	int width, height, channels;
+	uint8_t *pixels = stbi_load(sourcePath, &width, &height, &channels, 3);
+	if (pixels == nullptr) return false;
+
+	cooked.format = format;
+	cooked.width = width;
+	cooked.height = height;
+	cooked.levels.clear();
+	cooked.data.clear();
+
+	std::vector<uint8_t> level(pixels, pixels + (size_t)width * height * 3);
+	stbi_image_free(pixels);
+	std::vector<uint8_t> next;
+	for (;;) {
+		CookedLevel entry;
+		entry.width = width;
+		entry.height = height;
+		entry.offset = (uint32_t)cooked.data.size();
+		entry.size = format == COOKED_BC1 ? (uint32_t)(((width + 3) / 4) * ((height + 3) / 4) * 8) : (uint32_t)level.size();
+		cooked.data.resize(entry.offset + entry.size);
+		if (format == COOKED_BC1) {
+			EncodeBC1(level.data(), width, height, cooked.data.data() + entry.offset, pool);
+		} else {
+			memcpy(cooked.data.data() + entry.offset, level.data(), entry.size);
+		}
+		cooked.levels.push_back(entry);
+
+		if (width == 1 && height == 1) break;
+		int nextWidth = std::max(1, width / 2);
+		int nextHeight = std::max(1, height / 2);
+		next.resize((size_t)nextWidth * nextHeight * 3);
+		Downsample(level.data(), width, height, next.data(), nextWidth, nextHeight, pool);
+		level.swap(next);
+		width = nextWidth;
+		height = nextHeight;
+	}
+	return true;
+}
+
+static bool SourceStamp(const char *sourcePath, uint64_t &size, int64_t &time)
+{
+	struct stat info;
+	if (stat(sourcePath, &info) != 0) return false;
+	size = (uint64_t)info.st_size;
+	time = (int64_t)info.st_mtime;
+	return true;
+}
+
+bool WriteCookedTexture(const char *path, const char *sourcePath, const CookedTexture &cooked)
+{
+	CookedTextureHeader header = {};
+	header.magic = kCookedMagic;
+	header.version = kCookedVersion;
+	header.format = cooked.format;
+	header.width = cooked.width;
+	header.height = cooked.height;
+	header.levelCount = (uint32_t)cooked.levels.size();
+	if (!SourceStamp(sourcePath, header.sourceSize, header.sourceTime)) return false;
+
+	std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	stream.write((const char *)&header, sizeof(header));
+	stream.write((const char *)cooked.levels.data(), cooked.levels.size() * sizeof(CookedLevel));
+	stream.write((const char *)cooked.data.data(), cooked.data.size());
+	return (bool)stream;
+}
+
+bool ReadCookedTexture(const char *path, const char *sourcePath, CookedFormat format, CookedTexture &cooked)
+{
+	std::ifstream stream(path, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!stream.is_open()) return false;
+	size_t fileSize = (size_t)stream.tellg();
+	if (fileSize < sizeof(CookedTextureHeader)) return false;
+
+	// The whole file in one read, level offsets are moved past the header afterwards
+	std::vector<uint8_t> file(fileSize);
+	stream.seekg(0);
+	if (!stream.read((char *)file.data(), fileSize)) return false;
+
+	CookedTextureHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	if (header.magic != kCookedMagic || header.version != kCookedVersion || header.format != (uint32_t)format ||
+		!SourceStamp(sourcePath, sourceSize, sourceTime) || sourceSize != header.sourceSize || sourceTime != header.sourceTime) {
+		return false;
+	}
+	size_t dataStart = sizeof(header) + header.levelCount * sizeof(CookedLevel);
+	if (fileSize < dataStart) return false;
+
+	cooked.format = format;
+	cooked.width = header.width;
+	cooked.height = header.height;
+	cooked.levels.resize(header.levelCount);
+	memcpy(cooked.levels.data(), file.data() + sizeof(header), header.levelCount * sizeof(CookedLevel));
+	for (CookedLevel &level : cooked.levels) {
+		if (dataStart + level.offset + level.size > fileSize) return false;
+		level.offset += (uint32_t)dataStart;
+	}
+	cooked.data.swap(file);
+	return true;
+}
@@ -0,0 +1,56 @@
+#ifndef _TEXTURE_COOKER_H_
+#define _TEXTURE_COOKER_H_
+
+#include "worker_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Cooked textures: the whole mip chain of an image, BC1 compressed or plain
+// RGB8, in one file that loads with a single read and needs neither decoding
+// nor mip generation. File layout: CookedTextureHeader, one CookedLevel per
+// level (largest first), then the level data at the offsets they record.
+
+enum CookedFormat {
+	COOKED_RGB8 = 0,
+	COOKED_BC1 = 1,		// 8 bytes per 4x4 block, GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+};
+
+struct CookedLevel {
+	uint32_t width;
+	uint32_t height;
+	uint32_t offset;	// Into CookedTexture::data
+	uint32_t size;
+};
+
+struct CookedTexture {
+	CookedFormat format = COOKED_RGB8;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<CookedLevel> levels;
+	std::vector<uint8_t> data;
+
+	const uint8_t *levelData(size_t level) const { return data.data() + levels[level].offset; }
+
+	// Texel rows covered by one row of data (a row of BC1 blocks covers 4) and its size
+	int rowHeight() const { return format == COOKED_BC1 ? 4 : 1; }
+	size_t rowPitch(size_t level) const;
+
+	// Size of the level data, and as it would be stored uncompressed
+	size_t size() const;
+	size_t uncompressedSize() const;
+};
+
+// Decodes 'sourcePath', builds its mip chain, averaging in linear light, and
+// encodes every level. 'pool' splits the rows of each level, it may be null.
+bool CookTexture(const char *sourcePath, CookedFormat format, WorkerPool *pool, CookedTexture &cooked);
+
+// The source's size and modification time go into the header, so an edited source reads as stale
+bool WriteCookedTexture(const char *path, const char *sourcePath, const CookedTexture &cooked);
+
+// Loads a cooked file with one read; false when it is missing, damaged, in
+// another format or older than its source
+bool ReadCookedTexture(const char *path, const char *sourcePath, CookedFormat format, CookedTexture &cooked);
+
+#endif
@@ -0,0 +1,482 @@
+#include "texture_loader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// GL_EXT_texture_compression_s3tc, not in the 3.3 loader
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double Megabytes(size_t bytes)
+{
+	return bytes / (1024.0 * 1024.0);
+}
+
+static bool HasExtension(const char *name)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; i++) {
+		const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+		if (extension != nullptr && strcmp(extension, name) == 0) return true;
+	}
+	return false;
+}
+
+// FNV-1a over the full source path, so same-named images in different folders get their own file
+static std::string TextureCachePath(const std::string &directory, const std::string &sourcePath)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i <= sourcePath.size(); i++) {
+		hash = (hash ^ (unsigned char)sourcePath.c_str()[i]) * 1099511628211ull;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.tex", (unsigned long long)hash);
+	return directory + name;
+}
+
+int TextureLoader::Entry::targetLevel(uint64_t frame) const
+{
+	if (wantedLevel < 0 || frame - lastUsedFrame > kUnusedFrames) return residentLevel;
+	return std::min(wantedLevel, residentLevel);
+}
+
+size_t TextureLoader::Entry::nextLevelBytes() const
+{
+	size_t bytes = cooked.levels[baseLevel - 1].size;
+	if (uploadedRows > 0) bytes -= uploadedRows * cooked.rowPitch(baseLevel - 1);
+	return bytes;
+}
+
+void TextureLoader::initialize(WorkerPool *pool, const char *directory, size_t budget, size_t bytesPerFrame)
+{
+	workerPool = pool;
+	budgetBytes = budget;
+	uploadBytesPerFrame = bytesPerFrame;
+	glGenBuffers(1, &unpackBufferID);
+
+	format = HasExtension("GL_EXT_texture_compression_s3tc") ? COOKED_BC1 : COOKED_RGB8;
+	std::cout << "Textures are cooked as " << (format == COOKED_BC1 ? "BC1" : "RGB8, S3TC is not supported")
+		<< " into " << directory << ", " << Megabytes(budgetBytes) << " MB budget" << std::endl;
+#ifdef _WIN32
+	_mkdir(directory);
+#else
+	mkdir(directory, 0755);
+#endif
+	cacheDirectory = directory;
+	cacheDirectory += '/';
+}
+
+GLuint TextureLoader::load(const char *path, GLenum wrapS, GLenum wrapT)
+{
+	return create(GL_TEXTURE_2D, std::vector<std::string>(1, path), wrapS, wrapT);
+}
+
+GLuint TextureLoader::loadArray(const std::vector<std::string> &paths, GLenum wrapS, GLenum wrapT)
+{
+	return create(GL_TEXTURE_2D_ARRAY, paths, wrapS, wrapT);
+}
+
+GLuint TextureLoader::create(GLenum target, const std::vector<std::string> &paths, GLenum wrapS, GLenum wrapT)
+{
+	std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+	entry->path = paths[0];
+	if (paths.size() > 1) entry->path += " (+" + std::to_string(paths.size() - 1) + " layers)";
+	entry->layerPaths = paths;
+	entry->target = target;
+	entry->requested = std::chrono::steady_clock::now();
+	if (pendingCount() == 0) firstRequest = entry->requested;
+
+	// Grey placeholder, RGB rows are not 4 byte aligned
+	std::vector<uint8_t> grey(paths.size() * 3, 128);
+	glGenTextures(1, &entry->texture);
+	glBindTexture(target, entry->texture);
+	glTexParameteri(target, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(target, GL_TEXTURE_WRAP_T, wrapT);
+	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);	// No mips until the first level is in
+	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (target == GL_TEXTURE_2D_ARRAY) {
+		glTexImage3D(target, 0, GL_RGB8, 1, 1, (GLsizei)paths.size(), 0, GL_RGB, GL_UNSIGNED_BYTE, grey.data());
+	} else {
+		glTexImage2D(target, 0, GL_RGB8, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, grey.data());
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	// Cooked files are named after the source path, the header tells a stale one apart
+	std::vector<std::string> cachePaths;
+	for (const std::string &path : paths) {
+		cachePaths.push_back(TextureCachePath(cacheDirectory, path));
+	}
+	if (workerPool != nullptr) {
+		CookedFormat cookedFormat = format;
+		WorkerPool *pool = workerPool;
+		workerPool->submit([entry, cachePaths, cookedFormat, pool]() { decode(*entry, cachePaths, cookedFormat, pool); });
+	} else {
+		decode(*entry, cachePaths, format, nullptr);
+	}
+	entries.push_back(entry);
+	entryLookup[entry->texture] = entry.get();
+	return entry->texture;
+}
+
+// Reads or cooks every layer, then interleaves them level by level so each
+// level is one contiguous run of layers, the order glTexImage3D takes
+void TextureLoader::decode(Entry &entry, const std::vector<std::string> &cachePaths, CookedFormat format, WorkerPool *pool)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<CookedTexture> layers(cachePaths.size());
+	entry.valid = true;
+	for (size_t i = 0; i < layers.size() && entry.valid; i++) {
+		const char *sourcePath = entry.layerPaths[i].c_str();
+		if (!ReadCookedTexture(cachePaths[i].c_str(), sourcePath, format, layers[i])) {
+			entry.cookedNow = true;
+			entry.valid = CookTexture(sourcePath, format, pool, layers[i]);
+			if (entry.valid && !WriteCookedTexture(cachePaths[i].c_str(), sourcePath, layers[i])) {
+				std::cout << "Cannot write cooked texture " << cachePaths[i] << std::endl;
+			}
+		}
+		if (entry.valid && (layers[i].width != layers[0].width || layers[i].height != layers[0].height)) {
+			std::cout << "Texture array layer " << sourcePath << " is not the size of the first" << std::endl;
+			entry.valid = false;
+		}
+	}
+
+	if (entry.valid && layers.size() == 1) {
+		entry.cooked = std::move(layers[0]);
+	} else if (entry.valid) {
+		CookedTexture &cooked = entry.cooked;
+		cooked.format = layers[0].format;
+		cooked.width = layers[0].width;
+		cooked.height = layers[0].height;
+		size_t size = 0;
+		for (const CookedTexture &layer : layers) size += layer.size();
+		cooked.data.resize(size);
+		uint32_t offset = 0;
+		for (size_t level = 0; level < layers[0].levels.size(); level++) {
+			CookedLevel stacked = layers[0].levels[level];
+			stacked.offset = offset;
+			for (const CookedTexture &layer : layers) {
+				memcpy(cooked.data.data() + offset, layer.levelData(level), layer.levels[level].size);
+				offset += layer.levels[level].size;
+			}
+			stacked.size = offset - stacked.offset;
+			cooked.levels.push_back(stacked);
+		}
+	}
+	entry.decodeMilliseconds = MillisecondsSince(start);
+	entry.decoded.store(true, std::memory_order_release);
+}
+
+void TextureLoader::requestDetail(GLuint texture, float screenPixels)
+{
+	std::unordered_map<GLuint, Entry *>::iterator found = entryLookup.find(texture);
+	if (found == entryLookup.end()) return;
+	found->second->screenPixels = std::max(found->second->screenPixels, screenPixels);
+}
+
+void TextureLoader::setBudget(size_t budget)
+{
+	if (budget == budgetBytes) return;
+	budgetBytes = budget;
+	residencyChanged = true;
+}
+
+// Copies as many rows of the level below baseLevel as the budget allows (at
+// least one when nothing was sent yet this frame) through the unpack buffer.
+// True once that level is complete and sampled.
+bool TextureLoader::uploadRows(Entry &entry, size_t &budget)
+{
+	const CookedTexture &cooked = entry.cooked;
+	bool compressed = cooked.format == COOKED_BC1;
+	GLenum target = entry.target;
+	GLsizei layers = (GLsizei)entry.layerPaths.size();
+	int levelIndex = entry.baseLevel - 1;
+	const CookedLevel &level = cooked.levels[levelIndex];
+	size_t rowPitch = cooked.rowPitch(levelIndex);
+	int layerRows = ((int)level.height + cooked.rowHeight() - 1) / cooked.rowHeight();
+	int uploadedRows = std::max(entry.uploadedRows, 0);
+	int layer = uploadedRows / layerRows;
+	int layerRow = uploadedRows % layerRows;
+
+	// A band stays within one layer
+	size_t rows = std::min(budget / rowPitch, (size_t)(layerRows - layerRow));
+	if (rows == 0) {
+		if (budget < uploadBytesPerFrame) {
+			budget = 0;
+			return false;
+		}
+		rows = 1;
+	}
+	size_t bytes = rows * rowPitch;
+	glBindTexture(target, entry.texture);
+
+	// Storage first; the level is outside BASE_LEVEL..MAX_LEVEL until complete
+	if (entry.uploadedRows < 0) {
+		GLenum internalFormat = compressed ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_RGB8;
+		if (target == GL_TEXTURE_2D_ARRAY && compressed) {
+			glCompressedTexImage3D(target, levelIndex, internalFormat, level.width, level.height, layers, 0, level.size, nullptr);
+		} else if (target == GL_TEXTURE_2D_ARRAY) {
+			glTexImage3D(target, levelIndex, internalFormat, level.width, level.height, layers, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+		} else if (compressed) {
+			glCompressedTexImage2D(target, levelIndex, internalFormat, level.width, level.height, 0, level.size, nullptr);
+		} else {
+			glTexImage2D(target, levelIndex, internalFormat, level.width, level.height, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+		}
+		entry.uploadedRows = 0;
+		residentTotal += level.size;
+	}
+
+	// Orphan last frame's storage so mapping never waits on the previous transfer
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpackBufferID);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+	void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (mapped) {
+		memcpy(mapped, cooked.levelData(levelIndex) + uploadedRows * rowPitch, bytes);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		GLint y = layerRow * cooked.rowHeight();
+		GLsizei height = std::min((GLsizei)(rows * cooked.rowHeight()), (GLsizei)level.height - y);
+		if (compressed) {
+			if (target == GL_TEXTURE_2D_ARRAY) {
+				glCompressedTexSubImage3D(target, levelIndex, 0, y, layer, level.width, height, 1,
+					GL_COMPRESSED_RGB_S3TC_DXT1_EXT, (GLsizei)bytes, nullptr);
+			} else {
+				glCompressedTexSubImage2D(target, levelIndex, 0, y, level.width, height,
+					GL_COMPRESSED_RGB_S3TC_DXT1_EXT, (GLsizei)bytes, nullptr);
+			}
+		} else {
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			if (target == GL_TEXTURE_2D_ARRAY) {
+				glTexSubImage3D(target, levelIndex, 0, y, layer, level.width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+			} else {
+				glTexSubImage2D(target, levelIndex, 0, y, level.width, height, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+			}
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		}
+		entry.uploadedRows += (int)rows;
+	}
+	// Left bound, other texture uploads would read from it
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	budget -= std::min(budget, bytes);
+
+	if (entry.uploadedRows < layerRows * layers) return false;
+
+	// Level complete: sample from it down to the smallest
+	if (entry.baseLevel == (int)cooked.levels.size()) {
+		glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, (GLint)cooked.levels.size() - 1);
+		glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	}
+	glTexParameteri(target, GL_TEXTURE_BASE_LEVEL, levelIndex);
+	entry.baseLevel = levelIndex;
+	entry.uploadedRows = -1;
+	return true;
+}
+
+// Frees the finest level 'entry' has on the GPU, a level in flight included.
+// Respecifying it as 0x0 releases the storage; levels below BASE_LEVEL do not
+// count for completeness.
+void TextureLoader::evictLevel(Entry &entry)
+{
+	int levelIndex = entry.finestAllocatedLevel();
+	glBindTexture(entry.target, entry.texture);
+	if (entry.uploadedRows >= 0) {
+		entry.uploadedRows = -1;
+	} else {
+		entry.baseLevel++;
+		glTexParameteri(entry.target, GL_TEXTURE_BASE_LEVEL, entry.baseLevel);
+	}
+	if (entry.target == GL_TEXTURE_2D_ARRAY) {
+		glTexImage3D(entry.target, levelIndex, GL_RGB8, 0, 0, 0, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+	} else {
+		glTexImage2D(entry.target, levelIndex, GL_RGB8, 0, 0, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+	}
+	residentTotal -= entry.cooked.levels[levelIndex].size;
+	residencyChanged = true;
+}
+
+// Evicts fine levels until 'bytes' more fit the budget: levels finer than
+// their texture wants first, then, with 'evictWanted', wanted ones. Least
+// recently used textures lose theirs first, the largest level on a tie.
+// The coarse levels and 'keep' are never touched.
+bool TextureLoader::makeRoom(size_t bytes, const Entry *keep, bool evictWanted)
+{
+	while (residentTotal + bytes > budgetBytes) {
+		Entry *victim = nullptr;
+		bool victimWanted = false;
+		for (std::shared_ptr<Entry> &candidate : entries) {
+			Entry &entry = *candidate;
+			if (&entry == keep || entry.baseLevel < 0) continue;
+			int finest = entry.finestAllocatedLevel();
+			if (finest >= entry.residentLevel) continue;
+			bool wanted = finest >= entry.targetLevel(frame);
+			if (wanted && !evictWanted) continue;
+
+			if (victim != nullptr) {
+				if (wanted != victimWanted) {
+					if (wanted) continue;
+				} else if (entry.lastUsedFrame != victim->lastUsedFrame) {
+					if (entry.lastUsedFrame > victim->lastUsedFrame) continue;
+				} else if (entry.cooked.levels[finest].size <= victim->cooked.levels[victim->finestAllocatedLevel()].size) {
+					continue;
+				}
+			}
+			victim = &entry;
+			victimWanted = wanted;
+		}
+		if (victim == nullptr) return false;
+		evictLevel(*victim);
+	}
+	return true;
+}
+
+void TextureLoader::announce(Entry &entry)
+{
+	const CookedTexture &cooked = entry.cooked;
+	size_t uncompressed = cooked.uncompressedSize() * entry.layerPaths.size();
+	std::cout << "Texture loaded successfully: " << entry.path << " (" << cooked.width << "x" << cooked.height << " "
+		<< (cooked.format == COOKED_BC1 ? "BC1" : "RGB8") << ", " << cooked.levels.size() << " levels, "
+		<< Megabytes(cooked.size()) << " MB vs " << Megabytes(uncompressed) << " MB as RGB8, "
+		<< (entry.cookedNow ? "cooked in " : "read in ") << entry.decodeMilliseconds << " ms, coarse levels in after "
+		<< entry.uploadFrames << " frames, " << MillisecondsSince(entry.requested) << " ms after load)" << std::endl;
+
+	entry.announced = true;
+	loadedCount++;
+	decodeMilliseconds += entry.decodeMilliseconds;
+	cookedBytes += cooked.size();
+	uncompressedBytes += uncompressed;
+	if (pendingCount() == 0) {
+		std::cout << "Textures: " << loadedCount << " loaded, " << Megabytes(cookedBytes) << " MB with every level vs "
+			<< Megabytes(uncompressedBytes) << " MB as RGB8, " << decodeMilliseconds << " ms of reading and cooking on the workers, "
+			<< "coarse levels in after " << MillisecondsSince(firstRequest) << " ms" << std::endl;
+		loadedCount = 0;
+		decodeMilliseconds = 0.0;
+		cookedBytes = 0;
+		uncompressedBytes = 0;
+	}
+}
+
+void TextureLoader::remove(size_t index)
+{
+	entryLookup.erase(entries[index]->texture);
+	entries.erase(entries.begin() + index);
+}
+
+void TextureLoader::update()
+{
+	frame++;
+
+	// Feedback since the last update becomes the level each texture wants
+	for (size_t i = 0; i < entries.size(); i++) {
+		Entry &entry = *entries[i];
+		if (!entry.decoded.load(std::memory_order_acquire)) continue;
+		if (entry.baseLevel < 0) {
+			if (!entry.valid) {
+				std::cout << "Failed to load texture " << entry.path << std::endl;
+				remove(i--);
+				continue;
+			}
+			const std::vector<CookedLevel> &levels = entry.cooked.levels;
+			entry.baseLevel = (int)levels.size();
+			entry.residentLevel = (int)levels.size() - 1;
+			while (entry.residentLevel > 0 &&
+				std::max(levels[entry.residentLevel - 1].width, levels[entry.residentLevel - 1].height) <= kResidentSize) {
+				entry.residentLevel--;
+			}
+		}
+		if (entry.screenPixels > 0.0f) {
+			float level = std::floor(std::log2(entry.cooked.width / entry.screenPixels));
+			entry.wantedLevel = (int)std::min(std::max(level, 0.0f), (float)entry.cooked.levels.size() - 1);
+			entry.lastUsedFrame = frame;
+			entry.screenPixels = 0.0f;
+		}
+	}
+
+	// Over budget, after it shrank: unwanted levels go first, then wanted ones
+	makeRoom(0, nullptr, true);
+
+	size_t budget = uploadBytesPerFrame;
+	bool streaming = false;
+	while (budget > 0) {
+		// Coarse levels before promotions, then the smallest remaining level, so small
+		// textures do not wait behind a large one
+		Entry *next = nullptr;
+		for (std::shared_ptr<Entry> &candidate : entries) {
+			Entry &entry = *candidate;
+			if (entry.baseLevel <= 0 || entry.baseLevel <= entry.targetLevel(frame) || entry.blockedFrame == frame) continue;
+			if (next != nullptr) {
+				bool coarse = entry.baseLevel > entry.residentLevel;
+				bool nextCoarse = next->baseLevel > next->residentLevel;
+				if (coarse != nextCoarse ? !coarse : entry.nextLevelBytes() >= next->nextLevelBytes()) continue;
+			}
+			next = &entry;
+		}
+		if (next == nullptr) break;
+
+		Entry &entry = *next;
+		int levelIndex = entry.baseLevel - 1;
+		if (entry.uploadedRows < 0 && levelIndex < entry.residentLevel &&
+			!makeRoom(entry.cooked.levels[levelIndex].size, &entry, false)) {
+			entry.blockedFrame = frame;
+			continue;
+		}
+
+		streaming = true;
+		if (entry.lastUploadFrame != frame) {
+			entry.lastUploadFrame = frame;
+			entry.uploadFrames++;
+		}
+		if (!uploadRows(entry, budget)) continue;
+
+		residencyChanged = true;
+		if (!entry.announced && entry.baseLevel <= entry.residentLevel) announce(entry);
+	}
+
+	// Settled after a change: report where every texture stands
+	if (residencyChanged && !streaming && pendingCount() == 0) {
+		residencyChanged = false;
+		std::cout << "Texture memory: " << Megabytes(residentTotal) << " of " << Megabytes(budgetBytes) << " MB";
+		for (std::shared_ptr<Entry> &entry : entries) {
+			const CookedLevel &level = entry->cooked.levels[entry->baseLevel];
+			std::cout << (entry == entries.front() ? ", " : "; ") << entry->path.substr(entry->path.find_last_of("/\\") + 1)
+				<< " " << level.width << "x" << level.height;
+			if (entry->baseLevel > entry->targetLevel(frame)) std::cout << " (wants " << entry->cooked.levels[entry->targetLevel(frame)].width << ")";
+		}
+		std::cout << std::endl;
+	}
+}
+
+size_t TextureLoader::pendingCount() const
+{
+	size_t count = 0;
+	for (const std::shared_ptr<Entry> &entry : entries) {
+		if (!entry->announced) count++;
+	}
+	return count;
+}
+
+void TextureLoader::cleanup()
+{
+	for (std::shared_ptr<Entry> &entry : entries) {
+		while (!entry->decoded.load(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+	}
+	entries.clear();
+	entryLookup.clear();
+	glDeleteBuffers(1, &unpackBufferID);
+}
@@ -0,0 +1,132 @@
+#ifndef _TEXTURE_LOADER_H_
+#define _TEXTURE_LOADER_H_
+
+#include "texture_cooker.h"
+#include "worker_pool.h"
+
+#include <glad/gl.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Loads image files into GL textures without stalling the render thread, and
+// keeps their GPU memory within a budget.
+//
+// load() returns the texture name at once, sampling as a grey 1x1 placeholder.
+// A worker reads the image's cooked mip chain from the cache directory, or
+// cooks it on first use (see texture_cooker.h), and update() streams levels
+// to the GPU through a pixel unpack buffer, a bounded number of rows per
+// frame. Only the coarse levels, up to kResidentSize texels across, are
+// loaded unconditionally. Finer levels follow requestDetail(), which draws
+// call with the size the texture covers on screen: a level is promoted when
+// it would be magnified otherwise and fits the budget, and levels nobody
+// asked for recently are evicted first when it does not. GL_TEXTURE_BASE_LEVEL
+// follows the finest complete level, so a half-uploaded or evicted level is
+// never sampled. Levels are BC1 compressed when the driver has S3TC.
+class TextureLoader {
+public:
+	// Levels at most this many texels across stay resident whatever the budget
+	static const uint32_t kResidentSize = 128;
+
+	// Frames without requestDetail() after which a texture's fine levels count as unused
+	static const uint64_t kUnusedFrames = 120;
+
+	// Without a pool, load() reads or cooks on the calling thread (uploads still stream).
+	// 'budgetBytes' bounds the level data kept on the GPU, 'bytesPerFrame' the data update() copies each frame.
+	void initialize(WorkerPool *pool, const char *cacheDirectory, size_t budgetBytes, size_t bytesPerFrame = 4 << 20);
+
+	// Trilinear once loaded. A file that fails to decode keeps the placeholder.
+	GLuint load(const char *path, GLenum wrapS, GLenum wrapT);
+
+	// A GL_TEXTURE_2D_ARRAY with one layer per file, streamed and budgeted as
+	// one texture. The images must all have the same size.
+	GLuint loadArray(const std::vector<std::string> &paths, GLenum wrapS, GLenum wrapT);
+
+	// Usage feedback from a draw: the texture's full width spans about
+	// 'screenPixels' pixels on screen (more than the width when it repeats).
+	// The largest request since the last update() decides the level wanted.
+	void requestDetail(GLuint texture, float screenPixels);
+
+	// Shrinking the budget evicts on the next update()
+	void setBudget(size_t budgetBytes);
+	size_t budget() const { return budgetBytes; }
+	size_t residentBytes() const { return residentTotal; }
+
+	// Render thread, once per frame
+	void update();
+
+	// Textures whose coarse levels are not in yet
+	size_t pendingCount() const;
+
+	// Waits for decodes still running, the textures themselves stay alive
+	void cleanup();
+
+private:
+	struct Entry {
+		std::string path;				// For messages, the first layer's for arrays
+		std::vector<std::string> layerPaths;
+		GLenum target = GL_TEXTURE_2D;
+		GLuint texture = 0;
+		std::chrono::steady_clock::time_point requested;
+
+		// Written by the worker before 'decoded' is set
+		std::atomic<bool> decoded{false};
+		bool valid = false;
+		bool cookedNow = false;			// Not in the cache yet, or stale
+		CookedTexture cooked;			// Kept in system memory for promotions after eviction; every layer of a level in a row
+		double decodeMilliseconds = 0.0;
+
+		int baseLevel = -1;				// Finest complete level, GL_TEXTURE_BASE_LEVEL; -1 before decoding
+		int residentLevel = 0;			// Finest level always kept, kResidentSize across
+		int uploadedRows = -1;			// Data rows of level baseLevel - 1 already sent; -1 while not allocated
+		int uploadFrames = 0;
+		uint64_t lastUploadFrame = 0;
+		uint64_t blockedFrame = 0;		// No room for the next level this frame
+		bool announced = false;			// Coarse levels are in
+
+		float screenPixels = 0.0f;		// Largest requestDetail() since the last update()
+		int wantedLevel = -1;			// From the last frame with feedback; -1 for none yet
+		uint64_t lastUsedFrame = 0;
+
+		int targetLevel(uint64_t frame) const;
+		int finestAllocatedLevel() const { return uploadedRows >= 0 ? baseLevel - 1 : baseLevel; }
+		size_t nextLevelBytes() const;
+	};
+
+	GLuint create(GLenum target, const std::vector<std::string> &paths, GLenum wrapS, GLenum wrapT);
+	static void decode(Entry &entry, const std::vector<std::string> &cachePaths, CookedFormat format, WorkerPool *pool);
+	bool uploadRows(Entry &entry, size_t &budget);
+	bool makeRoom(size_t bytes, const Entry *keep, bool evictWanted);
+	void evictLevel(Entry &entry);
+	void announce(Entry &entry);
+	void remove(size_t index);
+
+	WorkerPool *workerPool = nullptr;
+	std::string cacheDirectory;
+	CookedFormat format = COOKED_RGB8;
+	size_t budgetBytes = 0;
+	size_t uploadBytesPerFrame = 0;
+	GLuint unpackBufferID = 0;
+	std::vector<std::shared_ptr<Entry>> entries;
+	std::unordered_map<GLuint, Entry *> entryLookup;
+	uint64_t frame = 0;
+
+	// Level bytes allocated on the GPU, complete or in flight
+	size_t residentTotal = 0;
+	bool residencyChanged = false;
+
+	// For the summary printed when the last texture's coarse levels are in
+	int loadedCount = 0;
+	double decodeMilliseconds = 0.0;
+	size_t cookedBytes = 0;
+	size_t uncompressedBytes = 0;
+	std::chrono::steady_clock::time_point firstRequest;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(unsigned int threadCount)
+{
+	if (threadCount == 0) {
+		unsigned int hardware = std::thread::hardware_concurrency();
+		threadCount = hardware > 1 ? hardware - 1 : 1;
+	}
+
+	for (unsigned int i = 0; i < threadCount; i++) {
+		threads.emplace_back(&WorkerPool::workerLoop, this);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueCondition.notify_all();
+
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+}
+
+void WorkerPool::submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		tasks.push_back(std::move(task));
+	}
+	queueCondition.notify_one();
+}
+
+void WorkerPool::parallelFor(size_t count, size_t granularity,
+	const std::function<void(size_t, size_t, unsigned int)> &job)
+{
+	if (count == 0) return;
+	if (granularity == 0) granularity = 1;
+
+	unsigned int chunks = chunkCount();
+	size_t perChunk = (count + chunks - 1) / chunks;
+	perChunk = (perChunk + granularity - 1) / granularity * granularity;
+	chunks = (unsigned int)((count + perChunk - 1) / perChunk);
+
+	// Ranges are claimed, not assigned: the caller keeps taking them too, so it
+	// finishes on its own when every worker is busy, e.g. when called from a task.
+	// Helpers may start after the call returned, hence the shared state.
+	struct Shared {
+		std::atomic<unsigned int> next{0};
+		std::mutex doneMutex;
+		std::condition_variable doneCondition;
+		unsigned int finished = 0;
+	};
+	std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+	const std::function<void(size_t, size_t, unsigned int)> *jobPointer = &job;
+
+	auto runChunks = [shared, jobPointer, chunks, perChunk, count]() {
+		for (;;) {
+			unsigned int chunk = shared->next.fetch_add(1);
+			if (chunk >= chunks) return;
+			size_t begin = chunk * perChunk;
+			size_t end = begin + perChunk < count ? begin + perChunk : count;
+			(*jobPointer)(begin, end, chunk);
+
+			std::lock_guard<std::mutex> lock(shared->doneMutex);
+			if (++shared->finished == chunks) shared->doneCondition.notify_all();
+		}
+	};
+
+	for (unsigned int helper = 1; helper < chunks; helper++) {
+		submit(runChunks);
+	}
+	runChunks();
+
+	std::unique_lock<std::mutex> lock(shared->doneMutex);
+	shared->doneCondition.wait(lock, [&]() { return shared->finished == chunks; });
+}
+
+void WorkerPool::workerLoop()
+{
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueCondition.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (stopping && tasks.empty()) return;
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads fed from a single task queue.
+// No GL calls may be made from tasks, the context belongs to the render thread.
+class WorkerPool {
+public:
+	// threadCount == 0 uses one worker per hardware thread, minus the caller
+	explicit WorkerPool(unsigned int threadCount = 0);
+	~WorkerPool();
+
+	// Number of ranges parallelFor splits work into (workers + calling thread)
+	unsigned int chunkCount() const { return (unsigned int)threads.size() + 1; }
+
+	// Queue a fire-and-forget task
+	void submit(std::function<void()> task);
+
+	// Split [0, count) into chunkCount() contiguous ranges, each a multiple of
+	// 'granularity' except the last, and block until all of them are done.
+	// job(begin, end, chunk) runs once per range; chunk is stable per range so
+	// it can index per-chunk state such as random generators.
+	// The calling thread takes ranges as well, so this may be called from a task.
+	void parallelFor(size_t count, size_t granularity,
+		const std::function<void(size_t, size_t, unsigned int)> &job);
+
+private:
+	void workerLoop();
+
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> tasks;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stopping = false;
+};
+
+#endif
@@ -2,23 +2,20 @@
 
 
 in vec2 uv;
+flat in float layer;
 in vec3 worldNormal;
 in vec3 worldPosition;
 
-uniform sampler2D texture1;
+uniform sampler2DArray signTextures;
 
-// Sphere light uniforms
-uniform vec3 sphereLightPos;
-uniform vec3 sphereLightColor;
-uniform float sphereLightIntensity;
-
-uniform vec3 viewPos;
+// Lights and camera position
+#include "frame_data.glsl"
 
 out vec3 finalColor;
 
 void main() {
 
-    vec3 textureColor = texture(texture1, uv).rgb;
+    vec3 textureColor = texture(signTextures, vec3(uv, layer)).rgb;
     vec3 norm = normalize(worldNormal);
 
     vec3 lightDir = normalize(sphereLightPos - worldPosition);
@@ -26,7 +23,7 @@ void main() {
     float diff = max(dot(norm, lightDir), 0.0);
     vec3 diffuse = textureColor * sphereLightColor * diff * sphereLightIntensity;
 
-    vec3 viewDir = normalize(viewPos - worldPosition);
+    vec3 viewDir = normalize(cameraPosition - worldPosition);
     vec3 reflectDir = reflect(-lightDir, norm);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32.0); 
     vec3 specular = vec3(1.0) * spec * sphereLightColor * sphereLightIntensity;
@@ -3,21 +3,33 @@ layout(location = 0) in vec3 vertexPosition;
 layout(location = 1) in vec3 vertexNormal;
 layout(location = 2) in vec2 vertexUV;
 
+// One SignField instance (divisor 1)
+layout(location = 3) in vec4 instancePositionRotation;	// Rotation about Y in radians
+layout(location = 4) in vec4 instanceScaleLayer;		// Layer of the sign texture array
+layout(location = 5) in float instanceBobPhase;
+
 out vec2 uv;
+flat out float layer;
 out vec3 worldNormal;
 out vec3 worldPosition;
 
-uniform mat4 MVP;
-uniform mat4 model;
-uniform mat3 normalMatrix;
+uniform mat4 viewProjection;
+
+// time
+#include "frame_data.glsl"
 
 void main() {
-    worldPosition = (model * vec4(vertexPosition, 1.0)).xyz;
+    // Rotate about Y, then scale, then "bob" up and down
+    float s = sin(instancePositionRotation.w);
+    float c = cos(instancePositionRotation.w);
+    vec3 rotated = vec3(c * vertexPosition.x + s * vertexPosition.z, vertexPosition.y, c * vertexPosition.z - s * vertexPosition.x);
+    vec3 rotatedNormal = vec3(c * vertexNormal.x + s * vertexNormal.z, vertexNormal.y, c * vertexNormal.z - s * vertexNormal.x);
+    float oscillation = sin(time * 3.5 + instanceBobPhase) * 0.3;
 
-    //worldNormal = normalMatrix * vec3(0.0, 0.0, 1.0); // for a flat surface
-    worldNormal = normalMatrix * vertexNormal;
-    //worldNormal = normalMatrix;
-    uv = vertexUV; 
+    worldPosition = instancePositionRotation.xyz + rotated * instanceScaleLayer.xyz + vec3(0.0, oscillation, 0.0);
+    worldNormal = rotatedNormal / instanceScaleLayer.xyz;	// Inverse transpose of the scale and rotation
+    uv = vertexUV;
+    layer = instanceScaleLayer.w;
 
-    gl_Position = MVP * vec4(vertexPosition, 1.0);
+    gl_Position = viewProjection * vec4(worldPosition, 1.0);
 }
@@ -0,0 +1,75 @@
+// skin.vert
+// Skinning pre-pass, run with rasterization disabled. Each vertex is skinned
+// once per unique pose and captured with transform feedback; every later pass
+// of the frame draws the captured vertices with bot.vert.
+#version 330 core
+
+layout(location = 0) in vec3 vertexPosition;
+layout(location = 1) in vec3 vertexNormal;
+layout(location = 2) in vec2 vertexUV;
+#ifdef COMPACT_SKINNING
+// 4 x uint8 joints and 4 x unorm8 weights that sum to exactly one
+layout(location = 3) in uvec4 vertexJointIndices;
+layout(location = 4) in vec4 vertexJointWeights;
+#else
+// Source format of the file, weights not guaranteed to be normalized
+layout(location = 3) in vec4 vertexJointIndices;
+layout(location = 4) in vec4 vertexJointWeights;
+#endif
+
+out vec3 skinnedPosition;
+out vec3 skinnedNormal;
+out vec2 skinnedUV;
+
+// Joint palettes of every pose, four RGBA32F texels per matrix
+uniform samplerBuffer jointPalette;
+uniform int paletteOffset;      // First matrix of the pose and skin being skinned
+
+// Baked clips, one row per frame with the same layout as a palette
+uniform bool useBakedAnimation;
+uniform sampler2D bakedAnimation;
+uniform ivec2 bakedClip;        // First row, frame count
+uniform float bakedFrame;       // Position within the clip in frames
+
+mat4 bakedJointMatrix(int texel, int row) {
+    return mat4(texelFetch(bakedAnimation, ivec2(texel, row), 0),
+                texelFetch(bakedAnimation, ivec2(texel + 1, row), 0),
+                texelFetch(bakedAnimation, ivec2(texel + 2, row), 0),
+                texelFetch(bakedAnimation, ivec2(texel + 3, row), 0));
+}
+
+mat4 jointMatrix(int joint) {
+    int texel = (paletteOffset + joint) * 4;
+    if (useBakedAnimation) {
+        // Blend the two nearest frames, the last one wraps to the start of the clip
+        int frame = min(int(bakedFrame), bakedClip.y - 1);
+        float t = bakedFrame - float(frame);
+        mat4 a = bakedJointMatrix(texel, bakedClip.x + frame);
+        mat4 b = bakedJointMatrix(texel, bakedClip.x + (frame + 1) % bakedClip.y);
+        return a * (1.0 - t) + b * t;
+    }
+    return mat4(texelFetch(jointPalette, texel),
+                texelFetch(jointPalette, texel + 1),
+                texelFetch(jointPalette, texel + 2),
+                texelFetch(jointPalette, texel + 3));
+}
+
+void main() {
+#ifdef COMPACT_SKINNING
+    // Exactly four influences
+    mat4 skin = vertexJointWeights.x * jointMatrix(int(vertexJointIndices.x))
+              + vertexJointWeights.y * jointMatrix(int(vertexJointIndices.y))
+              + vertexJointWeights.z * jointMatrix(int(vertexJointIndices.z))
+              + vertexJointWeights.w * jointMatrix(int(vertexJointIndices.w));
+#else
+    mat4 skin = mat4(0.0);
+    for (int j = 0; j < 4; j++) {
+        skin += vertexJointWeights[j] * jointMatrix(int(vertexJointIndices[j]));
+    }
+    skin *= 1.0 / max(dot(vertexJointWeights, vec4(1.0)), 1e-6);
+#endif
+
+    skinnedPosition = (skin * vec4(vertexPosition, 1.0)).xyz;
+    skinnedNormal = normalize(mat3(skin) * vertexNormal);
+    skinnedUV = vertexUV;
+}